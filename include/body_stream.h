@@ -0,0 +1,102 @@
+#pragma once
+
+#include "utils.h"
+#include "word_filter.h"
+
+#include "zlib.h"
+
+#include <memory>
+
+/*
+ Pull-based pipeline for message bodies. A reply body is read from the target
+ server piece by piece through a chain of stages (decoding, filtering, caching)
+ and sent on to the client as the pieces arrive, so the client gets the first
+ bytes long before the last ones are downloaded and only a few pieces of each
+ body are held in memory at a time.
+*/
+class BodyStream {
+public:
+    virtual ~BodyStream() {}
+
+    /**
+     * Appends the next piece of the body to `out`. Returns the number of bytes
+     * appended, 0 at the end of the body and -1 on errors.
+     */
+    virtual ssize_t read(std::string &out) = 0;
+};
+
+// Decodes a gzip or deflate encoded body, inflating each piece on the worker pool
+class InflateBodyStream : public BodyStream {
+public:
+    InflateBodyStream(BodyStream *source, bool gzip);
+    ~InflateBodyStream();
+
+    ssize_t read(std::string &out);
+
+private:
+    BodyStream *source;
+    z_stream zs;
+    bool initialized;
+    bool finished;
+    std::string input;
+};
+
+// Compresses the body with gzip, deflating and flushing each piece on the worker pool
+class GzipBodyStream : public BodyStream {
+public:
+    explicit GzipBodyStream(BodyStream *source);
+    ~GzipBodyStream();
+
+    ssize_t read(std::string &out);
+
+private:
+    BodyStream *source;
+    z_stream zs;
+    bool initialized;
+    bool finished;
+    std::string input;
+};
+
+// Body held in memory, possibly shared with the in-memory cache
+class MemoryBodyStream : public BodyStream {
+public:
+    explicit MemoryBodyStream(const std::shared_ptr<const std::string> &body) : body(body), offset(0) {}
+
+    ssize_t read(std::string &out);
+
+private:
+    std::shared_ptr<const std::string> body;
+    size_t offset;
+};
+
+// Body read from a range of a file, the descriptor is closed with the stream
+class FileBodyStream : public BodyStream {
+public:
+    FileBodyStream(int fd, off_t offset, size_t length) : fd(fd), offset(offset), remaining(length) {}
+    ~FileBodyStream();
+
+    ssize_t read(std::string &out);
+
+private:
+    int fd;
+    off_t offset;
+    size_t remaining;
+};
+
+/**
+ * Replaces the filtered words in the body as it passes, each piece filtered on
+ * the worker pool. Words and tags may span pieces, so the last bytes of a
+ * piece that may still start a word are held back until the next one.
+ */
+class FilterBodyStream : public BodyStream {
+public:
+    explicit FilterBodyStream(BodyStream *source);
+    ~FilterBodyStream();
+
+    ssize_t read(std::string &out);
+
+private:
+    BodyStream *source;
+    WordFilterStream filter;
+    bool finished;
+};
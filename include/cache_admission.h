@@ -0,0 +1,57 @@
+#pragma once
+
+#include "utils.h"
+
+#include <stdint.h>
+
+/*
+ Admission policy of the cache (TinyLFU). Every request is counted in a small
+ frequency sketch, and a reply only takes the place of others in the memory
+ tier if it was asked for at least as often as they were, and only goes to
+ disk once it was asked for more than once. One-off requests thus neither push
+ popular replies out of memory nor fill the disk.
+*/
+
+/*
+ Count-min sketch: every key bumps one saturating 4-bit counter in each of
+ four rows and its estimate is the smallest of them, which overestimates only
+ when all four collide. Counters are halved once the number of increments
+ reaches ten times the width, so old popularity fades away.
+
+ Two counters share a byte, and all threads update the bytes without a lock
+ by compare-and-swap; an increment racing with the halving may be lost,
+ which a sketch can afford.
+*/
+class FrequencySketch {
+public:
+    explicit FrequencySketch(size_t expected_keys);
+
+    void increment(uint64_t key_hash);
+    int estimate(uint64_t key_hash) const;
+
+private:
+    static const int ROWS = 4;
+    static const uint8_t MAX_COUNT = 15;
+
+    size_t slot(int row, uint64_t key_hash) const;
+    void age();
+
+    std::vector<uint8_t> counters;      // ROWS rows of `width` counters, two per byte
+    size_t width;                       // a power of two
+    size_t increments;                  // updated atomically
+};
+
+// Sizes the sketch for about this many distinct cached replies, before any request is served
+void configure_cache_admission(size_t expected_entries);
+
+// Counts a client request for the URL
+void record_cache_request(const std::string &url);
+
+// Estimated number of recent requests for the URL
+int cache_request_frequency(const std::string &url);
+
+// The same for the URL with this index key, see cache_url_hash()
+int cache_hash_request_frequency(uint64_t url_hash);
+
+// Whether the reply is asked for often enough to be written to disk
+bool admit_to_disk_cache(const std::string &url);
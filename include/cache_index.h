@@ -0,0 +1,90 @@
+#pragma once
+
+#include "utils.h"
+
+#include <stdint.h>
+
+/*
+ Index of the cached replies, kept in the file "index" of the cache directory
+ and mapped into memory, so it survives restarts and is ready as soon as it is
+ mapped, whatever its size. It is an open addressing hash table with linear
+ probing, keyed by a 64-bit hash of the URL. A second hash of the URL, by
+ another function, is kept in the entry and checked by the lookups, so URLs
+ whose keys collide don't get each other's replies. The table is rebuilt with
+ twice as many slots when it gets three quarters full.
+
+ Every entry locates a reply in the segment files of the cache store, see
+ cache_store.h: its head, and its body, which is stored once for all the
+ entries whose bodies have the same bytes. The index keeps in memory how many
+ entries point to each body, counted again when it is mapped.
+*/
+
+struct CacheIndexEntry {
+    uint32_t segment;
+    uint64_t offset;            // of the head within the segment
+    uint32_t head_length;
+    uint32_t body_segment;
+    uint64_t body_offset;
+    uint64_t body_length;
+    uint64_t body_hash;         // of the body bytes, 0 for an empty body
+    time_t stored_at;
+    time_t last_access;
+    time_t expires_at;          // the reply is stale from then on
+};
+
+// An entry along with the hash of its URL, for walking the index
+struct CacheIndexRecord {
+    uint64_t url_hash;
+    CacheIndexEntry entry;
+};
+
+// Key of the URL in the index (FNV-1a), never 0
+uint64_t cache_url_hash(const std::string &url);
+
+/**
+ * Maps the index of the cache directory, which is created if needed. An index
+ * that is missing or unreadable is replaced by an empty one. Dies if the
+ * directory can't be used.
+ */
+void open_cache_index(const std::string &directory);
+
+// Finds the entry of the URL and updates its last access time, false if there is none
+bool cache_index_lookup(const std::string &url, CacheIndexEntry &entry);
+
+/**
+ * Adds or replaces the entry of the URL. With shared_body, its body is one
+ * found by cache_index_find_body(), and the entry is only added if that body
+ * is still in the same place. Returns whether it was added.
+ */
+bool cache_index_store(const std::string &url, const CacheIndexEntry &entry, bool shared_body=false);
+
+// Finds a stored body with this hash and length, which may still have other bytes
+bool cache_index_find_body(uint64_t body_hash, uint64_t body_length, uint32_t &segment, uint64_t &offset);
+
+// Number of entries pointing to the body of the entry
+size_t cache_index_body_references(const CacheIndexEntry &entry);
+
+// Sets the time at which the entry of the URL becomes stale, after a revalidation
+void cache_index_refresh(const std::string &url, time_t expires_at);
+
+// Removes the entry of the URL if its head is still at this place of the segment
+void cache_index_remove(const std::string &url, uint32_t segment, uint64_t offset);
+
+// Removes the listed entry unless it was replaced or moved meanwhile, returns whether it did
+bool cache_index_remove_record(const CacheIndexRecord &record);
+
+// Number of entries in the index
+size_t cache_index_size();
+
+// Returns a segment number never handed out before, it is kept in the index across restarts
+uint32_t cache_index_allocate_segment();
+
+// Collects the entries whose head or body is in the segment, or all entries if `segment` is 0
+void cache_index_list_entries(uint32_t segment, std::vector<CacheIndexRecord> &records);
+
+/**
+ * Points the entry to the new places of its head and body, if they are still
+ * the ones at the old places. Returns false if it was replaced or removed meanwhile.
+ */
+bool cache_index_move(const CacheIndexRecord &record, uint32_t segment, uint64_t offset, uint32_t body_segment,
+                      uint64_t body_offset);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "utils.h"
+
+#include <stdint.h>
+
+/*
+ Keeps the cache directory within its quota. A background thread checks the
+ bytes of the segment files and the number of cached replies; past either
+ limit it evicts replies until both are back under nine tenths of it, then
+ compacts the segments they were evicted from. Request threads never wait for
+ it beyond the short index updates.
+
+ Replies are evicted by Greedy-Dual-Size-Frequency: each gets the priority
+ L + frequency / size, with the request frequency of the admission sketch and
+ L the priority of the last evicted reply as it was when the reply was last
+ stored or hit, and the lowest priorities go first. L only grows, so small
+ popular replies stay, while replies not asked for since earlier rounds go
+ before those hit after them.
+*/
+
+/**
+ * Starts the janitor thread. It also removes the files of the cache
+ * directory that don't belong to the store.
+ */
+void start_cache_janitor(uint64_t max_bytes, size_t max_entries);
+
+// Runs one round against the given quota, returns the number of replies evicted
+size_t run_cache_janitor(uint64_t max_bytes, size_t max_entries);
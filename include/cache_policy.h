@@ -0,0 +1,55 @@
+#pragma once
+
+#include "utils.h"
+#include "http_utils.h"
+
+/*
+ HTTP caching rules of a shared cache (RFC 7234): which target server replies
+ may be stored, how long they stay fresh, and how a stale one is revalidated.
+*/
+
+// Parses an HTTP-date in any of its three formats, -1 if it is not one
+time_t parse_http_date(const std::string &value);
+
+/**
+ * Whether the reply to a request of this method may be stored: a GET, a
+ * status that can be cached, no "no-store" or "private", and either a
+ * freshness lifetime or a validator to revalidate it with once stale.
+ */
+bool is_response_cacheable(const std::string &method, const HttpHeader &header, time_t response_time);
+
+/**
+ * Time at which the reply received at response_time becomes stale. The
+ * lifetime comes from s-maxage, max-age or Expires, or else is a tenth of the
+ * time since Last-Modified; the age the reply already had (Date, Age) is
+ * subtracted. "no-cache" makes it stale right away.
+ */
+time_t response_expiry_time(const HttpHeader &header, time_t response_time);
+
+/**
+ * Time until which the reply that went stale at expires_at may still be
+ * served, from its "stale-while-revalidate" or "stale-if-error" directive
+ * (RFC 5861), else default_seconds after expires_at. "must-revalidate",
+ * "proxy-revalidate" and "no-cache" rule stale serving out.
+ */
+time_t stale_serving_limit(const HttpHeader &header, time_t expires_at, const std::string &directive,
+                           long default_seconds);
+
+/**
+ * Makes the request conditional on the validators of the cached reply
+ * (If-None-Match, If-Modified-Since). A tag from gzip_etag() is sent along
+ * with the target server's own. Returns false if there are none.
+ */
+bool add_revalidation_headers(const HttpHeader &cached, HttpHeader &request);
+
+/**
+ * Updates the cached reply with the headers of a "304 Not Modified" reply to
+ * the revalidation. A cached tag from gzip_etag() of the confirmed one stays.
+ */
+void merge_not_modified_headers(HttpHeader &cached, const HttpHeader &not_modified);
+
+// ETag of the proxy's gzip encoding of a reply tagged etag: "abc" -> "abc-gzip"
+std::string gzip_etag(const std::string &etag);
+
+// Reverse of gzip_etag(), the trimmed tag itself if it doesn't end in "-gzip"
+std::string identity_etag(const std::string &etag);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "utils.h"
+#include "cache_index.h"
+
+/*
+ Log-structured storage of the cached replies. Replies are appended to large
+ segment files ("segment-N" in the cache directory) and located through the
+ cache index by segment and offset, so there is no file per reply. A segment
+ is written by one writer at a time and taken out of the pool of writable
+ segments once it reaches the segment size. Replaced or removed replies leave
+ garbage behind; a background thread copies the live replies out of segments
+ that are mostly garbage and deletes those segments.
+
+ Bodies are stored by their content: a body whose bytes are already in the
+ store, such as one served under several URLs, isn't written again, the new
+ entry points to the stored one. Lookups go by a hash of the bytes, and the
+ bytes themselves are compared before a body is shared.
+*/
+
+/**
+ * Opens the store in the cache directory, whose index must already be open,
+ * and starts the compaction thread.
+ */
+void start_cache_store(const std::string &directory, size_t segment_size);
+
+/**
+ * Returns a new descriptor of the segment file for reading, to be closed by
+ * the caller, -1 if the segment doesn't exist. It stays readable even if the
+ * segment is compacted away meanwhile.
+ */
+int open_cache_segment(uint32_t segment);
+
+/*
+ Appends one reply to a writable segment, which is held until the reply is
+ finished or aborted: its body, then its head. Nothing written is visible until
+ the caller adds the reply to the index.
+*/
+class CacheSegmentWriter {
+public:
+    CacheSegmentWriter();
+    ~CacheSegmentWriter();          // aborts an unfinished reply
+
+    bool is_open() const { return segment != NULL; }
+    bool append(const char *data, size_t length);
+
+    /**
+     * Ends the body and tells where it is in `entry`. If the store already
+     * holds the same bytes, those written are dropped and `shared` is set:
+     * the entry points to the stored body then.
+     */
+    bool finish_body(CacheIndexEntry &entry, bool &shared);
+
+    // Ends the reply and tells where the part after the body starts, the segment goes back to the pool
+    bool finish(uint32_t &segment_number, uint64_t &offset);
+
+    // Drops the bytes written so far
+    void abort();
+
+private:
+    CacheSegmentWriter(const CacheSegmentWriter &);
+    CacheSegmentWriter& operator=(const CacheSegmentWriter &);
+
+    struct WritableSegment *segment;
+    uint64_t start_offset;
+    uint64_t length;
+    uint64_t body_length;       // bytes of the body, before the rest of the reply
+    bool body_finished;
+    uint32_t body_crc;          // hash of the body so far, in two halves
+    uint32_t body_adler;
+};
+
+// A segment is compacted once less than this share of its bytes is live
+const int CACHE_COMPACTION_LIVE_PERCENT = 50;
+
+/**
+ * Runs one compaction round over the segments that aren't being written,
+ * compacting those with less than live_percent of their bytes live.
+ */
+void compact_cache_segments(int live_percent=CACHE_COMPACTION_LIVE_PERCENT);
+
+// Bytes taken by the segment files
+uint64_t cache_store_disk_usage();
+
+/**
+ * Deletes the files of the cache directory that are neither the index nor a
+ * segment, such as the file per reply of older versions. Returns how many.
+ */
+size_t remove_orphaned_cache_files();
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "utils.h"
+
+/*
+ Stub DNS resolver talking to the configured nameserver over UDP, replacing
+ the blocking and non-reentrant gethostbyname(). A and AAAA queries for a name
+ are sent at once and awaited with poll() on non-blocking sockets. Answers are
+ kept in a sharded in-process cache for the TTL of the records, failed lookups
+ (NXDOMAIN, no records) for the negative TTL advertised by the zone.
+ Concurrent misses for one name share a single query. A truncated reply is
+ asked again over TCP, and the lookup fails rather than keep a partial answer.
+*/
+
+struct IpAddress {
+    int family;                 // AF_INET or AF_INET6
+    unsigned char bytes[16];    // 4 or 16 bytes of the address in network order
+
+    std::string to_string() const;
+};
+
+/**
+ * Sets the nameserver ("IP" or "IP:PORT", IPv6 addresses in brackets) and the
+ * query timeout. Without an explicit nameserver the first one from
+ * /etc/resolv.conf is used, 127.0.0.1 if there is none.
+ */
+void configure_dns_resolver(const std::string &nameserver, int timeout_ms=2000, int attempts=2);
+
+/**
+ * Resolves the hostname to all of its IPv4 and IPv6 addresses (IPv4 first).
+ * IP literals and names from /etc/hosts are answered without a query.
+ * Returns false if the name does not resolve.
+ */
+bool resolve_hostname(const std::string &hostname, std::vector<IpAddress> &addresses);
+
+// Drops all cached answers
+void clear_dns_cache();
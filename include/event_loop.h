@@ -0,0 +1,17 @@
+#pragma once
+
+#include "utils.h"
+
+/**
+ * Runs the server in epoll mode and never returns. A fixed number of event
+ * loop threads accept clients and drive every connection as a non-blocking
+ * state machine (read request -> process -> write reply), while complete
+ * requests are handed to a fixed pool of handler threads which may block on
+ * the target server. Idle and slow clients only cost a few hundred bytes of
+ * connection state, not a thread.
+ *
+ * Loop i accepts from listening_sockets[i % count]; with one SO_REUSEPORT
+ * socket per loop the kernel balances new connections between the loops,
+ * which are then pinned to their own cores.
+ */
+void run_event_loop_server(const std::vector<int> &listening_sockets, const ParsedArguments &arguments);
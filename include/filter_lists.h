@@ -0,0 +1,39 @@
+#pragma once
+
+#include "utils.h"
+#include "word_filter.h"
+
+/*
+ The blocklist and the filtered words, read from their files at startup and
+ again whenever one of the files is written or replaced (inotify), or the
+ server gets SIGHUP. Edits take effect right away, and requests never touch
+ the files.
+
+ A reload builds the new lists off to the side and publishes them by swapping
+ one pointer, so readers take no lock (RCU): they only count themselves in
+ the readers of the current epoch while they look at the lists. The reload
+ starts a new epoch and frees the old lists once no reader of the previous
+ epoch is left. A body being filtered holds its own reference to the word
+ filter it started with.
+*/
+
+/**
+ * Reads both lists and remembers their files for the reloads. A file that
+ * can't be read counts as an empty list.
+ */
+void load_filter_lists(const std::string &blocklist_filename, const std::string &words_filename);
+
+// Starts the thread reloading the lists when their files change or on SIGHUP
+void start_filter_lists_reloader();
+
+// Reads both files again and publishes the new lists, false if one can't be read and the old lists stay
+bool reload_filter_lists();
+
+// Whether the host or one of its parent domains is blocked, see HostBlocklist
+bool is_host_blocked(const std::string &hostname);
+
+// The word filter in use, which stays valid for as long as the caller holds it
+std::shared_ptr<const WordFilter> current_word_filter();
+
+// Replaces the filtered words in the whole text
+std::string filter_words(const std::string &str);
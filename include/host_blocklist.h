@@ -0,0 +1,48 @@
+#pragma once
+
+#include "utils.h"
+
+#include <stdint.h>
+#include <unordered_map>
+
+/*
+ The blocked hosts as a trie of their labels, read from the top-level domain
+ down: "www.google.com" is the path com -> google -> www. A rule blocks the
+ host it names and all of its subdomains, "*.google.com" only the subdomains.
+ A lookup follows the labels of the host from the right and stops at the
+ first rule on the way, so it takes one step per label however many rules
+ there are.
+
+ Labels are interned, each distinct one stored once, and an edge of the trie
+ is a hash table entry keyed by its parent node and label; millions of rules
+ sharing a few top-level domains thus take little more than their edges.
+*/
+class HostBlocklist {
+public:
+    HostBlocklist();
+
+    // Adds a rule, "example.com" or "*.example.com", false if it names no host
+    bool add(const std::string &rule);
+
+    // Whether the host, which may carry a port, or one of its parent domains is blocked
+    bool blocks(const std::string &host) const;
+
+    size_t rule_count() const { return rules; }
+
+private:
+    enum NodeFlags {
+        BLOCKS_HOST = 1,            // the host of the node and its subdomains
+        BLOCKS_SUBDOMAINS = 2,      // only the subdomains, by a "*." rule
+    };
+
+    // The node below `parent` by the label, 0 if none (the root is never a child)
+    uint32_t child(uint32_t parent, const std::string &label) const;
+
+    std::unordered_map<std::string, uint32_t> label_ids;
+    std::unordered_map<uint64_t, uint32_t> children;    // (parent << 32 | label id) -> node
+    std::vector<uint8_t> node_flags;                    // by node number, the root is 0
+    size_t rules;
+};
+
+// The host name of a Host header or URL authority: lowercase, without port or trailing dot
+std::string normalize_host(const std::string &host);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+/*
+ Incremental HTTP/1.x head parser. It is fed the bytes received so far and
+ picks up where it stopped on the previous call, so no byte is scanned twice
+ however the head is split across reads. Parsing allocates nothing: the
+ results are offsets into the receive buffer, turned into HttpSlice views with
+ slice(). Offsets rather than pointers are kept because the buffer may be
+ moved as it grows.
+
+ Lines may end with CRLF or a bare LF, stray CRs at the end of a line are
+ ignored. Folded header lines are rejected.
+*/
+
+const size_t HTTP_PARSER_MAX_HEADERS = 128;
+
+// View of bytes in the receive buffer, valid as long as the buffer is unchanged
+struct HttpSlice {
+    const char *data;
+    size_t size;
+
+    std::string to_string() const { return std::string(data, size); }
+    bool equals(const char *str) const;
+    bool equals_ignore_case(const char *str) const;
+};
+
+struct HttpSpan {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct HttpParser {
+    enum Result {
+        INCOMPLETE,     // feed more bytes
+        COMPLETE,       // the head ends at head_length
+        INVALID
+    };
+
+    HttpParser() { reset(); }
+
+    // Prepares for the next message
+    void reset();
+
+    /**
+     * Continues parsing `buffer`, which holds all bytes of the message received
+     * so far, starting with its first byte. Heads longer than max_head_length
+     * are INVALID.
+     */
+    Result parse(const char *buffer, size_t length, size_t max_head_length=65536);
+
+    HttpSlice slice(const char *buffer, const HttpSpan &span) const
+    {
+        HttpSlice result = { buffer + span.offset, span.length };
+        return result;
+    }
+
+    // Value of the first header with this name (case-insensitive), false if there is none
+    bool find_header(const char *buffer, const char *name, HttpSlice &value) const;
+
+    // Results, valid once parse() returned COMPLETE
+    bool is_response;
+    HttpSpan method;        // requests
+    HttpSpan target;
+    HttpSpan version;
+    int status_code;        // responses
+    HttpSpan reason;
+    HttpSpan header_names[HTTP_PARSER_MAX_HEADERS];
+    HttpSpan header_values[HTTP_PARSER_MAX_HEADERS];
+    size_t header_count;
+    size_t head_length;     // including the empty line ending the head
+
+private:
+    bool parse_start_line(const char *line, size_t offset, size_t length);
+    bool parse_header_line(const char *line, size_t offset, size_t length);
+
+    size_t line_start;      // offset of the line being parsed
+    size_t scan_offset;     // bytes already searched for the end of that line
+    bool start_line_done;
+    Result result;
+};
@@ -2,6 +2,20 @@
 #pragma once
 
 #include "utils.h"
+#include "body_stream.h"
+#include "http_parser.h"
+
+#include <strings.h>
+
+// Header names are case-insensitive, "Content-Type" also finds "content-type"
+struct CaseInsensitiveLess {
+    bool operator()(const std::string &a, const std::string &b) const
+    {
+        return strcasecmp(a.c_str(), b.c_str()) < 0;
+    }
+};
+
+typedef std::map<std::string, std::string, CaseInsensitiveLess> HeaderMap;
 
 struct HttpHeader {
     enum Type {
@@ -13,7 +27,7 @@ struct HttpHeader {
 	std::string status;
 	std::string protocol;
 	std::string path;
-	std::map<std::string, std::string> headers;
+	HeaderMap headers;
 };
 
 struct HttpMessage {
@@ -21,11 +35,93 @@ struct HttpMessage {
 	std::string body;
 
 	std::string to_string() const;
+	std::string header_to_string() const;	// start line and headers up to the empty line
 	std::string to_log_string() const;
 
 	std::string get_request_url() const;
 };
 
-HttpMessage* read_http_message_from_socket(int socket_descriptor);
+/*
+ Buffered reading of HTTP messages from a socket. Bytes received past the end
+ of a message stay in the buffer, so the next message on a persistent
+ connection can be read with the same reader.
+*/
+struct SocketReader {
+	int socket_fd;
+	std::string buffer;
+	int timeout_ms;		// receive timeout, 0 waits forever
+	bool closed;		// the peer closed the connection
+
+	explicit SocketReader(int fd, int timeout=0) : socket_fd(fd), timeout_ms(timeout), closed(false) {}
+};
+
+// Reads the start line and headers of the next message, the body is left in the reader
+HttpMessage* read_http_message_header(SocketReader &reader);
+
+/*
+ Body of a message whose header was read with read_http_message_header(),
+ received piece by piece as delimited by its framing (Content-Length, chunked
+ transfer coding or the end of the connection). Chunks are decoded, but any
+ Content-Encoding is left as it is.
+*/
+class MessageBodyStream : public BodyStream {
+public:
+    // Pass expect_body=false for responses to HEAD requests
+    MessageBodyStream(SocketReader &reader, const HttpHeader &header, bool expect_body=true);
+
+    ssize_t read(std::string &out);
+
+    // Whether the body length is known upfront, i.e. Content-Length can be passed on
+    bool has_length() const;
+
+    // Before reading: whether there is any body at all
+    bool has_body() const;
+
+    // Once the body was read: another message may follow on the connection
+    bool is_reusable() const;
+
+private:
+    ssize_t read_remaining(std::string &out);
+
+    enum Framing {
+        NO_BODY,
+        LENGTH,
+        CHUNKED,
+        UNTIL_CLOSED
+    } framing;
+    SocketReader &reader;
+    size_t remaining;       // bytes left of the body or the current chunk
+    bool in_chunk;
+    bool finished;
+    bool keep_alive;
+};
+
+/**
+ * Reads one message, including a chunked or compressed body, which is decoded.
+ * `reusable` is set when the message was delimited by its framing and neither
+ * side asked to close the connection, i.e. another message may follow. Pass
+ * expect_body=false for responses to HEAD requests.
+ */
+HttpMessage* read_http_message(SocketReader &reader, bool *reusable=NULL, bool expect_body=true);
+
+bool is_keep_alive(const HttpHeader &header);
+
+// Whether the request's Accept-Encoding allows the content coding, e.g. "gzip"
+bool accepts_encoding(const HttpHeader &request, const std::string &coding);
+
+/**
+ * Tries to extract one complete HTTP request from the beginning of the buffer,
+ * for callers doing their own non-blocking reads. The parser keeps its progress
+ * between calls, so only newly appended bytes are scanned; it must be reset if
+ * the buffer is discarded. On success the consumed bytes are erased from the
+ * buffer. Returns NULL if more data is needed; `malformed` is set when the
+ * buffered bytes can never become a valid request.
+ */
+HttpMessage* parse_http_request_from_buffer(std::string &buffer, HttpParser &parser, bool &malformed);
+
+// Parses a head held in a string, such as a cached one. Returns false if it is malformed.
+bool parse_http_header(const std::string &head, HttpHeader &header);
+
+void rewrite_path_using_referer(HttpMessage *message);
 
 HttpMessage* make_http_response(const std::string &code);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "utils.h"
+
+/*
+ Blocking I/O primitives used by the socket helpers. They are served either
+ by plain system calls or by io_uring, where every thread owns a small ring
+ and linked operations (e.g. a receive and its timeout) are submitted
+ together with a single io_uring_enter() call.
+*/
+
+/**
+ * Selects the I/O backend: "syscalls" or "io_uring". Returns false, leaving the
+ * syscall backend in place, if the kernel does not support io_uring or one of
+ * the operations it is used for.
+ */
+bool set_io_backend(const std::string &name);
+
+int io_accept(int listening_socket, struct sockaddr *address, socklen_t *address_length);
+
+/**
+ * Same contract as recv(2); pass MSG_WAITALL to fill the whole buffer in one
+ * operation. With a positive timeout_ms, fails with EAGAIN if nothing arrives
+ * within that time.
+ */
+ssize_t io_recv(int socket_fd, void *buffer, size_t length, int flags=0, int timeout_ms=0);
+
+// Sends the whole buffer, returns -1 on error
+int io_send_all(int socket_fd, const char *data, size_t length);
+
+/**
+ * Sends all the buffers as one gathered write, returns -1 on error. The iovec
+ * array is advanced past the sent bytes. MSG_MORE tells the kernel that more
+ * data follows immediately, e.g. a body sent with io_sendfile_all().
+ */
+int io_send_buffers_all(int socket_fd, struct iovec *buffers, int count, int flags=0);
+
+/**
+ * Sends `length` bytes of the file starting at `offset` without copying them
+ * through user space. Always a plain sendfile(), io_uring has no equivalent.
+ */
+int io_sendfile_all(int socket_fd, int file_fd, off_t offset, size_t length);
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "utils.h"
+
+#include <memory>
+
+/*
+ In-memory tier of the response cache, consulted before the cache files.
+ Replies are kept in shards, each with its own lock and LRU list, and the
+ byte budget is split evenly between the shards. A reply that doesn't fit in
+ a fraction of its shard's budget is left to the disk cache alone. A new reply
+ only evicts least recently used ones that were asked for at most as often,
+ see cache_admission.h.
+*/
+
+// A reply held in memory, the body is shared by all clients it is sent to
+struct MemoryCachedReply {
+    std::string head;
+    std::shared_ptr<const std::string> body;
+    time_t expires_at;      // the reply is stale from then on
+    bool on_disk;           // also in the disk cache, or only held here
+
+    MemoryCachedReply() : expires_at(0), on_disk(false) {}
+};
+
+// A reply pushed out of memory, for the caller to demote to disk
+struct EvictedReply {
+    std::string url;
+    MemoryCachedReply reply;
+};
+
+// Sets the byte budget of the whole tier, 0 disables it
+void configure_memory_cache(size_t budget_bytes);
+
+// Largest body the tier accepts
+size_t memory_cache_max_body_size();
+
+// Finds the reply and marks it most recently used, false if it isn't held
+bool memory_cache_lookup(const std::string &url, MemoryCachedReply &reply);
+
+/**
+ * Stores the reply, unless its body is too large, and evicts the least
+ * recently used replies of the shard until it fits the budget again. The
+ * reply isn't stored if one of them was asked for more often; a former reply
+ * for the URL is dropped all the same. Evicted replies are appended to
+ * `evicted` if given. Returns whether the reply was stored.
+ */
+bool memory_cache_store(const std::string &url, const MemoryCachedReply &reply, std::vector<EvictedReply> *evicted=NULL);
+
+// Replaces the head and expiry time of the held reply after a revalidation
+void memory_cache_refresh(const std::string &url, const std::string &head, time_t expires_at);
+
+// Drops all held replies
+void clear_memory_cache();
@@ -1,8 +1,63 @@
 #pragma once
 
+#include "utils.h"
+#include "http_utils.h"
+#include "memory_cache.h"
+
 /**
- * This function is called in separate thread for each client request and
- * processes the request.
+ * This function is called in separate thread for each client connection and
+ * processes its requests until the client or the keep-alive limits close it.
  */
 void* handle_client_connection(void* arg);
 
+/*
+ Reply to a client request, split into head and body so the Connection header
+ can be set per client without touching the body. The body is either held in
+ memory (possibly shared with the in-memory cache), read from an open cache
+ file (sent with sendfile()), or streamed from the target server as it arrives.
+*/
+struct ClientResponse {
+    std::string head;       // status line and headers, including the empty line
+    std::string body;       // used when there is neither body_fd, shared_body nor body_stream
+    std::shared_ptr<const std::string> shared_body;     // body held by the in-memory cache
+    int body_fd;            // cache file holding the body, closed with the response
+    off_t body_offset;
+    size_t body_length;
+    BodyStream *body_stream;    // body still to be read, deleted with the response
+    bool chunked;               // the streamed body is sent with chunked transfer coding
+    bool close_delimited;       // the streamed body ends when the connection is closed
+
+    ClientResponse() : body_fd(-1), body_offset(0), body_length(0), body_stream(NULL),
+                       chunked(false), close_delimited(false) {}
+    ~ClientResponse();
+
+    size_t size() const;    // bytes to send in total, only the head for streamed bodies
+
+    // The body to send from memory, when there is no body_fd and no body_stream
+    const std::string& memory_body() const { return shared_body ? *shared_body : body; }
+
+private:
+    ClientResponse(const ClientResponse &);
+    ClientResponse& operator=(const ClientResponse &);
+};
+
+/**
+ * Produces the reply for a single client request: serves it from the cache or
+ * fetches it from the target server, filtering and caching the result.
+ * Blocks on the target server, so it must not run on an event loop thread.
+ * The reply has no Connection header, see set_connection_header().
+ */
+ClientResponse* process_client_request(const HttpMessage &http_message, const HostInfo &client_info);
+
+/**
+ * Adds "Connection: keep-alive" or "Connection: close" to the reply. Returns
+ * whether the connection can be kept open, which a body delimited by closing
+ * the connection rules out.
+ */
+bool set_connection_header(ClientResponse &response, bool keep_alive);
+
+// Line introducing a chunk of `length` bytes in chunked transfer coding
+std::string chunk_size_line(size_t length);
+
+// Sends the whole reply over a blocking socket, returns -1 on error
+int send_client_response(int socket_fd, const ClientResponse &response);
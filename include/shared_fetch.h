@@ -0,0 +1,63 @@
+#pragma once
+
+#include "utils.h"
+#include "http_utils.h"
+#include "body_stream.h"
+
+#include <memory>
+#include <stdint.h>
+
+/*
+ Single-flight fetches of cache misses. The first request to miss a URL leads
+ the fetch from the target server; requests for the same URL arriving
+ meanwhile follow it instead of sending their own, and get the same reply,
+ its body streamed to each of them as it arrives. Only a reply that may be
+ cached is shared: when the leader gives up or gets anything else, its
+ followers go on by themselves.
+
+ The leader and the followers read the body at their own pace, whoever needs
+ the next piece reads it from the target server for all of them. It stays in
+ memory until every one read it. Once more than a few megabytes came through,
+ no one joins any more and the bytes everyone read are dropped; at most that
+ much is held for the slowest reader, reading on waits for it to catch up and
+ detaches it if it doesn't in time, its client gets an incomplete body.
+*/
+
+struct SharedFetchState;
+
+// How long reading on waits for a reader holding a full buffer back before it is detached
+void configure_shared_fetch(int follower_timeout_ms);
+
+class SharedFetch {
+public:
+    SharedFetch() : leader(false), reader_id(0), reader_handed_over(false) {}
+    ~SharedFetch();     // a leader that published nothing lets its followers go
+
+    // Joins the fetch of the URL in progress, or starts one led by the caller. Returns whether the caller leads it.
+    bool join(const std::string &url);
+
+    bool is_leader() const { return leader; }
+
+    /**
+     * Leader: shares the reply, whose header must be final apart from the
+     * Connection header and the framing of a body of unknown length. The
+     * leader reads the body through the returned stream, which replaces and
+     * owns `body`. Others than the leader get `body` back unchanged.
+     */
+    BodyStream* publish(const HttpHeader &header, bool length_known, BodyStream *body);
+
+    /**
+     * Follower: waits for the reply of the leader. `body` is NULL for a reply
+     * without one. Returns false if the leader didn't share its reply.
+     */
+    bool wait(HttpHeader &header, bool &length_known, BodyStream *&body);
+
+private:
+    SharedFetch(const SharedFetch &);
+    SharedFetch& operator=(const SharedFetch &);
+
+    std::shared_ptr<SharedFetchState> state;
+    bool leader;
+    uint64_t reader_id;         // its reader of the shared body
+    bool reader_handed_over;    // to the body stream returned by wait()
+};
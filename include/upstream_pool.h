@@ -0,0 +1,28 @@
+#pragma once
+
+#include "utils.h"
+
+/*
+ Pool of idle persistent HTTP/1.1 connections to target servers, keyed by
+ origin (host:port). Requests to an origin that was recently talked to reuse
+ an idle connection and skip the DNS lookup and the TCP handshake.
+*/
+
+/**
+ * Sets the pool limits and starts the thread closing connections that stayed
+ * idle for longer than idle_timeout_seconds.
+ */
+void start_upstream_pool(int max_idle, int max_idle_per_host, int idle_timeout_seconds);
+
+/**
+ * Returns a connection to host:port - an idle pooled one if there is any, a new
+ * one otherwise (-1 if it can't be established). `reused` tells which, as a
+ * reused connection may turn out to have been closed by the server meanwhile.
+ */
+int acquire_upstream_connection(const std::string &host, int port, bool &reused);
+
+/**
+ * Hands a connection back after a complete request/response exchange. It is
+ * closed instead if the pool limits are reached.
+ */
+void release_upstream_connection(const std::string &host, int port, int socket_fd);
@@ -35,6 +35,31 @@ struct ParsedArguments
     std::string sites_blocklist_filename;
     std::string filter_words_list_filename;
     std::string cache_directory_path;
+
+    // Optional settings, passed as --name=value after the positional arguments
+    std::string server_mode;    // "threads" (thread per client) or "epoll"
+    int event_threads;          // epoll mode: number of event loop threads
+    int handler_threads;        // epoll mode: threads processing complete requests
+    int worker_threads;         // CPU worker pool size
+    int worker_queue_depth;     // tasks allowed to wait for a CPU worker
+    int listeners;              // SO_REUSEPORT listening sockets, each with its own accept loop
+    int listen_backlog;
+    int defer_accept_seconds;   // TCP_DEFER_ACCEPT timeout, 0 to disable
+    std::string io_backend;     // "syscalls" or "io_uring"
+    int upstream_max_idle;      // limits of the pool of persistent target server connections
+    int upstream_max_idle_per_host;
+    int upstream_idle_timeout_seconds;
+    std::string dns_server;     // empty to use the one from /etc/resolv.conf
+    int dns_timeout_ms;
+    int keep_alive_timeout_seconds;  // idle time before a persistent client connection is closed
+    int max_keep_alive_requests;     // requests served on one client connection
+    int memory_cache_megabytes;      // budget of the in-memory response cache
+    int cache_segment_megabytes;     // size of the segment files of the cache store
+    int upstream_timeout_seconds;    // wait for target server replies before giving up
+    int stale_while_revalidate_seconds;  // stale replies served while refreshed, unless they say otherwise
+    int stale_if_error_seconds;          // stale replies served when the target server fails
+    int cache_max_megabytes;         // quota of the cache directory
+    int cache_max_entries;
 };
 
 struct HostInfo {
@@ -63,7 +88,17 @@ HostInfo* wait_for_client_and_accept(int listening_socket);
 
 struct sockaddr_in create_listening_socket_address(const ParsedArguments &arguments);
 
-int create_listening_socket(struct sockaddr_in *socket_address);
+/**
+ * Creates a socket listening on the given address. With reuse_port set several
+ * such sockets can be bound to the same port and the kernel load balances
+ * incoming connections between them. A non-zero defer_accept_seconds makes
+ * accept() only return connections that already have request data to read.
+ */
+int create_listening_socket(struct sockaddr_in *socket_address, int backlog=32, bool reuse_port=false,
+                            int defer_accept_seconds=0);
+
+// Splits "host:port", the port defaults to 80
+void split_host_and_port(const std::string &hostport, std::string &host, int &port);
 
 int create_socket_to_server(const std::string &hostport);
 int create_socket_to_server(const std::string &host, int port);
@@ -89,8 +124,10 @@ inline std::string trim(const std::string &s)
     return std::string(it, rit.base());
 }
 
-bool is_host_blocked(const std::string &hostname, const std::string &sites_blocked_list_file);
-std::string filter_words(const std::string &str, const std::string &filtered_words_list);
-
 void print_vector(std::vector<std::string> v);
 
+int get_online_cpu_count();
+
+// Pins the thread to a single core, chosen round-robin by index
+void pin_thread_to_core(pthread_t thread, int index);
+
@@ -0,0 +1,124 @@
+#pragma once
+
+#include "utils.h"
+
+#include <stdint.h>
+#include <memory>
+
+/*
+ The filtered words compiled into an Aho-Corasick automaton, which finds all
+ of them in a single pass over a page, whatever their number. The automaton
+ is a DFA in one flat table: bytes are first mapped to classes (the bytes no
+ word contains share one, upper and lower case letters share one), and every
+ state has a row of next states, one per class. Matching a byte is thus one
+ load from a table small enough to stay in the CPU caches.
+
+ Matching ignores case and skips HTML tags, like the filter always did. Where
+ matches overlap, the leftmost wins, then the longest.
+
+ Most bytes of a page can't change the state: those of tags, which are
+ matched as spaces, and those that can't start a word while no word is under
+ way. Both are skipped 16 or 32 bytes at a time, by memchr() for the end of a
+ tag and by SIMD kernels for the next byte that may start a word, chosen by
+ what the CPU supports.
+*/
+
+/*
+ A set of bytes tested in SIMD registers: a byte may be in the set if the
+ masks of its low and high nibble share a bit. With too many distinct rows of
+ low nibbles the masks hold more bytes than the set, `exact` tells for sure.
+*/
+struct CandidateByteSet {
+    uint8_t low_nibble_masks[16];
+    uint8_t high_nibble_masks[16];
+    bool exact[256];
+};
+
+// Returns the position of the first byte from `from` that may be in the set, `length` if none
+typedef size_t (*CandidateScanner)(const unsigned char *text, size_t from, size_t length,
+                                   const CandidateByteSet &set);
+
+// Builds the set of the bytes flagged in `members`
+void make_candidate_byte_set(const bool members[256], CandidateByteSet &set);
+
+// The byte by byte scanner, which every CPU runs
+size_t scan_candidate_bytes(const unsigned char *text, size_t from, size_t length, const CandidateByteSet &set);
+
+// The fastest scanner the CPU supports: AVX2, SSSE3 or byte by byte
+CandidateScanner select_candidate_scanner();
+
+class WordFilter {
+public:
+    // Blank words are ignored
+    explicit WordFilter(const std::vector<std::string> &words);
+
+    // Returns the text with every match replaced by "CENSORED"
+    std::string censor(const std::string &text) const;
+
+    size_t word_count() const { return words; }
+    size_t max_word_length() const { return longest_word; }
+
+private:
+    friend class WordFilterStream;
+
+    // A match as (start, length), the start counted from the beginning of the text
+    typedef std::pair<uint64_t, size_t> Match;
+
+    // Where the scan of a text stands between two of its pieces
+    struct ScanState {
+        uint32_t row;
+        bool in_tag;
+    };
+
+    /**
+     * Goes on with the scan over the next piece of the text, which starts at
+     * `offset` within it, and appends the matches ending in the piece.
+     */
+    void scan(const unsigned char *bytes, size_t length, uint64_t offset, ScanState &state,
+              std::vector<Match> &matches) const;
+
+    // A match ending at the state, or at a state down its chain of suffixes
+    struct StateOutput {
+        uint32_t length;        // of the longest word ending exactly here, 0 if none
+        uint32_t next;          // next state of the suffix chain with an output, 0 if none
+    };
+
+    uint8_t byte_class[256];
+    CandidateByteSet word_starts;       // bytes leaving the root state, and '<'
+    CandidateScanner scan_word_starts;
+    int class_shift;                    // a row holds 1 << class_shift classes
+    std::vector<uint32_t> transitions;  // row of the next state, with OUTPUT_FLAG if it has an output
+    std::vector<StateOutput> outputs;   // by state number
+    size_t words;
+    size_t longest_word;
+};
+
+/*
+ Censors a text that arrives in pieces, such as a body being downloaded. The
+ scan of a piece goes on where the previous one left it, in the middle of a
+ word or a tag, and the censored text is handed out as soon as no later match
+ can change it: all but the last (longest word - 1) bytes that came in.
+*/
+class WordFilterStream {
+public:
+    explicit WordFilterStream(const std::shared_ptr<const WordFilter> &filter);
+
+    // Filters the next piece, and appends to `out` the part of the censored text that is settled
+    void write(const char *data, size_t length, std::string &out);
+
+    // Ends the text, and appends the rest of the censored text to `out`
+    void finish(std::string &out);
+
+private:
+    // Hands out the text before `settled`, and the matches starting there
+    void hand_out(uint64_t settled, std::string &out);
+
+    std::shared_ptr<const WordFilter> filter;
+    WordFilter::ScanState state;
+    std::string pending;                        // the text not handed out yet
+    uint64_t pending_start;                     // offset of `pending` within the text
+    std::vector<WordFilter::Match> matches;     // those not handed out yet
+};
+
+// Reads the words of the file, one per line, false if it can't be read
+bool read_filter_words(const std::string &filename, std::vector<std::string> &words);
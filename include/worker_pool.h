@@ -0,0 +1,28 @@
+#pragma once
+
+#include <functional>
+
+/*
+ Fixed-size pool of CPU worker threads for the CPU-bound stages of a request
+ (decompression, word filtering, serialization). Every worker owns a deque of
+ tasks and steals from the others when its own deque runs dry, so the work is
+ spread across cores without ever running more CPU-bound tasks at once than
+ there are workers.
+*/
+
+/**
+ * Starts `threads` workers, pinned round-robin to the available cores. At most
+ * `max_queued_tasks` tasks may wait in the deques; further submitters block
+ * until a slot frees up.
+ */
+void start_worker_pool(int threads, int max_queued_tasks);
+
+/**
+ * Runs the task on the worker pool and waits for it to finish. Exceptions
+ * thrown by the task are rethrown in the caller. Runs the task inline if the
+ * pool was not started or when called from a worker thread.
+ */
+void run_on_worker_pool(const std::function<void()> &task);
+
+// Tasks waiting in the deques for a worker right now
+int worker_pool_queued_tasks();
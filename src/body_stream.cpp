@@ -0,0 +1,194 @@
+#include "body_stream.h"
+#include "worker_pool.h"
+#include "filter_lists.h"
+
+// Output produced per inflate() round, a piece of the decoded body may hold several
+const size_t INFLATE_OUTPUT_CHUNK_SIZE = 65536;
+// Output produced per deflate() round
+const size_t DEFLATE_OUTPUT_CHUNK_SIZE = 65536;
+// Largest piece read at once from a body held in memory or in a file
+const size_t STORED_BODY_PIECE_SIZE = 65536;
+
+InflateBodyStream::InflateBodyStream(BodyStream *source, bool gzip)
+    : source(source), finished(false)
+{
+    memset(&zs, 0, sizeof(zs));
+    // MAX_WBITS + 32 detects the gzip header automatically
+    initialized = (gzip ? inflateInit2(&zs, MAX_WBITS + 32) : inflateInit(&zs)) == Z_OK;
+}
+
+InflateBodyStream::~InflateBodyStream()
+{
+    if (initialized)
+        inflateEnd(&zs);
+    delete source;
+}
+
+ssize_t InflateBodyStream::read(std::string &out)
+{
+    if (!initialized)
+        return -1;
+
+    size_t size_before = out.size();
+    while (out.size() == size_before) {
+        if (finished) {
+            // Whatever follows the end of the compressed stream is ignored
+            std::string rest;
+            ssize_t bytes_read;
+            while ((bytes_read = source->read(rest)) > 0)
+                rest.clear();
+            return bytes_read;
+        }
+
+        input.clear();
+        ssize_t bytes_read = source->read(input);
+        if (bytes_read <= 0) {
+            // The body ended before the compressed stream did
+            if (bytes_read == 0)
+                log("Compressed body is truncated");
+            return -1;
+        }
+
+        int ret = Z_OK;
+        run_on_worker_pool([&]() {
+            zs.next_in = (Bytef *)input.data();
+            zs.avail_in = input.size();
+            // Runs until the piece is consumed and zlib holds no pending output
+            while (ret == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0)) {
+                size_t offset = out.size();
+                out.resize(offset + INFLATE_OUTPUT_CHUNK_SIZE);
+                zs.next_out = (Bytef *)&out[offset];
+                zs.avail_out = INFLATE_OUTPUT_CHUNK_SIZE;
+                ret = inflate(&zs, Z_NO_FLUSH);
+                out.resize(out.size() - zs.avail_out);
+                if (ret == Z_BUF_ERROR && zs.avail_out > 0)
+                    ret = Z_OK;
+            }
+        });
+
+        if (ret == Z_STREAM_END) {
+            finished = true;
+        } else if (ret != Z_OK) {
+            log("Error while uncompressing target server's response");
+            return -1;
+        }
+    }
+    return out.size() - size_before;
+}
+
+GzipBodyStream::GzipBodyStream(BodyStream *source)
+    : source(source), finished(false)
+{
+    memset(&zs, 0, sizeof(zs));
+    // MAX_WBITS + 16 writes a gzip header and trailer around the deflate stream
+    initialized = deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+GzipBodyStream::~GzipBodyStream()
+{
+    if (initialized)
+        deflateEnd(&zs);
+    delete source;
+}
+
+ssize_t GzipBodyStream::read(std::string &out)
+{
+    if (!initialized)
+        return -1;
+
+    // Every piece is flushed so the client gets it right away, at a small cost in
+    // compression; reading only goes on if a piece brought nothing to hand out
+    size_t size_before = out.size();
+    while (out.size() == size_before && !finished) {
+        input.clear();
+        ssize_t bytes_read = source->read(input);
+        if (bytes_read < 0)
+            return -1;
+
+        int flush = bytes_read == 0 ? Z_FINISH : Z_SYNC_FLUSH;
+        int ret = Z_OK;
+        run_on_worker_pool([&]() {
+            zs.next_in = (Bytef *)input.data();
+            zs.avail_in = input.size();
+            do {
+                size_t offset = out.size();
+                out.resize(offset + DEFLATE_OUTPUT_CHUNK_SIZE);
+                zs.next_out = (Bytef *)&out[offset];
+                zs.avail_out = DEFLATE_OUTPUT_CHUNK_SIZE;
+                ret = deflate(&zs, flush);
+                out.resize(out.size() - zs.avail_out);
+            } while (ret == Z_OK && (zs.avail_in > 0 || zs.avail_out == 0 || flush == Z_FINISH));
+        });
+
+        if (ret == Z_STREAM_END) {
+            finished = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            log("Error while compressing the response");
+            return -1;
+        }
+    }
+    return out.size() - size_before;
+}
+
+ssize_t MemoryBodyStream::read(std::string &out)
+{
+    size_t length = std::min(STORED_BODY_PIECE_SIZE, body->size() - offset);
+    out.append(*body, offset, length);
+    offset += length;
+    return length;
+}
+
+FileBodyStream::~FileBodyStream()
+{
+    close(fd);
+}
+
+ssize_t FileBodyStream::read(std::string &out)
+{
+    if (remaining == 0)
+        return 0;
+
+    size_t size_before = out.size();
+    out.resize(size_before + std::min(STORED_BODY_PIECE_SIZE, remaining));
+    ssize_t bytes_read;
+    do {
+        bytes_read = pread(fd, &out[size_before], out.size() - size_before, offset);
+    } while (bytes_read < 0 && errno == EINTR);
+    // The file can't end before the body does
+    out.resize(size_before + std::max((ssize_t)0, bytes_read));
+    if (bytes_read <= 0)
+        return -1;
+    offset += bytes_read;
+    remaining -= bytes_read;
+    return bytes_read;
+}
+
+FilterBodyStream::FilterBodyStream(BodyStream *source)
+    : source(source), filter(current_word_filter()), finished(false)
+{
+}
+
+FilterBodyStream::~FilterBodyStream()
+{
+    delete source;
+}
+
+ssize_t FilterBodyStream::read(std::string &out)
+{
+    // A piece may be held back whole, the next one is read then
+    size_t size_before = out.size();
+    std::string piece;
+    while (out.size() == size_before && !finished) {
+        piece.clear();
+        ssize_t bytes_read = source->read(piece);
+        if (bytes_read < 0)
+            return -1;
+        if (bytes_read == 0) {
+            filter.finish(out);
+            finished = true;
+        } else {
+            run_on_worker_pool([&]() { filter.write(piece.data(), piece.size(), out); });
+        }
+    }
+    return out.size() - size_before;
+}
@@ -0,0 +1,121 @@
+#include "cache_admission.h"
+#include "cache_index.h"
+
+// Requests after which a reply is written to disk
+const int DISK_ADMISSION_MIN_REQUESTS = 2;
+const size_t DEFAULT_EXPECTED_ENTRIES = 4096;
+
+// Only guards replacing the sketch, requests update it without a lock
+static pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FrequencySketch *request_sketch = NULL;
+
+FrequencySketch::FrequencySketch(size_t expected_keys)
+    : width(1), increments(0)
+{
+    while (width < expected_keys)
+        width *= 2;
+    counters.assign((ROWS * width + 1) / 2, 0);
+}
+
+size_t FrequencySketch::slot(int row, uint64_t key_hash) const
+{
+    // Rows use independent-enough hashes derived from one (double hashing)
+    uint64_t step = (key_hash >> 32) | 1;
+    return row * width + ((key_hash + row * step) & (width - 1));
+}
+
+void FrequencySketch::increment(uint64_t key_hash)
+{
+    for (int row = 0; row < ROWS; row++) {
+        size_t counter = slot(row, key_hash);
+        uint8_t *byte = &counters[counter / 2];
+        int shift = (counter % 2) * 4;
+        uint8_t value = __atomic_load_n(byte, __ATOMIC_RELAXED);
+        while (((value >> shift) & 0xf) < MAX_COUNT
+               && !__atomic_compare_exchange_n(byte, &value, (uint8_t)(value + (1 << shift)), true,
+                                               __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+
+    // Only the increment reaching the limit ages the counters
+    size_t limit = 10 * width;
+    if (__atomic_add_fetch(&increments, 1, __ATOMIC_RELAXED) == limit) {
+        age();
+        __atomic_sub_fetch(&increments, limit / 2, __ATOMIC_RELAXED);
+    }
+}
+
+int FrequencySketch::estimate(uint64_t key_hash) const
+{
+    int count = MAX_COUNT;
+    for (int row = 0; row < ROWS; row++) {
+        size_t counter = slot(row, key_hash);
+        uint8_t byte = __atomic_load_n(&counters[counter / 2], __ATOMIC_RELAXED);
+        count = std::min(count, (byte >> ((counter % 2) * 4)) & 0xf);
+    }
+    return count;
+}
+
+void FrequencySketch::age()
+{
+    for (size_t i = 0; i < counters.size(); i++) {
+        uint8_t value = __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+        // Halves both counters of the byte at once
+        while (!__atomic_compare_exchange_n(&counters[i], &value, (uint8_t)((value >> 1) & 0x77), true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
+    }
+}
+
+// Key of the URL in the sketch: its index key, mixed so that the high and low halves are both usable
+static uint64_t sketch_key(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// The sketch, created with the default size if none was configured
+static FrequencySketch& get_request_sketch()
+{
+    FrequencySketch *sketch = __atomic_load_n(&request_sketch, __ATOMIC_ACQUIRE);
+    if (sketch != NULL)
+        return *sketch;
+
+    pthread_mutex_lock(&admission_mutex);
+    if (request_sketch == NULL)
+        __atomic_store_n(&request_sketch, new FrequencySketch(DEFAULT_EXPECTED_ENTRIES), __ATOMIC_RELEASE);
+    sketch = request_sketch;
+    pthread_mutex_unlock(&admission_mutex);
+    return *sketch;
+}
+
+void configure_cache_admission(size_t expected_entries)
+{
+    pthread_mutex_lock(&admission_mutex);
+    delete request_sketch;
+    __atomic_store_n(&request_sketch, new FrequencySketch(std::max(expected_entries, DEFAULT_EXPECTED_ENTRIES)),
+                     __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+void record_cache_request(const std::string &url)
+{
+    get_request_sketch().increment(sketch_key(cache_url_hash(url)));
+}
+
+int cache_request_frequency(const std::string &url)
+{
+    return cache_hash_request_frequency(cache_url_hash(url));
+}
+
+int cache_hash_request_frequency(uint64_t url_hash)
+{
+    return get_request_sketch().estimate(sketch_key(url_hash));
+}
+
+bool admit_to_disk_cache(const std::string &url)
+{
+    return cache_request_frequency(url) >= DISK_ADMISSION_MIN_REQUESTS;
+}
@@ -0,0 +1,452 @@
+#include "cache_index.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+const char CACHE_INDEX_MAGIC[8] = { 'C', 'N', 'C', 'A', 'C', 'H', 'E', 'I' };
+const uint32_t CACHE_INDEX_VERSION = 5;
+const uint32_t CACHE_INDEX_INITIAL_SLOTS = 16384;
+
+struct CacheIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;    // a power of two
+    uint64_t entry_count;
+    uint32_t next_segment;
+    uint32_t reserved;
+};
+
+struct CacheIndexSlot {
+    uint64_t url_hash;      // 0 for an empty slot
+    uint64_t url_check;     // second hash of the URL, tells apart URLs whose url_hash collides
+    uint64_t offset;
+    uint64_t body_offset;
+    uint64_t body_length;
+    uint64_t body_hash;
+    int64_t stored_at;
+    int64_t last_access;
+    int64_t expires_at;
+    uint32_t segment;
+    uint32_t head_length;
+    uint32_t body_segment;
+    uint32_t reserved;
+};
+
+// A body in the segments, which entries point to by its segment and offset
+typedef std::pair<uint32_t, uint64_t> BodyPlace;
+
+struct StoredBody {
+    uint64_t hash;
+    uint64_t length;
+    size_t references;
+};
+
+static pthread_mutex_t cache_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::string index_directory;
+static int index_fd = -1;
+static CacheIndexHeader *index_header = NULL;
+static std::map<BodyPlace, StoredBody> stored_bodies;
+static std::map<uint64_t, BodyPlace> bodies_by_hash;    // the body new entries share, for each hash
+
+static size_t index_file_size(uint32_t slot_count)
+{
+    return sizeof(CacheIndexHeader) + (size_t)slot_count * sizeof(CacheIndexSlot);
+}
+
+static CacheIndexSlot* index_slots(CacheIndexHeader *header)
+{
+    return (CacheIndexSlot *)(header + 1);
+}
+
+uint64_t cache_url_hash(const std::string &url)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < url.size(); i++) {
+        hash ^= (unsigned char)url[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash == 0 ? 1 : hash;
+}
+
+// Another hash function than cache_url_hash(), so URLs colliding in one differ in the other
+static uint64_t cache_url_check(const std::string &url)
+{
+    uint64_t hash = url.size();
+    for (size_t i = 0; i < url.size(); i++) {
+        hash = (hash ^ (unsigned char)url[i]) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    return hash;
+}
+
+static void unmap_index(CacheIndexHeader *header, int fd)
+{
+    if (header != NULL)
+        munmap(header, index_file_size(header->slot_count));
+    if (fd >= 0)
+        close(fd);
+}
+
+// Maps an existing index file, NULL if it is missing or not a valid index
+static CacheIndexHeader* map_index_file(const std::string &path, int &fd)
+{
+    fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    CacheIndexHeader header;
+    bool valid = fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(header)
+        && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+        && memcmp(header.magic, CACHE_INDEX_MAGIC, sizeof(header.magic)) == 0
+        && header.version == CACHE_INDEX_VERSION
+        && header.slot_count > 0 && (header.slot_count & (header.slot_count - 1)) == 0
+        && header.entry_count < header.slot_count
+        && (size_t)st.st_size == index_file_size(header.slot_count);
+
+    void *mapping = valid ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        return NULL;
+    }
+    return (CacheIndexHeader *)mapping;
+}
+
+// Creates an empty index file with slot_count slots and maps it, NULL on error
+static CacheIndexHeader* create_index_file(const std::string &path, uint32_t slot_count, int &fd)
+{
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+
+    // The file is extended with zeros, that is with empty slots
+    size_t size = index_file_size(slot_count);
+    void *mapping = ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        return NULL;
+    }
+
+    CacheIndexHeader *header = (CacheIndexHeader *)mapping;
+    memcpy(header->magic, CACHE_INDEX_MAGIC, sizeof(header->magic));
+    header->version = CACHE_INDEX_VERSION;
+    header->slot_count = slot_count;
+    header->entry_count = 0;
+    header->next_segment = 1;
+    return header;
+}
+
+// Counts the slot as a reference to its body, under cache_index_mutex
+static void add_body_reference(const CacheIndexSlot &slot)
+{
+    if (slot.body_length == 0)
+        return;
+    BodyPlace place(slot.body_segment, slot.body_offset);
+    StoredBody &body = stored_bodies[place];
+    if (body.references++ == 0) {
+        body.hash = slot.body_hash;
+        body.length = slot.body_length;
+        bodies_by_hash.insert(std::make_pair(body.hash, place));
+    }
+}
+
+// Forgets the body once no slot points to it any more, under cache_index_mutex
+static void drop_body_reference(const CacheIndexSlot &slot)
+{
+    BodyPlace place(slot.body_segment, slot.body_offset);
+    std::map<BodyPlace, StoredBody>::iterator it = stored_bodies.find(place);
+    if (slot.body_length == 0 || it == stored_bodies.end() || --it->second.references > 0)
+        return;
+    std::map<uint64_t, BodyPlace>::iterator shared = bodies_by_hash.find(it->second.hash);
+    if (shared != bodies_by_hash.end() && shared->second == place)
+        bodies_by_hash.erase(shared);
+    stored_bodies.erase(it);
+}
+
+// Slot holding the hash, or the empty slot where it belongs
+static size_t find_slot(CacheIndexHeader *header, uint64_t hash, bool &found)
+{
+    CacheIndexSlot *slots = index_slots(header);
+    size_t mask = header->slot_count - 1;
+    size_t i = hash & mask;
+    while (slots[i].url_hash != 0 && slots[i].url_hash != hash)
+        i = (i + 1) & mask;
+    found = slots[i].url_hash == hash;
+    return i;
+}
+
+// Moves all entries to a new index twice as large, which replaces the current one
+static bool grow_index()
+{
+    std::string path = index_directory + "/index";
+    std::string new_path = path + ".new";
+    int new_fd;
+    CacheIndexHeader *new_header = create_index_file(new_path, index_header->slot_count * 2, new_fd);
+    if (new_header == NULL)
+        return false;
+
+    CacheIndexSlot *slots = index_slots(index_header);
+    CacheIndexSlot *new_slots = index_slots(new_header);
+    for (size_t i = 0; i < index_header->slot_count; i++) {
+        if (slots[i].url_hash == 0)
+            continue;
+        bool found;
+        new_slots[find_slot(new_header, slots[i].url_hash, found)] = slots[i];
+    }
+    new_header->entry_count = index_header->entry_count;
+    new_header->next_segment = index_header->next_segment;
+
+    if (rename(new_path.c_str(), path.c_str()) != 0) {
+        unmap_index(new_header, new_fd);
+        unlink(new_path.c_str());
+        return false;
+    }
+    unmap_index(index_header, index_fd);
+    index_header = new_header;
+    index_fd = new_fd;
+    return true;
+}
+
+void open_cache_index(const std::string &directory)
+{
+    struct stat st;
+    if (stat(directory.c_str(), &st) != 0 && mkdir(directory.c_str(), 0700) != 0)
+        print_error_and_die("Unable to create cache directory " + directory);
+
+    pthread_mutex_lock(&cache_index_mutex);
+    unmap_index(index_header, index_fd);
+    index_directory = directory;
+
+    std::string path = directory + "/index";
+    index_header = map_index_file(path, index_fd);
+    if (index_header == NULL) {
+        index_header = create_index_file(path, CACHE_INDEX_INITIAL_SLOTS, index_fd);
+        if (index_header == NULL)
+            print_error_and_die("Unable to create cache index " + path);
+        log("Created an empty cache index in " + path);
+    } else {
+        std::stringstream ss;
+        ss << "Loaded cache index " << path << " with " << index_header->entry_count << " entries";
+        log(ss.str());
+    }
+
+    stored_bodies.clear();
+    bodies_by_hash.clear();
+    CacheIndexSlot *slots = index_slots(index_header);
+    for (size_t i = 0; i < index_header->slot_count; i++) {
+        if (slots[i].url_hash != 0)
+            add_body_reference(slots[i]);
+    }
+    pthread_mutex_unlock(&cache_index_mutex);
+}
+
+static void copy_entry(const CacheIndexSlot &slot, CacheIndexEntry &entry)
+{
+    entry.segment = slot.segment;
+    entry.offset = slot.offset;
+    entry.head_length = slot.head_length;
+    entry.body_segment = slot.body_segment;
+    entry.body_offset = slot.body_offset;
+    entry.body_length = slot.body_length;
+    entry.body_hash = slot.body_hash;
+    entry.stored_at = slot.stored_at;
+    entry.last_access = slot.last_access;
+    entry.expires_at = slot.expires_at;
+}
+
+// Slot of the URL, -1 if it has none: another URL with the same key isn't taken for it
+static ssize_t find_url_slot(const std::string &url)
+{
+    bool found = false;
+    size_t i = index_header != NULL ? find_slot(index_header, cache_url_hash(url), found) : 0;
+    return found && index_slots(index_header)[i].url_check == cache_url_check(url) ? (ssize_t)i : -1;
+}
+
+bool cache_index_lookup(const std::string &url, CacheIndexEntry &entry)
+{
+    pthread_mutex_lock(&cache_index_mutex);
+    ssize_t i = find_url_slot(url);
+    if (i >= 0) {
+        CacheIndexSlot &slot = index_slots(index_header)[i];
+        slot.last_access = time(NULL);
+        copy_entry(slot, entry);
+    }
+    pthread_mutex_unlock(&cache_index_mutex);
+    return i >= 0;
+}
+
+bool cache_index_store(const std::string &url, const CacheIndexEntry &entry, bool shared_body)
+{
+    uint64_t hash = cache_url_hash(url);
+
+    pthread_mutex_lock(&cache_index_mutex);
+    // A shared body may have been moved by compaction or freed by the janitor meanwhile
+    if (index_header == NULL
+        || (shared_body && entry.body_length > 0 && stored_bodies.count(BodyPlace(entry.body_segment, entry.body_offset)) == 0)) {
+        pthread_mutex_unlock(&cache_index_mutex);
+        return false;
+    }
+    if ((index_header->entry_count + 1) * 4 > (uint64_t)index_header->slot_count * 3 && !grow_index()
+        && index_header->entry_count + 1 >= index_header->slot_count) {
+        pthread_mutex_unlock(&cache_index_mutex);
+        log("Cache index is full, not caching " + url);
+        return false;
+    }
+
+    // An entry of another URL with the same key is replaced as well
+    bool found;
+    CacheIndexSlot &slot = index_slots(index_header)[find_slot(index_header, hash, found)];
+    if (found)
+        drop_body_reference(slot);
+    else
+        index_header->entry_count++;
+
+    slot.segment = entry.segment;
+    slot.offset = entry.offset;
+    slot.head_length = entry.head_length;
+    slot.body_segment = entry.body_segment;
+    slot.body_offset = entry.body_offset;
+    slot.body_length = entry.body_length;
+    slot.body_hash = entry.body_hash;
+    slot.stored_at = entry.stored_at;
+    slot.last_access = entry.last_access;
+    slot.expires_at = entry.expires_at;
+    slot.url_hash = hash;
+    slot.url_check = cache_url_check(url);
+    add_body_reference(slot);
+    pthread_mutex_unlock(&cache_index_mutex);
+    return true;
+}
+
+bool cache_index_find_body(uint64_t body_hash, uint64_t body_length, uint32_t &segment, uint64_t &offset)
+{
+    pthread_mutex_lock(&cache_index_mutex);
+    std::map<uint64_t, BodyPlace>::iterator it = bodies_by_hash.find(body_hash);
+    bool found = it != bodies_by_hash.end() && stored_bodies[it->second].length == body_length;
+    if (found) {
+        segment = it->second.first;
+        offset = it->second.second;
+    }
+    pthread_mutex_unlock(&cache_index_mutex);
+    return found;
+}
+
+size_t cache_index_body_references(const CacheIndexEntry &entry)
+{
+    pthread_mutex_lock(&cache_index_mutex);
+    std::map<BodyPlace, StoredBody>::iterator it = stored_bodies.find(BodyPlace(entry.body_segment, entry.body_offset));
+    size_t references = it != stored_bodies.end() ? it->second.references : 0;
+    pthread_mutex_unlock(&cache_index_mutex);
+    return references;
+}
+
+void cache_index_refresh(const std::string &url, time_t expires_at)
+{
+    pthread_mutex_lock(&cache_index_mutex);
+    ssize_t i = find_url_slot(url);
+    if (i >= 0)
+        index_slots(index_header)[i].expires_at = expires_at;
+    pthread_mutex_unlock(&cache_index_mutex);
+}
+
+// Removes the entry of the hash if its head is at this place of the segment
+static bool remove_entry(uint64_t hash, uint32_t segment, uint64_t offset)
+{
+    bool removed = false;
+    pthread_mutex_lock(&cache_index_mutex);
+    bool found = false;
+    size_t i = index_header != NULL ? find_slot(index_header, hash, found) : 0;
+    if (found && index_slots(index_header)[i].segment == segment && index_slots(index_header)[i].offset == offset) {
+        // Backward shift deletion: later entries of the probe sequence move up
+        // into the hole, unless that would put them before their home slot
+        CacheIndexSlot *slots = index_slots(index_header);
+        drop_body_reference(slots[i]);
+        size_t mask = index_header->slot_count - 1;
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (slots[j].url_hash == 0)
+                break;
+            size_t home = slots[j].url_hash & mask;
+            bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+            if (!stays) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        memset(&slots[i], 0, sizeof(CacheIndexSlot));
+        index_header->entry_count--;
+        removed = true;
+    }
+    pthread_mutex_unlock(&cache_index_mutex);
+    return removed;
+}
+
+void cache_index_remove(const std::string &url, uint32_t segment, uint64_t offset)
+{
+    remove_entry(cache_url_hash(url), segment, offset);
+}
+
+bool cache_index_remove_record(const CacheIndexRecord &record)
+{
+    return remove_entry(record.url_hash, record.entry.segment, record.entry.offset);
+}
+
+size_t cache_index_size()
+{
+    pthread_mutex_lock(&cache_index_mutex);
+    size_t size = index_header != NULL ? index_header->entry_count : 0;
+    pthread_mutex_unlock(&cache_index_mutex);
+    return size;
+}
+
+uint32_t cache_index_allocate_segment()
+{
+    pthread_mutex_lock(&cache_index_mutex);
+    uint32_t segment = index_header != NULL ? index_header->next_segment++ : 0;
+    pthread_mutex_unlock(&cache_index_mutex);
+    return segment;
+}
+
+void cache_index_list_entries(uint32_t segment, std::vector<CacheIndexRecord> &records)
+{
+    pthread_mutex_lock(&cache_index_mutex);
+    if (index_header != NULL) {
+        CacheIndexSlot *slots = index_slots(index_header);
+        for (size_t i = 0; i < index_header->slot_count; i++) {
+            if (slots[i].url_hash == 0 || (segment != 0 && slots[i].segment != segment && slots[i].body_segment != segment))
+                continue;
+            CacheIndexRecord record;
+            record.url_hash = slots[i].url_hash;
+            copy_entry(slots[i], record.entry);
+            records.push_back(record);
+        }
+    }
+    pthread_mutex_unlock(&cache_index_mutex);
+}
+
+bool cache_index_move(const CacheIndexRecord &record, uint32_t segment, uint64_t offset, uint32_t body_segment,
+                      uint64_t body_offset)
+{
+    bool moved = false;
+    pthread_mutex_lock(&cache_index_mutex);
+    bool found = false;
+    size_t i = index_header != NULL ? find_slot(index_header, record.url_hash, found) : 0;
+    if (found) {
+        CacheIndexSlot &slot = index_slots(index_header)[i];
+        if (slot.segment == record.entry.segment && slot.offset == record.entry.offset
+            && slot.body_segment == record.entry.body_segment && slot.body_offset == record.entry.body_offset) {
+            drop_body_reference(slot);
+            slot.segment = segment;
+            slot.offset = offset;
+            slot.body_segment = body_segment;
+            slot.body_offset = body_offset;
+            add_body_reference(slot);
+            moved = true;
+        }
+    }
+    pthread_mutex_unlock(&cache_index_mutex);
+    return moved;
+}
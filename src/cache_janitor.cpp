@@ -0,0 +1,132 @@
+#include "cache_janitor.h"
+#include "cache_index.h"
+#include "cache_store.h"
+#include "cache_admission.h"
+
+#include <float.h>
+
+const int CACHE_JANITOR_INTERVAL_SECONDS = 10;
+// Evictions go on until usage is back under this share of the quota
+const int CACHE_JANITOR_TARGET_PERCENT = 90;
+// Live share below which segments get compacted while the files exceed the byte quota
+const int CACHE_JANITOR_COMPACTION_LIVE_PERCENT = 90;
+
+struct JanitorQuota {
+    uint64_t max_bytes;
+    size_t max_entries;
+};
+
+static double gdsf_inflation = 0;      // L, only used by the janitor thread
+// L after every round that evicted, by the time the round ended
+static std::vector<std::pair<time_t, double> > inflation_history;
+
+struct EvictionCandidate {
+    double priority;
+    CacheIndexRecord record;
+
+    bool operator<(const EvictionCandidate &other) const { return priority < other.priority; }
+};
+
+/**
+ * L at the last hit of a reply, which is what GDSF adds to its priority:
+ * that of the last round up to then, 0 before any round.
+ */
+static double inflation_at(time_t last_access)
+{
+    std::vector<std::pair<time_t, double> >::const_iterator it =
+        std::upper_bound(inflation_history.begin(), inflation_history.end(), std::make_pair(last_access, DBL_MAX));
+    return it == inflation_history.begin() ? 0 : (it - 1)->second;
+}
+
+static void* run_janitor_thread(void *arg)
+{
+    JanitorQuota *quota = (JanitorQuota *)arg;
+    remove_orphaned_cache_files();
+    while (true) {
+        sleep(CACHE_JANITOR_INTERVAL_SECONDS);
+        run_cache_janitor(quota->max_bytes, quota->max_entries);
+    }
+    return NULL;
+}
+
+void start_cache_janitor(uint64_t max_bytes, size_t max_entries)
+{
+    JanitorQuota *quota = new JanitorQuota();
+    quota->max_bytes = max_bytes;
+    quota->max_entries = max_entries;
+
+    pthread_t janitor_thread;
+    if (pthread_create(&janitor_thread, NULL, run_janitor_thread, quota) != 0)
+        print_error_and_die("Error while spawning cache janitor thread");
+    pthread_detach(janitor_thread);
+}
+
+size_t run_cache_janitor(uint64_t max_bytes, size_t max_entries)
+{
+    uint64_t usage = cache_store_disk_usage();
+    size_t entry_count = cache_index_size();
+    if (usage <= max_bytes && entry_count <= max_entries)
+        return 0;
+
+    std::vector<CacheIndexRecord> records;
+    cache_index_list_entries(0, records);
+    // A body shared by several entries is only freed with the last of them
+    std::map<std::pair<uint32_t, uint64_t>, size_t> body_references;
+    uint64_t live_bytes = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        const CacheIndexEntry &entry = records[i].entry;
+        live_bytes += entry.head_length;
+        if (entry.body_length > 0 && body_references[std::make_pair(entry.body_segment, entry.body_offset)]++ == 0)
+            live_bytes += entry.body_length;
+    }
+
+    // Each entry is sized with its share of the body
+    std::vector<EvictionCandidate> candidates(records.size());
+    time_t oldest_access = time(NULL);
+    for (size_t i = 0; i < records.size(); i++) {
+        const CacheIndexEntry &entry = records[i].entry;
+        size_t references = std::max((size_t)1, body_references[std::make_pair(entry.body_segment, entry.body_offset)]);
+        uint64_t size = entry.head_length + entry.body_length / references;
+        int frequency = std::max(1, cache_hash_request_frequency(records[i].url_hash));
+        candidates[i].priority = inflation_at(entry.last_access) + (double)frequency / std::max((uint64_t)1, size);
+        candidates[i].record = records[i];
+        oldest_access = std::min(oldest_access, entry.last_access);
+    }
+    std::sort(candidates.begin(), candidates.end());
+
+    // Rounds before the last one preceding every access are no longer looked up
+    std::vector<std::pair<time_t, double> >::iterator unused =
+        std::upper_bound(inflation_history.begin(), inflation_history.end(), std::make_pair(oldest_access, DBL_MAX));
+    if (unused != inflation_history.begin())
+        inflation_history.erase(inflation_history.begin(), unused - 1);
+
+    uint64_t target_bytes = max_bytes * CACHE_JANITOR_TARGET_PERCENT / 100;
+    size_t target_entries = max_entries * CACHE_JANITOR_TARGET_PERCENT / 100;
+    size_t evicted = 0;
+    uint64_t freed = 0;
+    for (size_t i = 0; i < candidates.size() && (live_bytes > target_bytes || records.size() - evicted > target_entries); i++) {
+        const CacheIndexRecord &record = candidates[i].record;
+        if (!cache_index_remove_record(record))
+            continue;
+        uint64_t size = record.entry.head_length;
+        if (record.entry.body_length > 0
+            && --body_references[std::make_pair(record.entry.body_segment, record.entry.body_offset)] == 0)
+            size += record.entry.body_length;
+        live_bytes -= size;
+        freed += size;
+        evicted++;
+        gdsf_inflation = candidates[i].priority;
+    }
+
+    if (evicted > 0)
+        inflation_history.push_back(std::make_pair(time(NULL), gdsf_inflation));
+
+    // Evicted replies are garbage in their segments until those are compacted
+    compact_cache_segments(usage > max_bytes ? CACHE_JANITOR_COMPACTION_LIVE_PERCENT : CACHE_COMPACTION_LIVE_PERCENT);
+
+    std::stringstream ss;
+    ss << "Cache over its quota (" << usage << " bytes, " << entry_count << " replies): evicted " << evicted
+       << " replies, " << freed << " bytes";
+    log(ss.str());
+    return evicted;
+}
@@ -0,0 +1,180 @@
+#include "cache_policy.h"
+
+// Upper bound of the heuristic freshness lifetime of replies without an explicit one
+const time_t HEURISTIC_MAX_LIFETIME = 86400;
+
+// Appended to the ETag of a reply the proxy gzip-compresses
+const std::string GZIP_ETAG_SUFFIX = "-gzip";
+
+time_t parse_http_date(const std::string &value)
+{
+    // IMF-fixdate, then the obsolete RFC 850 and asctime() formats
+    const char *formats[] = { "%a, %d %b %Y %H:%M:%S GMT", "%A, %d-%b-%y %H:%M:%S GMT", "%a %b %e %H:%M:%S %Y" };
+    std::string date = trim(value);
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char *end = strptime(date.c_str(), formats[i], &tm);
+        if (end != NULL && *end == '\0')
+            return timegm(&tm);
+    }
+    return -1;
+}
+
+// Directives of the Cache-Control header, names in lower case, quotes removed from values
+static std::map<std::string, std::string> parse_cache_control(const HttpHeader &header)
+{
+    std::map<std::string, std::string> directives;
+    HeaderMap::const_iterator it = header.headers.find("Cache-Control");
+    if (it == header.headers.end())
+        return directives;
+
+    std::vector<std::string> parts = split_all(it->second, ',');
+    for (size_t i = 0; i < parts.size(); i++) {
+        std::string directive = trim(parts[i]);
+        std::string::size_type equals = directive.find('=');
+        std::string name = trim(directive.substr(0, equals));
+        std::string value = equals == std::string::npos ? "" : trim(directive.substr(equals + 1));
+        if (value.size() >= 2 && value[0] == '"' && value[value.size() - 1] == '"')
+            value = value.substr(1, value.size() - 2);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (!name.empty())
+            directives[name] = value;
+    }
+    return directives;
+}
+
+// Value of a delta-seconds directive, -1 if it is missing or invalid
+static long directive_seconds(const std::map<std::string, std::string> &directives, const std::string &name)
+{
+    std::map<std::string, std::string>::const_iterator it = directives.find(name);
+    if (it == directives.end() || it->second.empty() || it->second.find_first_not_of("0123456789") != std::string::npos)
+        return -1;
+    return atol(it->second.c_str());
+}
+
+static time_t header_date(const HttpHeader &header, const char *name)
+{
+    HeaderMap::const_iterator it = header.headers.find(name);
+    return it == header.headers.end() ? -1 : parse_http_date(it->second);
+}
+
+static bool has_validator(const HttpHeader &header)
+{
+    return header.headers.find("ETag") != header.headers.end()
+        || header.headers.find("Last-Modified") != header.headers.end();
+}
+
+bool is_response_cacheable(const std::string &method, const HttpHeader &header, time_t response_time)
+{
+    // A HEAD reply has no body and the other methods change what they act on
+    if (method != "GET")
+        return false;
+
+    // Statuses cacheable by default, the others would need to be listed explicitly
+    int status = atoi(header.status.c_str());
+    if (status != 200 && status != 203 && status != 300 && status != 301 && status != 404 && status != 410)
+        return false;
+
+    std::map<std::string, std::string> directives = parse_cache_control(header);
+    if (directives.count("no-store") > 0 || directives.count("private") > 0)
+        return false;
+    HeaderMap::const_iterator vary = header.headers.find("Vary");
+    if (vary != header.headers.end() && trim(vary->second) == "*")
+        return false;
+
+    return response_expiry_time(header, response_time) > response_time || has_validator(header);
+}
+
+time_t response_expiry_time(const HttpHeader &header, time_t response_time)
+{
+    std::map<std::string, std::string> directives = parse_cache_control(header);
+    if (directives.count("no-cache") > 0)
+        return response_time;
+
+    time_t date = header_date(header, "Date");
+    if (date < 0)
+        date = response_time;
+
+    long lifetime = directive_seconds(directives, "s-maxage");
+    if (lifetime < 0)
+        lifetime = directive_seconds(directives, "max-age");
+    if (lifetime < 0) {
+        time_t expires = header_date(header, "Expires");
+        time_t last_modified = header_date(header, "Last-Modified");
+        if (header.headers.find("Expires") != header.headers.end())
+            lifetime = expires > date ? expires - date : 0;     // invalid dates mean already expired
+        else if (last_modified >= 0 && last_modified < date)
+            lifetime = std::min((date - last_modified) / 10, HEURISTIC_MAX_LIFETIME);
+        else
+            lifetime = 0;
+    }
+
+    // Age the reply already had when it was received
+    long age = std::max(0L, (long)(response_time - date));
+    HeaderMap::const_iterator it = header.headers.find("Age");
+    if (it != header.headers.end())
+        age = std::max(age, atol(it->second.c_str()));
+
+    return response_time + std::max(0L, lifetime - age);
+}
+
+time_t stale_serving_limit(const HttpHeader &header, time_t expires_at, const std::string &directive,
+                           long default_seconds)
+{
+    std::map<std::string, std::string> directives = parse_cache_control(header);
+    if (directives.count("must-revalidate") > 0 || directives.count("proxy-revalidate") > 0
+        || directives.count("no-cache") > 0)
+        return expires_at;
+
+    long seconds = directive_seconds(directives, directive);
+    return expires_at + (seconds >= 0 ? seconds : default_seconds);
+}
+
+bool add_revalidation_headers(const HttpHeader &cached, HttpHeader &request)
+{
+    HeaderMap::const_iterator etag = cached.headers.find("ETag");
+    HeaderMap::const_iterator last_modified = cached.headers.find("Last-Modified");
+    if (etag != cached.headers.end()) {
+        // A tag ending in "-gzip" may be ours or the target server's, so both are asked about
+        std::string identity = identity_etag(etag->second);
+        request.headers["If-None-Match"] = identity == trim(etag->second) ? etag->second : etag->second + ", " + identity;
+    }
+    if (last_modified != cached.headers.end())
+        request.headers["If-Modified-Since"] = last_modified->second;
+    return etag != cached.headers.end() || last_modified != cached.headers.end();
+}
+
+void merge_not_modified_headers(HttpHeader &cached, const HttpHeader &not_modified)
+{
+    for (HeaderMap::const_iterator it = not_modified.headers.begin(); it != not_modified.headers.end(); ++it) {
+        // Framing and connection headers of the 304 don't describe the cached body
+        if (strcasecmp(it->first.c_str(), "Content-Length") == 0 || strcasecmp(it->first.c_str(), "Transfer-Encoding") == 0
+            || strcasecmp(it->first.c_str(), "Content-Encoding") == 0 || strcasecmp(it->first.c_str(), "Connection") == 0
+            || strcasecmp(it->first.c_str(), "Keep-Alive") == 0)
+            continue;
+        // The target server confirms its own tag, the cached gzip encoding keeps the one derived from it
+        HeaderMap::const_iterator etag = cached.headers.find(it->first);
+        if (strcasecmp(it->first.c_str(), "ETag") == 0 && etag != cached.headers.end()
+            && trim(etag->second) == gzip_etag(it->second))
+            continue;
+        cached.headers[it->first] = it->second;
+    }
+}
+
+std::string gzip_etag(const std::string &etag)
+{
+    std::string tag = trim(etag);
+    if (!tag.empty() && tag[tag.size() - 1] == '"')
+        return tag.substr(0, tag.size() - 1) + GZIP_ETAG_SUFFIX + "\"";
+    return tag + GZIP_ETAG_SUFFIX;
+}
+
+std::string identity_etag(const std::string &etag)
+{
+    std::string tag = trim(etag);
+    size_t end = (!tag.empty() && tag[tag.size() - 1] == '"') ? tag.size() - 1 : tag.size();
+    if (end < GZIP_ETAG_SUFFIX.size() || tag.compare(end - GZIP_ETAG_SUFFIX.size(), GZIP_ETAG_SUFFIX.size(), GZIP_ETAG_SUFFIX) != 0)
+        return tag;
+    return tag.erase(end - GZIP_ETAG_SUFFIX.size(), GZIP_ETAG_SUFFIX.size());
+}
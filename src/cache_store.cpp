@@ -0,0 +1,406 @@
+#include "cache_store.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <set>
+#include <zlib.h>
+
+const int CACHE_COMPACTION_INTERVAL_SECONDS = 30;
+const size_t CACHE_COPY_BUFFER_SIZE = 65536;
+const char CACHE_SEGMENT_PREFIX[] = "segment-";
+
+struct WritableSegment {
+    uint32_t number;
+    int fd;
+    uint64_t size;
+};
+
+static pthread_mutex_t cache_store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t compaction_mutex = PTHREAD_MUTEX_INITIALIZER;  // one compaction round at a time
+static std::string store_directory;
+static size_t max_segment_size = 0;
+static std::vector<WritableSegment *> idle_segments;     // writable segments no writer holds
+static std::set<uint32_t> writable_segment_numbers;      // idle or held, never compacted
+static std::map<uint32_t, int> segment_fds;              // read descriptors of the segments used so far
+
+static std::string segment_path(uint32_t number)
+{
+    std::stringstream ss;
+    ss << store_directory << "/" << CACHE_SEGMENT_PREFIX << number;
+    return ss.str();
+}
+
+static void* run_compaction(void *arg)
+{
+    while (true) {
+        sleep(CACHE_COMPACTION_INTERVAL_SECONDS);
+        compact_cache_segments();
+    }
+    return NULL;
+}
+
+void start_cache_store(const std::string &directory, size_t segment_size)
+{
+    store_directory = directory;
+    max_segment_size = segment_size;
+
+    pthread_t compaction_thread;
+    if (pthread_create(&compaction_thread, NULL, run_compaction, NULL) != 0)
+        print_error_and_die("Error while spawning cache compaction thread");
+    pthread_detach(compaction_thread);
+}
+
+int open_cache_segment(uint32_t segment)
+{
+    pthread_mutex_lock(&cache_store_mutex);
+    std::map<uint32_t, int>::iterator it = segment_fds.find(segment);
+    int fd = it != segment_fds.end() ? it->second : open(segment_path(segment).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0)
+        segment_fds[segment] = fd;
+    int result = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+    pthread_mutex_unlock(&cache_store_mutex);
+    return result;
+}
+
+// Takes an idle writable segment, or starts a new one. NULL on error.
+static WritableSegment* acquire_segment()
+{
+    pthread_mutex_lock(&cache_store_mutex);
+    if (!idle_segments.empty()) {
+        WritableSegment *segment = idle_segments.back();
+        idle_segments.pop_back();
+        pthread_mutex_unlock(&cache_store_mutex);
+        return segment;
+    }
+    pthread_mutex_unlock(&cache_store_mutex);
+
+    uint32_t number = cache_index_allocate_segment();
+    if (number == 0)
+        return NULL;
+
+    // Marked writable before the file exists, so compaction never takes it for an empty old segment
+    pthread_mutex_lock(&cache_store_mutex);
+    writable_segment_numbers.insert(number);
+    pthread_mutex_unlock(&cache_store_mutex);
+
+    // A file of this name can only be left from an index that was lost, nothing points to it
+    // Readable too, bodies just written are compared with stored ones
+    int fd = open(segment_path(number).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        log("Unable to create cache segment " + segment_path(number));
+        pthread_mutex_lock(&cache_store_mutex);
+        writable_segment_numbers.erase(number);
+        pthread_mutex_unlock(&cache_store_mutex);
+        return NULL;
+    }
+
+    WritableSegment *segment = new WritableSegment();
+    segment->number = number;
+    segment->fd = fd;
+    segment->size = 0;
+    return segment;
+}
+
+// Returns the segment to the pool, or seals it once it is full
+static void release_segment(WritableSegment *segment)
+{
+    pthread_mutex_lock(&cache_store_mutex);
+    if (segment->size < max_segment_size) {
+        idle_segments.push_back(segment);
+        segment = NULL;
+    } else {
+        writable_segment_numbers.erase(segment->number);
+    }
+    pthread_mutex_unlock(&cache_store_mutex);
+
+    if (segment != NULL) {
+        close(segment->fd);
+        delete segment;
+    }
+}
+
+static bool pread_all(int fd, char *data, size_t length, uint64_t offset)
+{
+    while (length > 0) {
+        ssize_t bytes_read = pread(fd, data, length, offset);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            return false;
+        data += bytes_read;
+        length -= bytes_read;
+        offset += bytes_read;
+    }
+    return true;
+}
+
+// Whether the two descriptors hold the same `length` bytes at their offsets
+static bool have_same_bytes(int fd, uint64_t offset, int other_fd, uint64_t other_offset, uint64_t length)
+{
+    std::string buffer(CACHE_COPY_BUFFER_SIZE, 0);
+    std::string other_buffer(CACHE_COPY_BUFFER_SIZE, 0);
+    for (uint64_t done = 0; done < length; ) {
+        size_t piece = std::min((uint64_t)buffer.size(), length - done);
+        if (!pread_all(fd, &buffer[0], piece, offset + done) || !pread_all(other_fd, &other_buffer[0], piece, other_offset + done)
+            || memcmp(buffer.data(), other_buffer.data(), piece) != 0)
+            return false;
+        done += piece;
+    }
+    return true;
+}
+
+CacheSegmentWriter::CacheSegmentWriter()
+    : segment(acquire_segment()), start_offset(0), length(0), body_length(0), body_finished(false),
+      body_crc(crc32(0, Z_NULL, 0)), body_adler(adler32(0, Z_NULL, 0))
+{
+    if (segment != NULL)
+        start_offset = segment->size;
+}
+
+CacheSegmentWriter::~CacheSegmentWriter()
+{
+    abort();
+}
+
+bool CacheSegmentWriter::append(const char *data, size_t data_length)
+{
+    if (segment == NULL)
+        return false;
+    if (!body_finished) {
+        body_crc = crc32(body_crc, (const Bytef *)data, data_length);
+        body_adler = adler32(body_adler, (const Bytef *)data, data_length);
+    }
+    while (data_length > 0) {
+        ssize_t written = pwrite(segment->fd, data, data_length, start_offset + length);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        data_length -= written;
+        length += written;
+    }
+    return true;
+}
+
+bool CacheSegmentWriter::finish_body(CacheIndexEntry &entry, bool &shared)
+{
+    if (segment == NULL || body_finished)
+        return false;
+    body_finished = true;
+    body_length = length;
+    shared = false;
+    entry.body_length = body_length;
+    if (body_length == 0) {
+        entry.body_segment = 0;
+        entry.body_offset = entry.body_hash = 0;
+        return true;
+    }
+    entry.body_segment = segment->number;
+    entry.body_offset = start_offset;
+    entry.body_hash = (uint64_t)body_crc << 32 | body_adler;
+
+    uint32_t stored_segment;
+    uint64_t stored_offset;
+    if (!cache_index_find_body(entry.body_hash, body_length, stored_segment, stored_offset))
+        return true;
+    int stored_fd = open_cache_segment(stored_segment);
+    bool same = stored_fd >= 0 && have_same_bytes(segment->fd, start_offset, stored_fd, stored_offset, body_length);
+    if (stored_fd >= 0)
+        close(stored_fd);
+    if (!same || ftruncate(segment->fd, start_offset) != 0)
+        return true;
+
+    length = body_length = 0;
+    entry.body_segment = stored_segment;
+    entry.body_offset = stored_offset;
+    shared = true;
+    return true;
+}
+
+bool CacheSegmentWriter::finish(uint32_t &segment_number, uint64_t &offset)
+{
+    if (segment == NULL)
+        return false;
+    segment_number = segment->number;
+    offset = start_offset + body_length;
+    segment->size = start_offset + length;
+    release_segment(segment);
+    segment = NULL;
+    return true;
+}
+
+void CacheSegmentWriter::abort()
+{
+    if (segment == NULL)
+        return;
+    if (ftruncate(segment->fd, start_offset) != 0)
+        segment->size = start_offset + length;
+    release_segment(segment);
+    segment = NULL;
+}
+
+// Copies bytes of a segment to a writable segment and tells where they went, false if they could not be copied
+static bool copy_to_writable_segment(int fd, uint64_t offset, uint64_t length, uint32_t &new_segment, uint64_t &new_offset)
+{
+    CacheSegmentWriter writer;
+    std::string buffer(CACHE_COPY_BUFFER_SIZE, 0);
+    while (length > 0) {
+        size_t piece = std::min((uint64_t)buffer.size(), length);
+        if (!pread_all(fd, &buffer[0], piece, offset) || !writer.append(buffer.data(), piece))
+            return false;
+        offset += piece;
+        length -= piece;
+    }
+    return writer.finish(new_segment, new_offset);
+}
+
+static void compact_segment(uint32_t number, uint64_t garbage, const std::vector<CacheIndexRecord> &records)
+{
+    int fd = open_cache_segment(number);
+    if (fd < 0)
+        return;
+
+    // A body shared by several entries is copied once, they all point to the copy
+    std::map<uint64_t, std::pair<uint32_t, uint64_t> > moved_bodies;
+    size_t moved = 0;
+    for (size_t i = 0; i < records.size(); i++) {
+        const CacheIndexEntry &entry = records[i].entry;
+        if (entry.segment != number && entry.body_segment != number)
+            continue;
+
+        uint32_t segment = entry.segment, body_segment = entry.body_segment;
+        uint64_t offset = entry.offset, body_offset = entry.body_offset;
+        bool copied = true;
+        if (entry.body_segment == number) {
+            std::map<uint64_t, std::pair<uint32_t, uint64_t> >::iterator it = moved_bodies.find(entry.body_offset);
+            if (it != moved_bodies.end()) {
+                body_segment = it->second.first;
+                body_offset = it->second.second;
+            } else {
+                copied = copy_to_writable_segment(fd, entry.body_offset, entry.body_length, body_segment, body_offset);
+                moved_bodies[entry.body_offset] = std::make_pair(body_segment, body_offset);
+            }
+        }
+        if (copied && entry.segment == number)
+            copied = copy_to_writable_segment(fd, entry.offset, entry.head_length, segment, offset);
+        if (!copied) {
+            log("Unable to move cached replies out of " + segment_path(number));
+            close(fd);
+            return;
+        }
+
+        // A reply replaced meanwhile stays where it is, the copies are garbage then
+        cache_index_move(records[i], segment, offset, body_segment, body_offset);
+        moved++;
+    }
+    close(fd);
+
+    // Readers that opened the segment before keep their own descriptor
+    std::vector<CacheIndexRecord> remaining;
+    cache_index_list_entries(number, remaining);
+    if (!remaining.empty())
+        return;
+    pthread_mutex_lock(&cache_store_mutex);
+    std::map<uint32_t, int>::iterator it = segment_fds.find(number);
+    if (it != segment_fds.end()) {
+        close(it->second);
+        segment_fds.erase(it);
+    }
+    pthread_mutex_unlock(&cache_store_mutex);
+    unlink(segment_path(number).c_str());
+
+    std::stringstream ss;
+    ss << "Compacted " << segment_path(number) << ": moved " << moved << " replies, freed " << garbage << " bytes";
+    log(ss.str());
+}
+
+// Number of the segment named by the file, 0 if it isn't a segment
+static uint32_t segment_number(const char *file_name)
+{
+    size_t prefix_length = strlen(CACHE_SEGMENT_PREFIX);
+    if (strncmp(file_name, CACHE_SEGMENT_PREFIX, prefix_length) != 0 || file_name[prefix_length] == '\0'
+        || strspn(file_name + prefix_length, "0123456789") != strlen(file_name + prefix_length))
+        return 0;
+    return strtoul(file_name + prefix_length, NULL, 10);
+}
+
+// Sizes of the segment files, only of those no writer may be appending to unless `writable` is set
+static void list_segment_sizes(std::map<uint32_t, uint64_t> &segment_sizes, bool writable)
+{
+    DIR *dir = opendir(store_directory.c_str());
+    if (dir == NULL)
+        return;
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL) {
+        uint32_t number = segment_number(dir_entry->d_name);
+        pthread_mutex_lock(&cache_store_mutex);
+        bool skipped = !writable && writable_segment_numbers.count(number) > 0;
+        pthread_mutex_unlock(&cache_store_mutex);
+
+        struct stat st;
+        if (number != 0 && !skipped && stat(segment_path(number).c_str(), &st) == 0)
+            segment_sizes[number] = st.st_size;
+    }
+    closedir(dir);
+}
+
+void compact_cache_segments(int live_percent)
+{
+    pthread_mutex_lock(&compaction_mutex);
+    std::map<uint32_t, uint64_t> segment_sizes;
+    list_segment_sizes(segment_sizes, false);
+
+    std::vector<CacheIndexRecord> records;
+    if (!segment_sizes.empty())
+        cache_index_list_entries(0, records);
+    std::map<uint32_t, uint64_t> live_bytes;
+    std::set<std::pair<uint32_t, uint64_t> > counted_bodies;
+    for (size_t i = 0; i < records.size(); i++) {
+        const CacheIndexEntry &entry = records[i].entry;
+        live_bytes[entry.segment] += entry.head_length;
+        if (entry.body_length > 0 && counted_bodies.insert(std::make_pair(entry.body_segment, entry.body_offset)).second)
+            live_bytes[entry.body_segment] += entry.body_length;
+    }
+
+    for (std::map<uint32_t, uint64_t>::iterator it = segment_sizes.begin(); it != segment_sizes.end(); ++it) {
+        uint64_t live = live_bytes[it->first];
+        if (live == 0 || live * 100 < it->second * live_percent)
+            compact_segment(it->first, it->second - std::min(live, it->second), records);
+    }
+    pthread_mutex_unlock(&compaction_mutex);
+}
+
+uint64_t cache_store_disk_usage()
+{
+    std::map<uint32_t, uint64_t> segment_sizes;
+    list_segment_sizes(segment_sizes, true);
+    uint64_t usage = 0;
+    for (std::map<uint32_t, uint64_t>::iterator it = segment_sizes.begin(); it != segment_sizes.end(); ++it)
+        usage += it->second;
+    return usage;
+}
+
+size_t remove_orphaned_cache_files()
+{
+    DIR *dir = opendir(store_directory.c_str());
+    if (dir == NULL)
+        return 0;
+
+    size_t removed = 0;
+    struct dirent *dir_entry;
+    while ((dir_entry = readdir(dir)) != NULL) {
+        // index.new only exists while the index grows
+        std::string name = dir_entry->d_name;
+        if (name == "." || name == ".." || name == "index" || name == "index.new" || segment_number(name.c_str()) != 0)
+            continue;
+        std::string path = store_directory + "/" + name;
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && unlink(path.c_str()) == 0) {
+            log("Removed orphaned cache file " + path);
+            removed++;
+        }
+    }
+    closedir(dir);
+    return removed;
+}
@@ -0,0 +1,558 @@
+#include "dns_resolver.h"
+
+#include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <sys/random.h>
+
+const int DNS_CACHE_SHARDS = 16;
+const uint16_t DNS_TYPE_A = 1;
+const uint16_t DNS_TYPE_SOA = 6;
+const uint16_t DNS_TYPE_AAAA = 28;
+const uint16_t DNS_CLASS_IN = 1;
+const int DNS_RCODE_NXDOMAIN = 3;
+const size_t DNS_MAX_PACKET_SIZE = 4096;
+
+// TTLs from the wire are clamped, a broken zone must not pin an answer forever
+const uint32_t DNS_MAX_TTL = 86400;
+const uint32_t DNS_DEFAULT_NEGATIVE_TTL = 30;
+const uint32_t DNS_MAX_NEGATIVE_TTL = 300;
+
+struct DnsCacheEntry {
+    std::vector<IpAddress> addresses;   // empty for a cached failed lookup
+    time_t expires_at;
+};
+
+// A lookup whose query is in flight, the others for the same name wait for it
+struct DnsPendingLookup {
+    bool done;
+    bool resolved;
+    std::vector<IpAddress> addresses;
+};
+
+struct DnsCacheShard {
+    pthread_mutex_t mutex;
+    pthread_cond_t lookup_done;     // broadcast when a pending lookup of the shard completes
+    std::map<std::string, DnsCacheEntry> entries;
+    std::map<std::string, std::shared_ptr<DnsPendingLookup> > pending;
+};
+
+// Answer to one query, A or AAAA
+struct DnsAnswer {
+    bool received;
+    bool truncated;     // TC bit, the records didn't fit into the UDP reply
+    int rcode;
+    std::vector<IpAddress> addresses;
+    uint32_t ttl;
+    uint32_t negative_ttl;
+};
+
+enum DnsLookupResult {
+    DNS_RESOLVED,
+    DNS_NOT_FOUND,      // authoritative "no such name/records", cached negatively
+    DNS_FAILED          // timeout or server failure, not cached
+};
+
+static pthread_once_t dns_init_once = PTHREAD_ONCE_INIT;
+static DnsCacheShard dns_cache_shards[DNS_CACHE_SHARDS];
+static std::map<std::string, std::vector<IpAddress> > hosts_file_entries;
+
+static struct sockaddr_storage nameserver_address;
+static socklen_t nameserver_address_length = 0;
+static int query_timeout_ms = 2000;
+static int query_attempts = 2;
+
+std::string IpAddress::to_string() const
+{
+    char buffer[INET6_ADDRSTRLEN];
+    if (inet_ntop(family, bytes, buffer, sizeof(buffer)) == NULL)
+        return "";
+    return buffer;
+}
+
+static time_t monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static long monotonic_milliseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+static bool parse_ip_literal(const std::string &text, IpAddress &address)
+{
+    memset(&address, 0, sizeof(address));
+    if (inet_pton(AF_INET, text.c_str(), address.bytes) == 1) {
+        address.family = AF_INET;
+        return true;
+    }
+    if (inet_pton(AF_INET6, text.c_str(), address.bytes) == 1) {
+        address.family = AF_INET6;
+        return true;
+    }
+    return false;
+}
+
+static std::string normalize_hostname(const std::string &hostname)
+{
+    std::string result = hostname;
+    std::transform(result.begin(), result.end(), result.begin(), ::tolower);
+    if (!result.empty() && result[result.size() - 1] == '.')
+        result.erase(result.size() - 1);
+    return result;
+}
+
+static bool set_nameserver(const std::string &nameserver)
+{
+    // "IP", "IPv4:PORT" or "[IPv6]:PORT"
+    std::string host = nameserver;
+    int port = 53;
+    if (!host.empty() && host[0] == '[') {
+        std::string::size_type closing = host.find(']');
+        if (closing == std::string::npos)
+            return false;
+        if (closing + 1 < host.size() && host[closing + 1] == ':')
+            port = atoi(host.c_str() + closing + 2);
+        host = host.substr(1, closing - 1);
+    } else if (std::count(host.begin(), host.end(), ':') == 1) {
+        port = atoi(split(host, ':')[1].c_str());
+        host = split(host, ':')[0];
+    }
+
+    IpAddress address;
+    if (!parse_ip_literal(host, address) || port <= 0)
+        return false;
+
+    memset(&nameserver_address, 0, sizeof(nameserver_address));
+    if (address.family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)&nameserver_address;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        memcpy(&sin->sin_addr, address.bytes, 4);
+        nameserver_address_length = sizeof(struct sockaddr_in);
+    } else {
+        struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&nameserver_address;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        memcpy(&sin6->sin6_addr, address.bytes, 16);
+        nameserver_address_length = sizeof(struct sockaddr_in6);
+    }
+    return true;
+}
+
+static void load_hosts_file()
+{
+    std::ifstream is("/etc/hosts");
+    std::string line;
+    while (std::getline(is, line)) {
+        line = split(line, '#')[0];
+        std::stringstream ss(line);
+        std::string ip, name;
+        IpAddress address;
+        if (!(ss >> ip) || !parse_ip_literal(ip, address))
+            continue;
+        while (ss >> name)
+            hosts_file_entries[normalize_hostname(name)].push_back(address);
+    }
+}
+
+static void initialize_dns_resolver()
+{
+    for (int i = 0; i < DNS_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&dns_cache_shards[i].mutex, NULL);
+        pthread_cond_init(&dns_cache_shards[i].lookup_done, NULL);
+    }
+
+    load_hosts_file();
+
+    std::ifstream is("/etc/resolv.conf");
+    std::string line;
+    while (nameserver_address_length == 0 && std::getline(is, line)) {
+        std::stringstream ss(line);
+        std::string keyword, value;
+        if ((ss >> keyword >> value) && keyword == "nameserver")
+            set_nameserver(value);
+    }
+    if (nameserver_address_length == 0)
+        set_nameserver("127.0.0.1");
+}
+
+void configure_dns_resolver(const std::string &nameserver, int timeout_ms, int attempts)
+{
+    pthread_once(&dns_init_once, initialize_dns_resolver);
+    if (!nameserver.empty() && !set_nameserver(nameserver))
+        print_error_and_die("Invalid DNS server address " + nameserver);
+    query_timeout_ms = timeout_ms;
+    query_attempts = attempts;
+}
+
+static DnsCacheShard& get_cache_shard(const std::string &hostname)
+{
+    size_t hash = 5381;
+    for (size_t i = 0; i < hostname.size(); i++)
+        hash = hash * 33 + (unsigned char)hostname[i];
+    return dns_cache_shards[hash % DNS_CACHE_SHARDS];
+}
+
+void clear_dns_cache()
+{
+    pthread_once(&dns_init_once, initialize_dns_resolver);
+    for (int i = 0; i < DNS_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&dns_cache_shards[i].mutex);
+        dns_cache_shards[i].entries.clear();
+        pthread_mutex_unlock(&dns_cache_shards[i].mutex);
+    }
+}
+
+static uint16_t read_uint16(const unsigned char *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t read_uint32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void append_uint16(std::string &packet, uint16_t value)
+{
+    packet += (char)(value >> 8);
+    packet += (char)(value & 0xFF);
+}
+
+static bool build_query(uint16_t id, const std::string &hostname, uint16_t type, std::string &packet)
+{
+    packet.clear();
+    append_uint16(packet, id);
+    append_uint16(packet, 0x0100);  // standard query, recursion desired
+    append_uint16(packet, 1);       // one question
+    append_uint16(packet, 0);
+    append_uint16(packet, 0);
+    append_uint16(packet, 0);
+
+    std::vector<std::string> labels = split_all(hostname, '.');
+    for (size_t i = 0; i < labels.size(); i++) {
+        if (labels[i].empty() || labels[i].size() > 63)
+            return false;
+        packet += (char)labels[i].size();
+        packet += labels[i];
+    }
+    packet += '\0';
+
+    append_uint16(packet, type);
+    append_uint16(packet, DNS_CLASS_IN);
+    return true;
+}
+
+static bool skip_name(const unsigned char *packet, size_t length, size_t &offset)
+{
+    while (offset < length) {
+        unsigned char label_length = packet[offset];
+        if ((label_length & 0xC0) == 0xC0) {
+            // Compression pointer ends the name
+            offset += 2;
+            return offset <= length;
+        }
+        if (label_length & 0xC0)
+            return false;
+        offset += 1 + label_length;
+        if (label_length == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool parse_response(const unsigned char *packet, size_t length, uint16_t type, DnsAnswer &answer)
+{
+    if (length < 12 || !(packet[2] & 0x80))
+        return false;
+
+    answer.truncated = (packet[2] & 0x02) != 0;
+    answer.rcode = packet[3] & 0x0F;
+    answer.addresses.clear();
+    answer.ttl = DNS_MAX_TTL;
+    answer.negative_ttl = DNS_DEFAULT_NEGATIVE_TTL;
+
+    uint16_t questions = read_uint16(packet + 4);
+    uint16_t answers = read_uint16(packet + 6);
+    uint16_t authorities = read_uint16(packet + 8);
+
+    size_t offset = 12;
+    for (int i = 0; i < questions; i++) {
+        if (!skip_name(packet, length, offset) || offset + 4 > length)
+            return false;
+        offset += 4;
+    }
+
+    for (int i = 0; i < answers + authorities; i++) {
+        if (!skip_name(packet, length, offset) || offset + 10 > length)
+            return false;
+        uint16_t record_type = read_uint16(packet + offset);
+        uint16_t record_class = read_uint16(packet + offset + 2);
+        uint32_t record_ttl = read_uint32(packet + offset + 4);
+        uint16_t data_length = read_uint16(packet + offset + 8);
+        offset += 10;
+        if (offset + data_length > length)
+            return false;
+
+        if (i < answers && record_class == DNS_CLASS_IN && record_type == type &&
+            data_length == (type == DNS_TYPE_A ? 4 : 16)) {
+            IpAddress address;
+            memset(&address, 0, sizeof(address));
+            address.family = (type == DNS_TYPE_A) ? AF_INET : AF_INET6;
+            memcpy(address.bytes, packet + offset, data_length);
+            answer.addresses.push_back(address);
+            answer.ttl = std::min(answer.ttl, record_ttl);
+        } else if (i >= answers && record_type == DNS_TYPE_SOA && data_length >= 20) {
+            // RFC 2308: negative answers live for min(SOA TTL, SOA MINIMUM)
+            uint32_t minimum = read_uint32(packet + offset + data_length - 4);
+            answer.negative_ttl = std::min(std::min(record_ttl, minimum), DNS_MAX_NEGATIVE_TTL);
+        }
+        offset += data_length;
+    }
+    return true;
+}
+
+static uint16_t random_query_id()
+{
+    uint16_t id;
+    if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+        id = (uint16_t)rand();
+    return id;
+}
+
+// Waits for the events on the socket until the deadline, false on timeout
+static bool wait_for_socket(int sd, short events, long deadline)
+{
+    struct pollfd pfd;
+    pfd.fd = sd;
+    pfd.events = events;
+    while (true) {
+        long timeout = deadline - monotonic_milliseconds();
+        if (timeout <= 0)
+            return false;
+        int ready = poll(&pfd, 1, timeout);
+        if (ready > 0)
+            return true;
+        if (ready < 0 && errno != EINTR)
+            return false;
+    }
+}
+
+/**
+ * Sends the query again over TCP (RFC 7766), for a reply that was truncated
+ * over UDP. False unless a complete answer came within the query timeout.
+ */
+static bool query_over_tcp(const std::string &query, uint16_t id, uint16_t type, DnsAnswer &answer)
+{
+    int sd = socket(nameserver_address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+        return false;
+    long deadline = monotonic_milliseconds() + query_timeout_ms;
+    if (connect(sd, (struct sockaddr *)&nameserver_address, nameserver_address_length) != 0 && errno != EINPROGRESS) {
+        close(sd);
+        return false;
+    }
+
+    // Messages over TCP are prefixed with their length
+    std::string message;
+    append_uint16(message, query.size());
+    message += query;
+    size_t sent = 0;
+    while (sent < message.size() && wait_for_socket(sd, POLLOUT, deadline)) {
+        ssize_t n = send(sd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+            break;
+        if (n > 0)
+            sent += n;
+    }
+
+    std::string reply;
+    size_t expected = 2;
+    unsigned char buffer[DNS_MAX_PACKET_SIZE];
+    while (sent == message.size() && reply.size() < expected && wait_for_socket(sd, POLLIN, deadline)) {
+        ssize_t n = recv(sd, buffer, sizeof(buffer), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+            break;
+        if (n > 0)
+            reply.append((const char *)buffer, n);
+        if (reply.size() >= 2)
+            expected = 2 + read_uint16((const unsigned char *)reply.data());
+    }
+    close(sd);
+
+    if (reply.size() < expected || expected < 4)
+        return false;
+    const unsigned char *packet = (const unsigned char *)reply.data() + 2;
+    return read_uint16(packet) == id && parse_response(packet, expected - 2, type, answer) && !answer.truncated;
+}
+
+/**
+ * Sends the A and AAAA queries together over one connected non-blocking UDP
+ * socket and polls for both replies, re-sending unanswered queries on timeout.
+ */
+static DnsLookupResult query_nameserver(const std::string &hostname, std::vector<IpAddress> &addresses,
+                                        uint32_t &ttl)
+{
+    const uint16_t types[2] = { DNS_TYPE_A, DNS_TYPE_AAAA };
+    uint16_t ids[2];
+    std::string queries[2];
+    DnsAnswer answers[2];
+    ids[0] = random_query_id();
+    do {
+        ids[1] = random_query_id();
+    } while (ids[1] == ids[0]);
+
+    for (int i = 0; i < 2; i++) {
+        answers[i].received = false;
+        if (!build_query(ids[i], hostname, types[i], queries[i]))
+            return DNS_NOT_FOUND;
+    }
+
+    int sd = socket(nameserver_address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sd < 0)
+        return DNS_FAILED;
+    // Connected, so the kernel drops datagrams from anybody but the nameserver
+    if (connect(sd, (struct sockaddr *)&nameserver_address, nameserver_address_length) != 0) {
+        close(sd);
+        return DNS_FAILED;
+    }
+
+    unsigned char packet[DNS_MAX_PACKET_SIZE];
+    for (int attempt = 0; attempt < query_attempts && !(answers[0].received && answers[1].received); attempt++) {
+        for (int i = 0; i < 2; i++) {
+            if (!answers[i].received)
+                send(sd, queries[i].data(), queries[i].size(), 0);
+        }
+
+        long deadline = monotonic_milliseconds() + query_timeout_ms;
+        while (!(answers[0].received && answers[1].received)) {
+            long timeout = deadline - monotonic_milliseconds();
+            if (timeout <= 0)
+                break;
+            struct pollfd pfd;
+            pfd.fd = sd;
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, timeout) <= 0)
+                continue;
+
+            ssize_t length;
+            while ((length = recv(sd, packet, sizeof(packet), 0)) > 0) {
+                if (length < 2)
+                    continue;
+                uint16_t id = read_uint16(packet);
+                for (int i = 0; i < 2; i++) {
+                    if (id == ids[i] && !answers[i].received && parse_response(packet, length, types[i], answers[i]))
+                        answers[i].received = true;
+                }
+            }
+        }
+    }
+    close(sd);
+
+    for (int i = 0; i < 2; i++) {
+        // A truncated reply lacks records, so only the complete answer from TCP is used
+        if (answers[i].received && answers[i].truncated && !query_over_tcp(queries[i], ids[i], types[i], answers[i]))
+            return DNS_FAILED;
+    }
+
+    addresses.clear();
+    ttl = DNS_MAX_TTL;
+    uint32_t negative_ttl = DNS_MAX_NEGATIVE_TTL;
+    bool authoritative_miss = true;
+    for (int i = 0; i < 2; i++) {
+        if (!answers[i].received || (answers[i].rcode != 0 && answers[i].rcode != DNS_RCODE_NXDOMAIN)) {
+            authoritative_miss = false;
+            continue;
+        }
+        addresses.insert(addresses.end(), answers[i].addresses.begin(), answers[i].addresses.end());
+        if (!answers[i].addresses.empty())
+            ttl = std::min(ttl, answers[i].ttl);
+        negative_ttl = std::min(negative_ttl, answers[i].negative_ttl);
+    }
+
+    if (!addresses.empty())
+        return DNS_RESOLVED;
+    if (authoritative_miss) {
+        ttl = negative_ttl;
+        return DNS_NOT_FOUND;
+    }
+    return DNS_FAILED;
+}
+
+bool resolve_hostname(const std::string &hostname, std::vector<IpAddress> &addresses)
+{
+    pthread_once(&dns_init_once, initialize_dns_resolver);
+
+    addresses.clear();
+    IpAddress literal;
+    if (parse_ip_literal(hostname, literal)) {
+        addresses.push_back(literal);
+        return true;
+    }
+
+    std::string name = normalize_hostname(hostname);
+    if (name.empty())
+        return false;
+    if (hosts_file_entries.find(name) != hosts_file_entries.end()) {
+        addresses = hosts_file_entries[name];
+        return true;
+    }
+
+    DnsCacheShard &shard = get_cache_shard(name);
+    time_t now = monotonic_seconds();
+    pthread_mutex_lock(&shard.mutex);
+    std::map<std::string, DnsCacheEntry>::iterator it = shard.entries.find(name);
+    if (it != shard.entries.end()) {
+        if (it->second.expires_at > now) {
+            addresses = it->second.addresses;
+            pthread_mutex_unlock(&shard.mutex);
+            return !addresses.empty();
+        }
+        shard.entries.erase(it);
+    }
+
+    // Only one query per name is in flight, later misses take its result
+    std::map<std::string, std::shared_ptr<DnsPendingLookup> >::iterator pending_it = shard.pending.find(name);
+    if (pending_it != shard.pending.end()) {
+        std::shared_ptr<DnsPendingLookup> lookup = pending_it->second;
+        while (!lookup->done)
+            pthread_cond_wait(&shard.lookup_done, &shard.mutex);
+        addresses = lookup->addresses;
+        pthread_mutex_unlock(&shard.mutex);
+        return lookup->resolved;
+    }
+    std::shared_ptr<DnsPendingLookup> lookup = std::make_shared<DnsPendingLookup>();
+    lookup->done = false;
+    lookup->resolved = false;
+    shard.pending[name] = lookup;
+    pthread_mutex_unlock(&shard.mutex);
+
+    uint32_t ttl = 0;
+    DnsLookupResult result = query_nameserver(name, addresses, ttl);
+
+    pthread_mutex_lock(&shard.mutex);
+    if (result != DNS_FAILED && ttl > 0) {
+        DnsCacheEntry entry;
+        entry.addresses = addresses;
+        entry.expires_at = monotonic_seconds() + ttl;
+        shard.entries[name] = entry;
+    }
+    lookup->done = true;
+    lookup->resolved = result == DNS_RESOLVED;
+    lookup->addresses = addresses;
+    shard.pending.erase(name);
+    pthread_cond_broadcast(&shard.lookup_done);
+    pthread_mutex_unlock(&shard.mutex);
+
+    if (result == DNS_FAILED)
+        log("DNS lookup of " + name + " failed");
+    else if (result == DNS_NOT_FOUND)
+        log("Hostname " + name + " does not resolve");
+    return result == DNS_RESOLVED;
+}
@@ -0,0 +1,878 @@
+#include "event_loop.h"
+#include "request_handler.h"
+
+#include <deque>
+#include <list>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+const int EPOLL_MAX_EVENTS = 256;
+const int READ_CHUNK_SIZE = 16384;
+
+// Pipelined requests buffered while one is processed; reading pauses beyond that
+const size_t PIPELINED_INPUT_LIMIT = 65536;
+
+// Streamed body bytes a handler may hand over before it lets go of the body until the client took them
+const size_t STREAM_BUFFER_LIMIT = 262144;
+
+// Markers stored in epoll_event.data.ptr for the non-client descriptors
+static char LISTENER_MARKER;
+static char WAKEUP_MARKER;
+
+struct EventLoop;
+struct ClientConnection;
+
+/*
+ Hand-over of a streamed reply body from the handler thread reading it to the
+ event loop writing it. While too much is buffered the body is parked in the
+ pipe and the handler thread goes back to other requests; the loop hands the
+ body to a handler again once the client took the bytes. A slow client thus
+ holds back the download instead of growing the buffer or holding a thread.
+ The loop frees the pipe once both sides are done with it.
+*/
+struct StreamPipe {
+    pthread_mutex_t mutex;
+    std::string data;           // framed body bytes not taken by the loop yet
+    BodyStream *body_stream;    // read by one handler at a time, deleted by the last one
+    bool chunked;
+    bool parked;                // no handler reads the body until the loop resumes it
+    bool handler_done;          // the handler won't touch the pipe anymore
+    bool failed;                // the body could not be read completely
+    bool loop_released;         // the loop takes no more data, the client is gone or served
+    bool update_pending;        // the loop has been notified and didn't look yet
+
+    EventLoop *loop;
+    ClientConnection *connection;   // loop side only
+};
+
+/*
+ Per-client state machine. A connection is owned by the event loop thread
+ that accepted it; handler threads never touch it, they only post results.
+ Persistent connections go back to READING_REQUEST after each reply. Only one
+ request is processed at a time, so pipelined replies keep the request order.
+*/
+struct ClientConnection {
+    enum State {
+        READING_REQUEST,
+        PROCESSING,
+        WRITING_RESPONSE
+    } state;
+    int fd;
+    HostInfo client_info;
+    EventLoop *loop;
+    std::string input;
+    HttpParser *request_parser; // progress on a partly received request, NULL between requests
+    ClientResponse *output;     // reply being written, NULL otherwise
+    size_t output_offset;       // bytes of it sent so far
+    StreamPipe *pipe;           // streamed body of the reply, if any
+    std::string stream_output;  // part of the streamed body taken from the pipe
+    size_t stream_offset;
+    size_t stream_sent;         // streamed bytes sent in total
+    bool stream_finished;       // the whole streamed body was taken from the pipe
+    bool stream_failed;
+    bool peer_closed;
+    bool input_paused;          // unread data left in the kernel while the input buffer is full
+    bool keep_alive;            // keep the connection open after the current reply
+    int requests_served;
+
+    // Position in the loop's activity list, unless processing
+    time_t last_activity;
+    std::list<ClientConnection*>::iterator activity_position;
+    bool in_activity_list;
+};
+
+struct HandlerJob {
+    ClientConnection *connection;
+    EventLoop *loop;
+    HostInfo client_info;
+    HttpMessage *request;
+    bool keep_alive;
+    StreamPipe *resumed_pipe;   // instead of a request, a parked body to read on
+};
+
+struct HandlerResult {
+    ClientConnection *connection;
+    ClientResponse *response;
+    StreamPipe *pipe;
+    bool keep_alive;
+};
+
+struct EventLoop {
+    int epoll_fd;
+    int wakeup_fd;
+    int listening_socket;
+    int keep_alive_timeout;
+    int max_keep_alive_requests;
+
+    // Connections reading or writing, least recently active first
+    std::list<ClientConnection*> activity_list;
+
+    pthread_mutex_t results_mutex;
+    std::vector<HandlerResult> results;
+    std::vector<StreamPipe*> stream_updates;   // pipes with new data or a finished handler
+};
+
+pthread_mutex_t handler_jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t handler_jobs_cond = PTHREAD_COND_INITIALIZER;
+std::deque<HandlerJob> handler_jobs;
+
+static time_t monotonic_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
+
+static void set_non_blocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        print_error_and_die("Error while making socket non-blocking");
+}
+
+// Every connection costs a descriptor, the default soft limit of 1024 is far too low
+static void raise_open_files_limit()
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+            log("Unable to raise the open files limit");
+    }
+}
+
+static void wake_up_event_loop(EventLoop *loop)
+{
+    uint64_t one = 1;
+    if (write(loop->wakeup_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        log("Error while waking up event loop");
+}
+
+static void post_handler_result(EventLoop *loop, const HandlerResult &result)
+{
+    pthread_mutex_lock(&loop->results_mutex);
+    loop->results.push_back(result);
+    pthread_mutex_unlock(&loop->results_mutex);
+    wake_up_event_loop(loop);
+}
+
+static StreamPipe* create_stream_pipe(EventLoop *loop, BodyStream *body_stream, bool chunked)
+{
+    StreamPipe *pipe = new StreamPipe();
+    pthread_mutex_init(&pipe->mutex, NULL);
+    pipe->body_stream = body_stream;
+    pipe->chunked = chunked;
+    pipe->parked = false;
+    pipe->handler_done = false;
+    pipe->failed = false;
+    pipe->loop_released = false;
+    pipe->update_pending = false;
+    pipe->loop = loop;
+    pipe->connection = NULL;
+    return pipe;
+}
+
+static void destroy_stream_pipe(StreamPipe *pipe)
+{
+    pthread_mutex_destroy(&pipe->mutex);
+    delete pipe;
+}
+
+// Handler side, called with the pipe's mutex held. At most one update per pipe
+// is pending, so the loop never sees a pipe in its list that is already freed.
+static bool needs_stream_update(StreamPipe *pipe)
+{
+    bool notify = !pipe->update_pending;
+    pipe->update_pending = true;
+    return notify;
+}
+
+static void post_stream_update(EventLoop *loop, StreamPipe *pipe)
+{
+    pthread_mutex_lock(&loop->results_mutex);
+    loop->stream_updates.push_back(pipe);
+    pthread_mutex_unlock(&loop->results_mutex);
+    wake_up_event_loop(loop);
+}
+
+// Appends the bytes. Returns false once the loop released the pipe.
+static bool push_to_stream_pipe(StreamPipe *pipe, const std::string &bytes)
+{
+    pthread_mutex_lock(&pipe->mutex);
+    bool released = pipe->loop_released;
+    bool notify = false;
+    if (!released) {
+        pipe->data += bytes;
+        notify = needs_stream_update(pipe);
+    }
+    pthread_mutex_unlock(&pipe->mutex);
+
+    if (notify)
+        post_stream_update(pipe->loop, pipe);
+    return !released;
+}
+
+// Whether the loop still takes data and has room for it; if not the body is parked while the client has enough to take
+static bool should_read_on(StreamPipe *pipe, bool &parked)
+{
+    pthread_mutex_lock(&pipe->mutex);
+    parked = pipe->data.size() >= STREAM_BUFFER_LIMIT && !pipe->loop_released;
+    pipe->parked = parked;
+    bool read_on = !parked && !pipe->loop_released;
+    pthread_mutex_unlock(&pipe->mutex);
+    return read_on;
+}
+
+// The handler's last access to the pipe
+static void finish_stream_pipe(StreamPipe *pipe, bool failed)
+{
+    delete pipe->body_stream;
+    pipe->body_stream = NULL;
+
+    pthread_mutex_lock(&pipe->mutex);
+    pipe->handler_done = true;
+    pipe->failed = failed;
+    bool notify = needs_stream_update(pipe);
+    pthread_mutex_unlock(&pipe->mutex);
+
+    if (notify)
+        post_stream_update(pipe->loop, pipe);
+}
+
+/**
+ * Reads the body on the handler thread and hands it to the loop, framed for
+ * the client, until it ends or the pipe is full. In the latter case the body
+ * stays parked in the pipe and the thread returns to other requests.
+ */
+static void pump_body_stream(StreamPipe *pipe)
+{
+    std::string piece;
+    bool failed = false;
+    bool parked = false;
+    while (should_read_on(pipe, parked)) {
+        piece.clear();
+        ssize_t length = pipe->body_stream->read(piece);
+        if (length < 0) {
+            failed = true;
+            break;
+        }
+        if (length == 0 && !pipe->chunked)
+            break;
+
+        // The last chunk of chunked transfer coding is the empty one
+        bool pushed = pipe->chunked ? push_to_stream_pipe(pipe, chunk_size_line(length) + piece + "\r\n")
+                                    : push_to_stream_pipe(pipe, piece);
+        if (!pushed || length == 0)
+            break;
+    }
+    // Once parked, the pipe may already be resumed on another thread
+    if (!parked)
+        finish_stream_pipe(pipe, failed);
+}
+
+static void submit_handler_job(const HandlerJob &job);
+
+// Loop side: a handler reads on the parked body
+static void resume_stream_pipe(StreamPipe *pipe)
+{
+    HandlerJob job;
+    job.connection = NULL;
+    job.loop = pipe->loop;
+    job.request = NULL;
+    job.keep_alive = false;
+    job.resumed_pipe = pipe;
+    submit_handler_job(job);
+}
+
+// Loop side: no more data is taken from the pipe, a parked body is handed back to be deleted
+static void release_stream_pipe(StreamPipe *pipe)
+{
+    pthread_mutex_lock(&pipe->mutex);
+    pipe->loop_released = true;
+    pipe->connection = NULL;
+    bool resume = pipe->parked;
+    pipe->parked = false;
+    bool can_free = pipe->handler_done && !pipe->update_pending;
+    pthread_mutex_unlock(&pipe->mutex);
+
+    if (resume)
+        resume_stream_pipe(pipe);
+    if (can_free)
+        destroy_stream_pipe(pipe);
+}
+
+static void* run_request_handler(void *arg)
+{
+    while (true) {
+        pthread_mutex_lock(&handler_jobs_mutex);
+        while (handler_jobs.empty())
+            pthread_cond_wait(&handler_jobs_cond, &handler_jobs_mutex);
+        HandlerJob job = handler_jobs.front();
+        handler_jobs.pop_front();
+        pthread_mutex_unlock(&handler_jobs_mutex);
+
+        if (job.resumed_pipe != NULL) {
+            pump_body_stream(job.resumed_pipe);
+            continue;
+        }
+
+        HandlerResult result;
+        result.connection = job.connection;
+        result.response = process_client_request(*job.request, job.client_info);
+        result.keep_alive = set_connection_header(*result.response, job.keep_alive);
+        delete job.request;
+
+        // A streamed body is read by the handler threads, the loop only gets its bytes
+        BodyStream *body_stream = result.response->body_stream;
+        result.response->body_stream = NULL;
+        result.pipe = (body_stream != NULL) ? create_stream_pipe(job.loop, body_stream, result.response->chunked) : NULL;
+
+        post_handler_result(job.loop, result);
+        if (result.pipe != NULL)
+            pump_body_stream(result.pipe);
+    }
+    return NULL;
+}
+
+static void submit_handler_job(const HandlerJob &job)
+{
+    pthread_mutex_lock(&handler_jobs_mutex);
+    handler_jobs.push_back(job);
+    pthread_cond_signal(&handler_jobs_cond);
+    pthread_mutex_unlock(&handler_jobs_mutex);
+}
+
+// Marks the connection as active now, idle ones are closed from the front of the list
+static void touch_connection(ClientConnection *connection)
+{
+    EventLoop *loop = connection->loop;
+    if (connection->in_activity_list)
+        loop->activity_list.erase(connection->activity_position);
+    connection->last_activity = monotonic_seconds();
+    connection->activity_position = loop->activity_list.insert(loop->activity_list.end(), connection);
+    connection->in_activity_list = true;
+}
+
+// Handlers may take arbitrarily long, a connection waiting for one never times out
+static void untrack_connection(ClientConnection *connection)
+{
+    if (connection->in_activity_list) {
+        connection->loop->activity_list.erase(connection->activity_position);
+        connection->in_activity_list = false;
+    }
+}
+
+static void free_connection(ClientConnection *connection)
+{
+    delete connection->output;
+    delete connection->request_parser;
+    delete connection;
+}
+
+static void close_connection(ClientConnection *connection)
+{
+    untrack_connection(connection);
+
+    // Closing the descriptor also removes it from the epoll set
+    close(connection->fd);
+    connection->fd = -1;
+
+    if (connection->pipe != NULL) {
+        release_stream_pipe(connection->pipe);
+        connection->pipe = NULL;
+    }
+
+    // A handler still works on this connection - it gets freed when the result arrives
+    if (connection->state != ClientConnection::PROCESSING)
+        free_connection(connection);
+}
+
+// Reads everything the kernel has buffered for the connection. Returns false
+// on socket errors; an orderly shutdown by the peer only sets peer_closed, as
+// the peer may still wait for the reply to a request it has sent.
+static bool read_available_input(ClientConnection *connection)
+{
+    char buffer[READ_CHUNK_SIZE];
+    while (true) {
+        // Requests pipelined behind the one being processed stay in the kernel once enough are buffered
+        if (connection->state != ClientConnection::READING_REQUEST &&
+            connection->input.size() >= PIPELINED_INPUT_LIMIT) {
+            connection->input_paused = true;
+            return true;
+        }
+
+        ssize_t bytes_read = recv(connection->fd, buffer, sizeof(buffer), 0);
+        if (bytes_read > 0) {
+            connection->input.append(buffer, bytes_read);
+            continue;
+        }
+        if (bytes_read == 0) {
+            connection->peer_closed = true;
+            return true;
+        }
+        if (errno == EINTR)
+            continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+}
+
+// Moves what the handler produced into the connection's output. Returns false
+// if the handler failed to read the body, the reply can't be completed then.
+static bool take_stream_output(ClientConnection *connection)
+{
+    StreamPipe *pipe = connection->pipe;
+    pthread_mutex_lock(&pipe->mutex);
+    connection->stream_output.swap(pipe->data);
+    connection->stream_finished = pipe->handler_done;
+    connection->stream_failed = pipe->failed;
+    bool resume = pipe->parked;
+    pipe->parked = false;
+    pthread_mutex_unlock(&pipe->mutex);
+
+    if (resume)
+        resume_stream_pipe(pipe);
+    return !connection->stream_failed;
+}
+
+// Sends as much of the pending reply as the socket accepts. Returns false on error.
+// The head and an in-memory body go out with one gathered write, a cached body
+// with sendfile() straight from the cache file.
+static bool write_pending_output(ClientConnection *connection)
+{
+    const ClientResponse *response = connection->output;
+    size_t head_size = response->head.size();
+    const std::string &body = response->memory_body();
+    size_t memory_size = head_size + (response->body_fd < 0 ? body.size() : 0);
+
+    while (connection->output_offset < response->size()) {
+        size_t offset = connection->output_offset;
+        ssize_t bytes_sent;
+        if (offset < memory_size) {
+            struct iovec buffers[2];
+            int count = 0;
+            if (offset < head_size) {
+                buffers[count].iov_base = (void *)(response->head.data() + offset);
+                buffers[count].iov_len = head_size - offset;
+                count++;
+            }
+            if (response->body_fd < 0) {
+                size_t body_offset = offset > head_size ? offset - head_size : 0;
+                buffers[count].iov_base = (void *)(body.data() + body_offset);
+                buffers[count].iov_len = body.size() - body_offset;
+                count++;
+            }
+
+            struct msghdr message;
+            memset(&message, 0, sizeof(message));
+            message.msg_iov = buffers;
+            message.msg_iovlen = count;
+            bytes_sent = sendmsg(connection->fd, &message, MSG_NOSIGNAL | (response->body_fd >= 0 ? MSG_MORE : 0));
+        } else {
+            off_t file_offset = response->body_offset + (offset - head_size);
+            bytes_sent = sendfile(connection->fd, response->body_fd, &file_offset, response->size() - offset);
+        }
+
+        if (bytes_sent > 0) {
+            connection->output_offset += bytes_sent;
+            continue;
+        }
+        if (bytes_sent < 0 && errno == EINTR)
+            continue;
+        return bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    if (connection->pipe == NULL)
+        return true;
+
+    // Then the streamed body, as far as the handler has produced it
+    while (true) {
+        if (connection->stream_offset == connection->stream_output.size()) {
+            connection->stream_output.clear();
+            connection->stream_offset = 0;
+            if (connection->stream_finished || !take_stream_output(connection))
+                return !connection->stream_failed;
+            if (connection->stream_output.empty())
+                return true;
+        }
+
+        ssize_t bytes_sent = send(connection->fd, connection->stream_output.data() + connection->stream_offset,
+                                  connection->stream_output.size() - connection->stream_offset, MSG_NOSIGNAL);
+        if (bytes_sent > 0) {
+            connection->stream_offset += bytes_sent;
+            connection->stream_sent += bytes_sent;
+            continue;
+        }
+        if (bytes_sent < 0 && errno == EINTR)
+            continue;
+        return bytes_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+}
+
+static bool is_output_complete(ClientConnection *connection)
+{
+    if (connection->output_offset < connection->output->size())
+        return false;
+    return connection->pipe == NULL ||
+           (connection->stream_finished && connection->stream_offset == connection->stream_output.size());
+}
+
+// The streamed body is drained, only the handler can provide more
+static bool is_waiting_for_stream(ClientConnection *connection)
+{
+    return connection->pipe != NULL && !connection->stream_finished &&
+           connection->output_offset == connection->output->size() &&
+           connection->stream_offset == connection->stream_output.size();
+}
+
+static bool start_next_request(ClientConnection *connection);
+
+// Called once the reply is sent. Returns false if the connection got closed.
+static bool finish_response(ClientConnection *connection)
+{
+    if (!connection->keep_alive) {
+        close_connection(connection);
+        return false;
+    }
+
+    connection->state = ClientConnection::READING_REQUEST;
+    delete connection->output;
+    connection->output = NULL;
+    connection->output_offset = 0;
+    if (connection->pipe != NULL) {
+        release_stream_pipe(connection->pipe);
+        connection->pipe = NULL;
+        connection->stream_output.clear();
+        connection->stream_offset = 0;
+        connection->stream_finished = false;
+    }
+    touch_connection(connection);
+
+    // Edge-triggered: data left in the kernel while paused raises no new event
+    if (connection->input_paused) {
+        connection->input_paused = false;
+        if (!read_available_input(connection)) {
+            close_connection(connection);
+            return false;
+        }
+    }
+    return start_next_request(connection);
+}
+
+// Sends what the socket accepts now. Returns false if the connection got closed.
+static bool continue_writing_response(ClientConnection *connection)
+{
+    size_t sent_before = connection->output_offset + connection->stream_sent;
+    if (!write_pending_output(connection)) {
+        close_connection(connection);
+        return false;
+    }
+    if (is_output_complete(connection))
+        return finish_response(connection);
+
+    // A slow target server is no reason to time the client out
+    if (is_waiting_for_stream(connection))
+        untrack_connection(connection);
+    else if (connection->output_offset + connection->stream_sent != sent_before)
+        touch_connection(connection);
+    return true;
+}
+
+// Returns false if the connection got closed and must not be used anymore
+static bool start_writing_response(ClientConnection *connection, ClientResponse *response, StreamPipe *pipe=NULL)
+{
+    connection->state = ClientConnection::WRITING_RESPONSE;
+    connection->output = response;
+    connection->output_offset = 0;
+    connection->pipe = pipe;
+    if (pipe != NULL)
+        pipe->connection = connection;
+    touch_connection(connection);
+    return continue_writing_response(connection);
+}
+
+// Hands the next complete buffered request to a handler. Returns false if the
+// connection got closed and must not be used anymore.
+static bool start_next_request(ClientConnection *connection)
+{
+    // Idle connections don't carry a parser, it's only needed once bytes arrive
+    bool malformed = false;
+    HttpMessage *request = NULL;
+    if (!connection->input.empty()) {
+        if (connection->request_parser == NULL)
+            connection->request_parser = new HttpParser();
+        request = parse_http_request_from_buffer(connection->input, *connection->request_parser, malformed);
+        if (request != NULL && connection->input.empty()) {
+            delete connection->request_parser;
+            connection->request_parser = NULL;
+        }
+    }
+    if (malformed) {
+        HttpMessage *bad_request = make_http_response("400 Bad Request");
+        ClientResponse *response = new ClientResponse();
+        response->head = bad_request->header_to_string();
+        response->body = bad_request->body;
+        delete bad_request;
+        set_connection_header(*response, false);
+        connection->keep_alive = false;
+        return start_writing_response(connection, response);
+    }
+    if (request == NULL) {
+        if (connection->peer_closed) {
+            close_connection(connection);
+            return false;
+        }
+        return true;
+    }
+
+    connection->requests_served++;
+    connection->keep_alive = is_keep_alive(request->header) &&
+                             connection->requests_served < connection->loop->max_keep_alive_requests;
+    connection->state = ClientConnection::PROCESSING;
+    untrack_connection(connection);
+
+    HandlerJob job;
+    job.connection = connection;
+    job.loop = connection->loop;
+    job.client_info = connection->client_info;
+    job.request = request;
+    job.keep_alive = connection->keep_alive;
+    job.resumed_pipe = NULL;
+    submit_handler_job(job);
+    return true;
+}
+
+// Returns false if the connection got closed and must not be used anymore
+static bool on_connection_readable(ClientConnection *connection)
+{
+    size_t input_before = connection->input.size();
+    if (!read_available_input(connection)) {
+        close_connection(connection);
+        return false;
+    }
+    if (connection->state != ClientConnection::READING_REQUEST)
+        return true;
+    if (connection->input.size() != input_before)
+        touch_connection(connection);
+    return start_next_request(connection);
+}
+
+static void on_connection_event(ClientConnection *connection, uint32_t events)
+{
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        close_connection(connection);
+        return;
+    }
+    if ((events & (EPOLLIN | EPOLLRDHUP)) && !on_connection_readable(connection))
+        return;
+    if ((events & EPOLLOUT) && connection->state == ClientConnection::WRITING_RESPONSE)
+        continue_writing_response(connection);
+}
+
+// Closes connections that neither sent nor accepted data for the keep-alive timeout
+static void close_idle_connections(EventLoop *loop)
+{
+    time_t now = monotonic_seconds();
+    while (!loop->activity_list.empty()) {
+        ClientConnection *connection = loop->activity_list.front();
+        if (now - connection->last_activity < loop->keep_alive_timeout)
+            break;
+        close_connection(connection);
+    }
+}
+
+static void accept_new_connections(EventLoop *loop)
+{
+    while (true) {
+        struct sockaddr_in client_address;
+        socklen_t addr_size = static_cast<socklen_t>(sizeof(client_address));
+        int client_sd = accept4(loop->listening_socket, (struct sockaddr*)&client_address, &addr_size,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log("Error in accept(): " + std::string(strerror(errno)));
+            return;
+        }
+
+        ClientConnection *connection = new ClientConnection();
+        connection->state = ClientConnection::READING_REQUEST;
+        connection->fd = client_sd;
+        connection->loop = loop;
+        connection->request_parser = NULL;
+        connection->output = NULL;
+        connection->output_offset = 0;
+        connection->pipe = NULL;
+        connection->stream_offset = 0;
+        connection->stream_sent = 0;
+        connection->stream_finished = false;
+        connection->stream_failed = false;
+        connection->peer_closed = false;
+        connection->input_paused = false;
+        connection->keep_alive = false;
+        connection->requests_served = 0;
+        connection->in_activity_list = false;
+        touch_connection(connection);
+        connection->client_info.socket_fd = client_sd;
+        connection->client_info.hostname = inet_ntoa(client_address.sin_addr);
+        connection->client_info.port = ntohs(client_address.sin_port);
+
+        std::stringstream ss;
+        ss << "New connection from " << connection->client_info.hostname << ":" << connection->client_info.port;
+        log(ss.str());
+
+        // Registered once for both directions, edge-triggered: no epoll_ctl() calls on state changes
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_sd, &event) != 0) {
+            log("Error while adding client socket to epoll");
+            close_connection(connection);
+        }
+    }
+}
+
+static void dispatch_handler_results(EventLoop *loop)
+{
+    uint64_t counter;
+    while (read(loop->wakeup_fd, &counter, sizeof(counter)) > 0)
+        ;
+
+    // A handler posts its result before any update of its pipe, so results go first
+    std::vector<HandlerResult> results;
+    std::vector<StreamPipe*> stream_updates;
+    pthread_mutex_lock(&loop->results_mutex);
+    results.swap(loop->results);
+    stream_updates.swap(loop->stream_updates);
+    pthread_mutex_unlock(&loop->results_mutex);
+
+    for (size_t i = 0; i < results.size(); i++) {
+        ClientConnection *connection = results[i].connection;
+        if (connection->fd < 0) {
+            // The client went away while its request was processed
+            if (results[i].pipe != NULL)
+                release_stream_pipe(results[i].pipe);
+            delete results[i].response;
+            free_connection(connection);
+            continue;
+        }
+        connection->keep_alive = results[i].keep_alive;
+        start_writing_response(connection, results[i].response, results[i].pipe);
+    }
+
+    for (size_t i = 0; i < stream_updates.size(); i++) {
+        StreamPipe *pipe = stream_updates[i];
+        pthread_mutex_lock(&pipe->mutex);
+        pipe->update_pending = false;
+        bool released = pipe->loop_released;
+        bool can_free = released && pipe->handler_done;
+        pthread_mutex_unlock(&pipe->mutex);
+
+        if (can_free) {
+            destroy_stream_pipe(pipe);
+        } else if (!released && pipe->connection->state == ClientConnection::WRITING_RESPONSE) {
+            continue_writing_response(pipe->connection);
+        }
+    }
+}
+
+static void* run_event_loop(void *arg)
+{
+    EventLoop *loop = (EventLoop *)arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    while (true) {
+        // Wakes up at least every second to close idle connections
+        int events_count = epoll_wait(loop->epoll_fd, events, EPOLL_MAX_EVENTS, 1000);
+        if (events_count < 0) {
+            if (errno == EINTR)
+                continue;
+            print_error_and_die("Error in epoll_wait()");
+        }
+
+        // Handler results are dispatched after the other events: finishing a reply
+        // may free a connection that still has an event later in this batch
+        bool results_pending = false;
+        for (int i = 0; i < events_count; i++) {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &LISTENER_MARKER) {
+                accept_new_connections(loop);
+            } else if (ptr == &WAKEUP_MARKER) {
+                results_pending = true;
+            } else {
+                on_connection_event((ClientConnection *)ptr, events[i].events);
+            }
+        }
+        if (results_pending)
+            dispatch_handler_results(loop);
+        close_idle_connections(loop);
+    }
+    return NULL;
+}
+
+static EventLoop* create_event_loop(int listening_socket, const ParsedArguments &arguments)
+{
+    EventLoop *loop = new EventLoop();
+    loop->listening_socket = listening_socket;
+    loop->keep_alive_timeout = arguments.keep_alive_timeout_seconds;
+    loop->max_keep_alive_requests = arguments.max_keep_alive_requests;
+    pthread_mutex_init(&loop->results_mutex, NULL);
+
+    if ((loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        print_error_and_die("Error in epoll_create1()");
+    if ((loop->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        print_error_and_die("Error in eventfd()");
+
+    // EPOLLEXCLUSIVE wakes a single loop per incoming connection instead of all of them
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = &LISTENER_MARKER;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listening_socket, &event) != 0) {
+        event.events = EPOLLIN;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listening_socket, &event) != 0)
+            print_error_and_die("Error while adding listening socket to epoll");
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &WAKEUP_MARKER;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wakeup_fd, &event) != 0)
+        print_error_and_die("Error while adding eventfd to epoll");
+
+    return loop;
+}
+
+void run_event_loop_server(const std::vector<int> &listening_sockets, const ParsedArguments &arguments)
+{
+    raise_open_files_limit();
+    for (size_t i = 0; i < listening_sockets.size(); i++)
+        set_non_blocking(listening_sockets[i]);
+
+    for (int i = 0; i < arguments.handler_threads; i++) {
+        pthread_t handler_thread;
+        if (pthread_create(&handler_thread, NULL, run_request_handler, NULL) != 0)
+            print_error_and_die("Error while spawning request handler thread");
+        pthread_detach(handler_thread);
+    }
+
+    // Every listening socket needs a loop, the kernel hands connections to all of them
+    int loop_count = std::max(arguments.event_threads, (int)listening_sockets.size());
+    std::vector<pthread_t> loop_threads(loop_count);
+    for (int i = 0; i < loop_count; i++) {
+        EventLoop *loop = create_event_loop(listening_sockets[i % listening_sockets.size()], arguments);
+        if (pthread_create(&loop_threads[i], NULL, run_event_loop, loop) != 0)
+            print_error_and_die("Error while spawning event loop thread");
+        if (listening_sockets.size() > 1)
+            pin_thread_to_core(loop_threads[i], i);
+    }
+
+    std::stringstream ss;
+    ss << "Running " << loop_count << " event loop(s) and "
+       << arguments.handler_threads << " request handler thread(s)";
+    log(ss.str());
+
+    for (int i = 0; i < loop_count; i++)
+        pthread_join(loop_threads[i], NULL);
+}
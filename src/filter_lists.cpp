@@ -0,0 +1,229 @@
+#include "filter_lists.h"
+#include "host_blocklist.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+
+// One version of the lists, never changed once published
+struct FilterLists {
+    HostBlocklist blocked_hosts;
+    std::shared_ptr<const WordFilter> word_filter;
+};
+
+static pthread_mutex_t reload_mutex = PTHREAD_MUTEX_INITIALIZER;     // one reload at a time, readers never take it
+static std::string blocklist_path;
+static std::string words_path;
+static FilterLists *current_lists = NULL;
+static unsigned reader_epoch = 0;
+static int epoch_readers[2] = { 0, 0 };     // by parity of the epoch
+static int reload_pipe[2] = { -1, -1 };     // SIGHUP wakes the reloader through it
+static int inotify_fd = -1;
+static std::string watched_names[2];        // of the list files within their directories
+
+/**
+ * Pins the current lists until release_lists(), NULL if none were loaded. A
+ * reload may start a new epoch between reading it and counting ourselves in
+ * it, and wait on the other counter; the count is then moved to the new epoch.
+ */
+static const FilterLists* acquire_lists(unsigned &epoch)
+{
+    unsigned seen = __atomic_load_n(&reader_epoch, __ATOMIC_SEQ_CST);
+    while (true) {
+        epoch = seen & 1;
+        __atomic_add_fetch(&epoch_readers[epoch], 1, __ATOMIC_SEQ_CST);
+        unsigned now = __atomic_load_n(&reader_epoch, __ATOMIC_SEQ_CST);
+        if (now == seen)
+            return __atomic_load_n(&current_lists, __ATOMIC_SEQ_CST);
+        __atomic_sub_fetch(&epoch_readers[epoch], 1, __ATOMIC_SEQ_CST);
+        seen = now;
+    }
+}
+
+static void release_lists(unsigned epoch)
+{
+    __atomic_sub_fetch(&epoch_readers[epoch], 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Publishes the lists and frees the ones they replace. A reader that got the
+ * old pointer was counted in the old epoch while it still was the current
+ * one, so it is waited for.
+ */
+static void publish_lists(FilterLists *lists)
+{
+    std::stringstream ss;
+    ss << "Filtering " << lists->blocked_hosts.rule_count() << " blocked hosts and " << lists->word_filter->word_count()
+       << " words";
+    log(ss.str());
+
+    pthread_mutex_lock(&reload_mutex);
+    FilterLists *old_lists = __atomic_exchange_n(&current_lists, lists, __ATOMIC_SEQ_CST);
+    unsigned old_epoch = __atomic_fetch_add(&reader_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&epoch_readers[old_epoch], __ATOMIC_SEQ_CST) != 0)
+        sched_yield();
+    delete old_lists;
+    pthread_mutex_unlock(&reload_mutex);
+}
+
+// Reads the blocked hosts, one rule per line, false if the file can't be read
+static bool read_blocked_hosts(const std::string &filename, HostBlocklist &hosts)
+{
+    std::ifstream is(filename.c_str());
+    if (!is.is_open())
+        return false;
+    std::string line;
+    while (std::getline(is, line)) {
+        std::string rule = trim(line);
+        if (!rule.empty() && !hosts.add(rule))
+            log("Ignoring the blocklist line " + rule + ", which names no host");
+    }
+    return true;
+}
+
+// Reads and compiles both lists, those of a file that can't be read are left empty
+static FilterLists* read_filter_lists(bool &readable)
+{
+    FilterLists *lists = new FilterLists();
+    std::vector<std::string> words;
+    bool blocklist_read = read_blocked_hosts(blocklist_path, lists->blocked_hosts);
+    bool words_read = read_filter_words(words_path, words);
+    if (!blocklist_read)
+        log("Unable to read the blocklist " + blocklist_path);
+    if (!words_read)
+        log("Unable to read the filtered words " + words_path);
+    readable = blocklist_read && words_read;
+    lists->word_filter = std::make_shared<const WordFilter>(words);
+    return lists;
+}
+
+void load_filter_lists(const std::string &blocklist_filename, const std::string &words_filename)
+{
+    blocklist_path = blocklist_filename;
+    words_path = words_filename;
+    bool readable;
+    publish_lists(read_filter_lists(readable));
+}
+
+bool reload_filter_lists()
+{
+    bool readable;
+    FilterLists *lists = read_filter_lists(readable);
+    if (!readable) {
+        log("Keeping the filter lists in use");
+        delete lists;
+        return false;
+    }
+    publish_lists(lists);
+    return true;
+}
+
+static void request_reload(int signal_number)
+{
+    int saved_errno = errno;
+    char byte = 0;
+    if (write(reload_pipe[1], &byte, 1) < 0) {
+        // A reload is already pending
+    }
+    errno = saved_errno;
+}
+
+static void split_path(const std::string &path, std::string &directory, std::string &name)
+{
+    size_t slash = path.rfind('/');
+    directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    name = slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+static void* run_reloader(void *arg)
+{
+    struct pollfd fds[2];
+    fds[0].fd = reload_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = inotify_fd;
+    fds[1].events = POLLIN;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true) {
+        if (poll(fds, inotify_fd >= 0 ? 2 : 1, -1) < 0) {
+            if (errno != EINTR)
+                print_error_and_die("Error while waiting for changes of the filter lists");
+            continue;
+        }
+
+        bool changed = false;
+        if (fds[0].revents & POLLIN) {
+            while (read(reload_pipe[0], buffer, sizeof(buffer)) > 0)
+                ;
+            log("Got SIGHUP, reloading the filter lists");
+            changed = true;
+        }
+        if (inotify_fd >= 0 && (fds[1].revents & POLLIN)) {
+            ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+            for (ssize_t offset = 0; offset < length; ) {
+                const struct inotify_event *event = (const struct inotify_event *)(buffer + offset);
+                if (event->len > 0 && (watched_names[0] == event->name || watched_names[1] == event->name)) {
+                    log(std::string("Filter list ") + event->name + " changed, reloading the filter lists");
+                    changed = true;
+                }
+                offset += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        if (changed)
+            reload_filter_lists();
+    }
+    return NULL;
+}
+
+void start_filter_lists_reloader()
+{
+    if (pipe2(reload_pipe, O_CLOEXEC | O_NONBLOCK) != 0)
+        print_error_and_die("Error while creating the filter lists reload pipe");
+
+    // The directories are watched, editors often replace a file rather than write it
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    std::string paths[2] = { blocklist_path, words_path };
+    for (int i = 0; i < 2; i++) {
+        std::string directory;
+        split_path(paths[i], directory, watched_names[i]);
+        if (inotify_fd >= 0 && inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+            log("Unable to watch " + directory + " for changes of the filter lists");
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_reload;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGHUP, &action, NULL);
+
+    pthread_t reloader_thread;
+    if (pthread_create(&reloader_thread, NULL, run_reloader, NULL) != 0)
+        print_error_and_die("Error while spawning filter lists reloader thread");
+    pthread_detach(reloader_thread);
+}
+
+bool is_host_blocked(const std::string &hostname)
+{
+    unsigned epoch;
+    const FilterLists *lists = acquire_lists(epoch);
+    bool blocked = lists != NULL && lists->blocked_hosts.blocks(hostname);
+    release_lists(epoch);
+    return blocked;
+}
+
+std::shared_ptr<const WordFilter> current_word_filter()
+{
+    unsigned epoch;
+    const FilterLists *lists = acquire_lists(epoch);
+    std::shared_ptr<const WordFilter> filter;
+    if (lists != NULL)
+        filter = lists->word_filter;
+    release_lists(epoch);
+    return filter ? filter : std::make_shared<const WordFilter>(std::vector<std::string>());
+}
+
+std::string filter_words(const std::string &str)
+{
+    return current_word_filter()->censor(str);
+}
@@ -0,0 +1,120 @@
+#include "utils.h"
+#include "word_filter.h"
+
+#include <dirent.h>
+#include <time.h>
+
+using namespace std;
+
+ParsedArguments parsedArguments;
+
+/*
+ Compares the Aho-Corasick word filter with the word by word search it
+ replaced, on the bodies of the replies stored in a cache directory. Both run
+ with the words of the filter file, then with the list grown to the size of a
+ larger deployment by words that never match.
+*/
+
+const int ROUNDS = 200;
+const size_t LARGE_WORD_LIST = 5000;
+
+// The former filter: one std::string::find pass over the whole page per word
+string legacy_filter_words(const string &str, const vector<string> &words)
+{
+	string str_lowercase = string(str);
+	for (int i = 0; i < str_lowercase.size() - 1; i++) {
+		if (str_lowercase[i] == '<') {
+			while (i < str_lowercase.size() - 1 && str_lowercase[i] != '>') {
+				str_lowercase[i] = ' ';
+				i++;
+			}
+		}
+	}
+
+	string result = string(str);
+	transform(str_lowercase.begin(), str_lowercase.end(), str_lowercase.begin(), ::tolower);
+
+	for (int i = 0; i < words.size(); i++) {
+		const string &word = words[i];
+		string::size_type n = 0;
+		string replacement = "CENSORED";
+		while ((n = str_lowercase.find(word, n)) != string::npos) {
+			str_lowercase.replace(n, word.size(), replacement);
+			result.replace(n, word.size(), replacement);
+			n += replacement.size();
+		}
+	}
+	return result;
+}
+
+double seconds_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void run(const vector<string> &words, const vector<string> &bodies)
+{
+	size_t bytes = 0;
+	size_t different = 0;
+	WordFilter filter(words);
+	for (size_t i = 0; i < bodies.size(); i++) {
+		bytes += bodies[i].size();
+		if (filter.censor(bodies[i]) != legacy_filter_words(bodies[i], words))
+			different++;
+	}
+
+	double start = seconds_now();
+	size_t checksum = 0;
+	for (int round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < bodies.size(); i++)
+			checksum += legacy_filter_words(bodies[i], words).size();
+	}
+	double legacy_elapsed = seconds_now() - start;
+
+	start = seconds_now();
+	for (int round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < bodies.size(); i++)
+			checksum += filter.censor(bodies[i]).size();
+	}
+	double elapsed = seconds_now() - start;
+
+	cout << words.size() << " words: find per word " << legacy_elapsed * 1e9 / (ROUNDS * bytes) << " ns/byte, "
+	     << "Aho-Corasick " << elapsed * 1e9 / (ROUNDS * bytes) << " ns/byte, "
+	     << different << " bodies censored differently (checksum " << checksum << ")" << endl;
+}
+
+int main(int argc, char **argv)
+{
+	string directory = argc > 1 ? argv[1] : "./cache";
+	string words_file = argc > 2 ? argv[2] : "./filter_words.txt";
+	DIR *dir = opendir(directory.c_str());
+	if (dir == NULL) {
+		cerr << "Usage: " << argv[0] << " [CACHE_DIRECTORY] [WORDS_FILTER]" << endl;
+		return 1;
+	}
+
+	vector<string> bodies;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		ifstream file((directory + "/" + entry->d_name).c_str(), ios::binary);
+		stringstream contents;
+		contents << file.rdbuf();
+		size_t head_end = contents.str().find("\r\n\r\n");
+		if (head_end != string::npos && head_end + 4 < contents.str().size())
+			bodies.push_back(contents.str().substr(head_end + 4));
+	}
+	closedir(dir);
+
+	vector<string> words;
+	read_filter_words(words_file, words);
+	cout << bodies.size() << " bodies from " << directory << endl;
+	run(words, bodies);
+	for (size_t i = 0; words.size() < LARGE_WORD_LIST; i++)
+		words.push_back("zq" + to_string(i) + "xj");
+	run(words, bodies);
+	return 0;
+}
@@ -0,0 +1,94 @@
+#include "host_blocklist.h"
+
+HostBlocklist::HostBlocklist() : node_flags(1, 0), rules(0)
+{
+}
+
+std::string normalize_host(const std::string &host)
+{
+    std::string name = trim(host);
+    if (!name.empty() && name[0] == '[') {
+        // An IPv6 literal, whose colons aren't a port
+        size_t end = name.find(']');
+        name = name.substr(0, end == std::string::npos ? name.size() : end + 1);
+    } else if (name.find(':') == name.rfind(':')) {
+        name = name.substr(0, name.find(':'));
+    }
+    while (!name.empty() && name[name.size() - 1] == '.')
+        name.erase(name.size() - 1);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    return name;
+}
+
+// Whether the name is labels separated by single dots
+static bool has_labels(const std::string &name)
+{
+    return !name.empty() && name[0] != '.' && name.find("..") == std::string::npos;
+}
+
+uint32_t HostBlocklist::child(uint32_t parent, const std::string &label) const
+{
+    std::unordered_map<std::string, uint32_t>::const_iterator label_it = label_ids.find(label);
+    if (label_it == label_ids.end())
+        return 0;
+    std::unordered_map<uint64_t, uint32_t>::const_iterator child_it =
+        children.find((uint64_t)parent << 32 | label_it->second);
+    return child_it == children.end() ? 0 : child_it->second;
+}
+
+bool HostBlocklist::add(const std::string &rule)
+{
+    std::string name = normalize_host(rule);
+    uint8_t flag = BLOCKS_HOST;
+    if (name.compare(0, 2, "*.") == 0) {
+        name.erase(0, 2);
+        flag = BLOCKS_SUBDOMAINS;
+    }
+    if (!has_labels(name) || name.find('*') != std::string::npos)
+        return false;
+
+    uint32_t node = 0;
+    size_t end = name.size();
+    while (true) {
+        size_t dot = name.rfind('.', end - 1);
+        size_t start = dot == std::string::npos ? 0 : dot + 1;
+        std::string label = name.substr(start, end - start);
+        uint32_t label_id = label_ids.insert(std::make_pair(label, (uint32_t)label_ids.size())).first->second;
+        std::pair<std::unordered_map<uint64_t, uint32_t>::iterator, bool> edge =
+            children.insert(std::make_pair((uint64_t)node << 32 | label_id, (uint32_t)node_flags.size()));
+        if (edge.second)
+            node_flags.push_back(0);
+        node = edge.first->second;
+        if (start == 0)
+            break;
+        end = start - 1;
+    }
+    node_flags[node] |= flag;
+    rules++;
+    return true;
+}
+
+bool HostBlocklist::blocks(const std::string &host) const
+{
+    std::string name = normalize_host(host);
+    if (!has_labels(name))
+        return false;
+
+    uint32_t node = 0;
+    std::string label;
+    size_t end = name.size();
+    while (true) {
+        size_t dot = name.rfind('.', end - 1);
+        size_t start = dot == std::string::npos ? 0 : dot + 1;
+        label.assign(name, start, end - start);
+        node = child(node, label);
+        if (node == 0)
+            return false;
+        if (start == 0)
+            return (node_flags[node] & BLOCKS_HOST) != 0;
+        // Labels remain, so the host is a subdomain of this node
+        if (node_flags[node] != 0)
+            return true;
+        end = start - 1;
+    }
+}
@@ -0,0 +1,166 @@
+#include "http_parser.h"
+
+#include <string.h>
+#include <strings.h>
+
+bool HttpSlice::equals(const char *str) const
+{
+    return strlen(str) == size && memcmp(data, str, size) == 0;
+}
+
+bool HttpSlice::equals_ignore_case(const char *str) const
+{
+    return strlen(str) == size && strncasecmp(data, str, size) == 0;
+}
+
+static HttpSpan make_span(size_t offset, size_t length)
+{
+    HttpSpan span = { (uint32_t)offset, (uint32_t)length };
+    return span;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+// Token characters of RFC 7230, used for methods and header names
+static bool is_token_char(unsigned char c)
+{
+    return c > 0x20 && c < 0x7F && !strchr("\"(),/:;<=>?@[\\]{}", c);
+}
+
+void HttpParser::reset()
+{
+    line_start = 0;
+    scan_offset = 0;
+    start_line_done = false;
+    result = INCOMPLETE;
+    is_response = false;
+    status_code = 0;
+    method = target = version = reason = make_span(0, 0);
+    header_count = 0;
+    head_length = 0;
+}
+
+HttpParser::Result HttpParser::parse(const char *buffer, size_t length, size_t max_head_length)
+{
+    while (result == INCOMPLETE) {
+        // Only the bytes that arrived since the last call are searched
+        const char *line_end = (const char *)memchr(buffer + scan_offset, '\n', length - scan_offset);
+        if (line_end == NULL) {
+            scan_offset = length;
+            if (length >= max_head_length)
+                result = INVALID;
+            break;
+        }
+
+        size_t end_offset = line_end - buffer;
+        const char *line = buffer + line_start;
+        size_t line_length = end_offset - line_start;
+        while (line_length > 0 && line[line_length - 1] == '\r')
+            line_length--;
+
+        if (end_offset + 1 > max_head_length) {
+            result = INVALID;
+        } else if (!start_line_done) {
+            // Empty lines before the start line are tolerated
+            if (line_length > 0) {
+                if (!parse_start_line(line, line_start, line_length))
+                    result = INVALID;
+                start_line_done = true;
+            }
+        } else if (line_length == 0) {
+            head_length = end_offset + 1;
+            result = COMPLETE;
+        } else if (!parse_header_line(line, line_start, line_length)) {
+            result = INVALID;
+        }
+
+        line_start = scan_offset = end_offset + 1;
+    }
+    return result;
+}
+
+bool HttpParser::parse_start_line(const char *line, size_t offset, size_t length)
+{
+    const char *first_space = (const char *)memchr(line, ' ', length);
+    if (first_space == NULL)
+        return false;
+    size_t first_length = first_space - line;
+
+    if (first_length > 5 && memcmp(line, "HTTP/", 5) == 0) {
+        // HTTP-version SP status-code SP reason-phrase
+        is_response = true;
+        version = make_span(offset, first_length);
+        size_t position = first_length + 1;
+        size_t digits = 0;
+        status_code = 0;
+        while (position < length && line[position] >= '0' && line[position] <= '9' && digits < 3) {
+            status_code = status_code * 10 + (line[position] - '0');
+            position++;
+            digits++;
+        }
+        if (digits != 3 || (position < length && line[position] != ' '))
+            return false;
+        if (position < length)
+            position++;
+        reason = make_span(offset + position, length - position);
+        return true;
+    }
+
+    // method SP request-target SP HTTP-version
+    for (size_t i = 0; i < first_length; i++) {
+        if (!is_token_char(line[i]))
+            return false;
+    }
+    const char *last_space = (const char *)memrchr(line, ' ', length);
+    if (first_length == 0 || last_space == first_space)
+        return false;
+    size_t target_start = first_length + 1;
+    size_t version_start = last_space - line + 1;
+    if (version_start - 1 == target_start || version_start + 5 > length || memcmp(line + version_start, "HTTP/", 5) != 0)
+        return false;
+
+    is_response = false;
+    method = make_span(offset, first_length);
+    target = make_span(offset + target_start, version_start - 1 - target_start);
+    version = make_span(offset + version_start, length - version_start);
+    return true;
+}
+
+bool HttpParser::parse_header_line(const char *line, size_t offset, size_t length)
+{
+    // obs-fold continuation lines are not supported
+    if (is_space(line[0]) || header_count == HTTP_PARSER_MAX_HEADERS)
+        return false;
+
+    size_t name_length = 0;
+    while (name_length < length && is_token_char(line[name_length]))
+        name_length++;
+    if (name_length == 0 || name_length == length || line[name_length] != ':')
+        return false;
+
+    size_t value_start = name_length + 1;
+    size_t value_end = length;
+    while (value_start < value_end && is_space(line[value_start]))
+        value_start++;
+    while (value_end > value_start && is_space(line[value_end - 1]))
+        value_end--;
+
+    header_names[header_count] = make_span(offset, name_length);
+    header_values[header_count] = make_span(offset + value_start, value_end - value_start);
+    header_count++;
+    return true;
+}
+
+bool HttpParser::find_header(const char *buffer, const char *name, HttpSlice &value) const
+{
+    for (size_t i = 0; i < header_count; i++) {
+        if (slice(buffer, header_names[i]).equals_ignore_case(name)) {
+            value = slice(buffer, header_values[i]);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,147 @@
+#include "utils.h"
+#include "http_utils.h"
+
+#include <dirent.h>
+#include <time.h>
+
+using namespace std;
+
+ParsedArguments parsedArguments;
+
+/*
+ Compares the incremental HttpParser with the string based parser it replaced,
+ on the replies stored in a cache directory. Every head is fed to the parsers
+ the way it arrives from a socket, in segments of one TCP packet.
+*/
+
+const size_t SEGMENT_SIZE = 1460;
+const int ROUNDS = 2000;
+
+// The former parser: std::stringstream, getline and split, run on a copy of the head
+HttpHeader legacy_make_http_header_from_string(const string &str)
+{
+	HttpHeader header;
+	stringstream sstream(str);
+	string request_line;
+	getline(sstream, request_line, '\n');
+	request_line = trim(request_line);
+
+    vector<string> request_line_parts = split_all(request_line, ' ');
+    if (request_line_parts.size() < 3) {
+        header.type = HttpHeader::MALFORMED;
+        return header;
+    }
+    if (request_line_parts[0].find("HTTP") != string::npos) {
+        header.type = HttpHeader::RESPONSE;
+        header.protocol = request_line_parts[0];
+        header.status = "";
+        for (int i = 1; i < request_line_parts.size(); i++) {
+            header.status += request_line_parts[i];
+            if (i < request_line_parts.size() - 1) {
+                header.status += " ";
+            }
+        }
+    } else {
+        header.type = HttpHeader::REQUEST;
+        header.method = request_line_parts[0];
+        header.path = request_line_parts[1];
+        header.protocol = request_line_parts[2];
+    }
+
+	string line;
+	while (getline(sstream, line, '\n')) {
+		vector<string> header_parts = split(line, ':');
+		if (!header_parts[1].empty()) {
+			header.headers[header_parts[0]] = trim(header_parts[1]);
+		}
+	}
+	return header;
+}
+
+// Both return the number of lines of a parsed head (start line and headers), 0 on failure
+
+// The former receive loop: the whole buffer is searched again after every segment
+size_t legacy_parse(const string &message)
+{
+	string buffer;
+	for (size_t offset = 0; offset < message.size(); offset += SEGMENT_SIZE) {
+		buffer.append(message, offset, SEGMENT_SIZE);
+		const char *headers_end = strstr(buffer.c_str(), "\r\n\r\n");
+		if (headers_end != NULL) {
+			HttpHeader header = legacy_make_http_header_from_string(buffer.substr(0, headers_end - buffer.c_str()));
+			return header.type == HttpHeader::MALFORMED ? 0 : header.headers.size() + 1;
+		}
+	}
+	return 0;
+}
+
+size_t incremental_parse(const string &message)
+{
+	HttpParser parser;
+	for (size_t length = SEGMENT_SIZE; ; length += SEGMENT_SIZE) {
+		length = min(length, message.size());
+		HttpParser::Result result = parser.parse(message.data(), length);
+		if (result == HttpParser::COMPLETE)
+			return parser.header_count + 1;
+		if (result == HttpParser::INVALID || length == message.size())
+			return 0;
+	}
+}
+
+double seconds_now()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void run(const string &name, size_t (*parse)(const string &), const vector<string> &messages)
+{
+	size_t headers = 0;
+	size_t parsed = 0;
+	for (size_t i = 0; i < messages.size(); i++) {
+		size_t lines = parse(messages[i]);
+		if (lines > 0) {
+			headers += lines - 1;
+			parsed++;
+		}
+	}
+
+	double start = seconds_now();
+	size_t checksum = 0;
+	for (int round = 0; round < ROUNDS; round++) {
+		for (size_t i = 0; i < messages.size(); i++)
+			checksum += parse(messages[i]);
+	}
+	double elapsed = seconds_now() - start;
+
+	cout << name << ": " << parsed << "/" << messages.size() << " heads, " << headers << " headers, "
+	     << elapsed * 1e9 / (ROUNDS * messages.size()) << " ns per reply (checksum " << checksum << ")" << endl;
+}
+
+int main(int argc, char **argv)
+{
+	string directory = argc > 1 ? argv[1] : "./cache";
+	DIR *dir = opendir(directory.c_str());
+	if (dir == NULL) {
+		cerr << "Usage: " << argv[0] << " [CACHE_DIRECTORY]" << endl;
+		return 1;
+	}
+
+	vector<string> messages;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		ifstream file((directory + "/" + entry->d_name).c_str(), ios::binary);
+		stringstream contents;
+		contents << file.rdbuf();
+		messages.push_back(contents.str());
+	}
+	closedir(dir);
+	cout << messages.size() << " replies from " << directory << ", " << SEGMENT_SIZE << " byte segments" << endl;
+
+	run("string parser     ", legacy_parse, messages);
+	run("incremental parser", incremental_parse, messages);
+	return 0;
+}
@@ -1,55 +1,43 @@
 
 #include "utils.h"
 #include "http_utils.h"
+#include "worker_pool.h"
+#include "io_backend.h"
 
 #include "zlib.h"
 
 // The maximum length of HTTP request is 8190, according to Apache docs
 const int HTTP_REQUEST_MAX_LENGTH = 8200;
 
-HttpHeader make_http_header_from_string(const std::string &str)
+// Upper limit for headers received from sockets, responses may carry lots of cookies
+const size_t HTTP_HEADER_MAX_LENGTH = 65536;
+
+// Receive size for data of unknown length
+const size_t BODY_READ_CHUNK_SIZE = 65536;
+
+// Copies the parsed head out of the receive buffer
+static HttpHeader make_http_header(const HttpParser &parser, const char *buffer)
 {
-	HttpHeader header;
-	std::stringstream sstream(str);
-	std::string request_line;
-	std::getline(sstream, request_line, '\n');
-	
-	std::cerr << "Request line" << request_line << std::endl;
-	
-    std::vector<std::string> request_line_parts = split_all(request_line, ' ');
-    if (request_line_parts.size() < 3) {
-        log("Malformed HTTP header");
-        header.type = HttpHeader::MALFORMED;
-        return header;
-    }
-    if (request_line_parts[0].find("HTTP") != std::string::npos) {
+    HttpHeader header;
+    header.protocol = parser.slice(buffer, parser.version).to_string();
+    if (parser.is_response) {
         header.type = HttpHeader::RESPONSE;
-        header.protocol = request_line_parts[0];
-        header.status = "";
-        for (int i = 1; i < request_line_parts.size(); i++) {
-            header.status += request_line_parts[i];
-            if (i < request_line_parts.size() - 1) {
-                header.status += " ";
-            }
-        }
+        std::stringstream status;
+        status << parser.status_code;
+        if (parser.reason.length > 0)
+            status << " " << parser.slice(buffer, parser.reason).to_string();
+        header.status = status.str();
     } else {
         header.type = HttpHeader::REQUEST;
-        header.method = request_line_parts[0];
-        header.path = request_line_parts[1];        
-        header.protocol = request_line_parts[2];         
+        header.method = parser.slice(buffer, parser.method).to_string();
+        header.path = parser.slice(buffer, parser.target).to_string();
     }
 
-	std::string line;
-	while (std::getline(sstream, line, '\n')) {
-		std::vector<std::string> header_parts = split(line, ':');
-		if (header_parts[1].empty()) {
-			log("Malformed HTTP header line: " + line);
-		} else {
-			header.headers[header_parts[0]] = trim(header_parts[1]);
-		}
-	}
-
-	return header;
+    for (size_t i = 0; i < parser.header_count; i++) {
+        header.headers[parser.slice(buffer, parser.header_names[i]).to_string()] =
+            parser.slice(buffer, parser.header_values[i]).to_string();
+    }
+    return header;
 }
 
 HttpMessage* make_http_response(const std::string &code)
@@ -59,6 +47,7 @@ HttpMessage* make_http_response(const std::string &code)
     std::stringstream stream;
     stream << msg->body.size();
     msg->header.headers["Content-Length"] = stream.str();
+    msg->header.type = HttpHeader::RESPONSE;
     msg->header.protocol = "HTTP/1.1";
     msg->header.status = code;
     return msg;
@@ -150,154 +139,359 @@ std::string decompress_gzip(const std::string& str)
     return outstring;
 }
 
-HttpMessage* read_http_message_from_socket(int sd)
+void rewrite_path_using_referer(HttpMessage *message)
 {
-	char buffer[HTTP_REQUEST_MAX_LENGTH];
-    int bytes_read = 0;
+	if (message->header.headers.find("Referer") != message->header.headers.end()) {
+		std::string referer_string = message->header.headers["Referer"];
+        std::vector<std::string> referer_string_parts = split_all(referer_string, '/');
+        if (referer_string_parts.size() > 3) {
+            std::string referer_base = referer_string_parts[3];
+            if (message->header.path.find("/" + referer_base) != 0) {
+                log("Using Referer to rewrite path string in HTTP response to target server");
+                if (message->header.path == "/") {
+                    message->header.path = "/" + referer_base;
+                } else {
+                    message->header.path = "/" + referer_base + "/" + message->header.path;
+                }
+            }
+        }
+	}
+}
 
-    std::string header_string;
-    std::string body_string;
+// Receives more data into the reader's buffer. Returns the number of bytes
+// received, 0 if the peer closed the connection and -1 on errors.
+static int fill_reader_buffer(SocketReader &reader)
+{
+    size_t buffered = reader.buffer.size();
+    reader.buffer.resize(buffered + BODY_READ_CHUNK_SIZE);
+    int bytes_read;
+    do {
+        bytes_read = io_recv(reader.socket_fd, &reader.buffer[buffered], BODY_READ_CHUNK_SIZE, 0, reader.timeout_ms);
+    } while (bytes_read < 0 && errno == EINTR);
+    reader.buffer.resize(buffered + std::max(bytes_read, 0));
+    if (bytes_read == 0)
+        reader.closed = true;
+    return bytes_read;
+}
 
-    // Reading HTTP header request from the client
-    do
-    {
-        int bytes_read_this_iteration = recv(sd, buffer + bytes_read, sizeof(buffer), 0);
-        if (bytes_read_this_iteration < 0) {
-        	log("Error in recv() while reading data from the client's socket");
-        	return nullptr;
-        }
-        if (bytes_read_this_iteration == 0)
-        	break;
-        bytes_read += bytes_read_this_iteration;
-	    buffer[bytes_read] = '\0';
-
-        // Check if the end of HTTP header was encountered
-        char *headers_end = strstr(buffer, "\r\n\r\n");
-        if (headers_end != NULL) {
-
-       		// Reached end of headers
-			*headers_end = '\0';
-			header_string = std::string(buffer);
-
-			buffer[bytes_read] = '\0';
-			if ((headers_end + 4 - buffer) < bytes_read) {
-				// We've read a part of message's body - append it to body_string
-				std::string t;
-				t.resize(bytes_read - (headers_end + 4 - buffer));
-				std::copy(buffer + (headers_end + 4 - buffer), buffer + bytes_read, t.begin());
-				body_string += t;
-			}
-
-			break;
-        }
+static bool read_line(SocketReader &reader, std::string &line)
+{
+    std::string::size_type line_end;
+    while ((line_end = reader.buffer.find("\r\n")) == std::string::npos) {
+        if (reader.buffer.size() > HTTP_HEADER_MAX_LENGTH || fill_reader_buffer(reader) <= 0)
+            return false;
+    }
+    line = reader.buffer.substr(0, line_end);
+    reader.buffer.erase(0, line_end + 2);
+    return true;
+}
+
+static bool response_has_body(const HttpHeader &header)
+{
+    int code = atoi(header.status.c_str());
+    return !(code / 100 == 1 || code == 204 || code == 304);
+}
 
+bool is_keep_alive(const HttpHeader &header)
+{
+    HeaderMap::const_iterator connection = header.headers.find("Connection");
+    std::string value = (connection != header.headers.end()) ? connection->second : "";
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+
+    if (header.protocol == "HTTP/1.1")
+        return value.find("close") == std::string::npos;
+    return value.find("keep-alive") != std::string::npos;
+}
+
+bool accepts_encoding(const HttpHeader &request, const std::string &coding)
+{
+    HeaderMap::const_iterator it = request.headers.find("Accept-Encoding");
+    if (it == request.headers.end())
+        return false;
+
+    // Codings are listed with an optional weight, "q=0" rules one out
+    bool wildcard = false;
+    std::vector<std::string> entries = split_all(it->second, ',');
+    for (size_t i = 0; i < entries.size(); i++) {
+        std::vector<std::string> parameters = split_all(entries[i], ';');
+        if (parameters.empty())
+            continue;
+        std::string name = trim(parameters[0]);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        bool allowed = true;
+        for (size_t j = 1; j < parameters.size(); j++) {
+            std::string parameter = trim(parameters[j]);
+            if (parameter.compare(0, 2, "q=") == 0)
+                allowed = atof(parameter.c_str() + 2) > 0;
+        }
+        if (name == coding || (coding == "gzip" && name == "x-gzip"))
+            return allowed;
+        if (name == "*")
+            wildcard = allowed;
     }
-    while (true);
+    return wildcard;
+}
 
-    HttpHeader http_header = make_http_header_from_string(header_string);
-    if (http_header.type == HttpHeader::MALFORMED)
+HttpMessage* read_http_message_header(SocketReader &reader)
+{
+    // Reading HTTP header, the parser resumes where it stopped after every receive
+    HttpParser parser;
+    HttpParser::Result state;
+    while ((state = parser.parse(reader.buffer.data(), reader.buffer.size(), HTTP_HEADER_MAX_LENGTH)) ==
+           HttpParser::INCOMPLETE) {
+        int bytes_read = fill_reader_buffer(reader);
+        if (bytes_read < 0) {
+            if (errno == EAGAIN)
+                log("Timed out waiting for HTTP message");
+            else
+                log("Error in recv() while reading HTTP message from socket");
+            return NULL;
+        }
+        if (bytes_read == 0)
+            return NULL;
+    }
+    if (state == HttpParser::INVALID) {
+        log("Malformed or too long HTTP header");
         return NULL;
+    }
+
     HttpMessage *result = new HttpMessage();
-    result->header = http_header;
+    result->header = make_http_header(parser, reader.buffer.data());
+    reader.buffer.erase(0, parser.head_length);
     
     log("END OF HTTP HEADERS");
 
-    // If there's Content-Length or Content-Encoding header, read the body
-    if ((http_header.headers.find("Content-Length") != http_header.headers.end()) || 
-    	(http_header.headers.find("Content-Encoding") != http_header.headers.end()) || 
-    	(http_header.headers.find("Transfer-Encoding") != http_header.headers.end())) {
-
-    	if ((http_header.headers.find("Content-Length") != http_header.headers.end()) && (http_header.headers.find("Content-Encoding") == http_header.headers.end()) || 
-    		((http_header.headers.find("Content-Encoding") != http_header.headers.end()) &&             (http_header.headers["Content-Encoding"] == "identity"))) {
-    		// Case 1: body is not compressed
-
-	    	int content_length = atoi(http_header.headers["Content-Length"].c_str());
-	    	int bytes_left = content_length - body_string.size();
-
-	    	if (bytes_left > 0) {
-		    	do {
-					int bytes_read_this_iteration = recv(sd, buffer, bytes_left, 0);
-					
-			        if (bytes_read_this_iteration < 0) {
-			        	log("Error in recv() while reading data from the client's socket");
-			        	return nullptr;
-			        }
-
-			        bytes_left -= bytes_read_this_iteration;
-
-			        if (bytes_read_this_iteration == 0) {
-			        	// No more data from the client
-			        	break;
-			        } else {
-			        	std::string t;
-			        	t.resize(bytes_read_this_iteration);
-			        	std::copy(buffer, buffer + bytes_read_this_iteration, t.begin());
-			        	body_string += t;
-			        }
-
-		    	} while (true);
-	    	}
-    	} else {
-    		// Case 2: body is compressed - just read body until no more data in the socket
-
-    		do {
-				int bytes_read_this_iteration = recv(sd, buffer, sizeof(buffer), 0);
-				
-		        if (bytes_read_this_iteration < 0) {
-		        	log("Error in recv() while reading data from the client's socket");
-		        	return nullptr;
-		        }
-
-		        if (bytes_read_this_iteration == 0) {
-		        	break;
-		        } else {
-		        	std::string t;
-		        	t.resize(bytes_read_this_iteration);
-		        	std::copy(buffer, buffer + bytes_read_this_iteration, t.begin());
-		        	body_string += t;
-		        }
-
-		    } while (true);
-
-		    log("Target server's reply is compressed - starting decompresison");
-		    try {
-		    
-		    	std::string encoding = trim(http_header.headers["Content-Encoding"]);
-		    	if (encoding == "gzip") {
-					body_string = decompress_gzip(body_string);
-				} else if (encoding == "deflate") {
-					body_string = decompress_deflate(body_string);
-				}
-				result->header.headers["Content-Encoding"] = "identity";
-				std::stringstream content_length_stream;
-				content_length_stream << body_string.size();
-				result->header.headers["Content-Length"] = content_length_stream.str();
-			} catch (std::runtime_error e) {
-				log("Error while uncompressing target server's response: " + std::string(e.what()));
-				return NULL;
-			}
-    	}
+	rewrite_path_using_referer(result);
+    return result;
+}
+
+MessageBodyStream::MessageBodyStream(SocketReader &reader, const HttpHeader &header, bool expect_body)
+    : reader(reader), remaining(0), in_chunk(false), finished(false), keep_alive(is_keep_alive(header))
+{
+    HeaderMap::const_iterator transfer_encoding = header.headers.find("Transfer-Encoding");
+    HeaderMap::const_iterator content_length = header.headers.find("Content-Length");
+    if (!expect_body) {
+        framing = NO_BODY;
+    } else if (transfer_encoding != header.headers.end() &&
+               transfer_encoding->second.find("chunked") != std::string::npos) {
+        framing = CHUNKED;
+    } else if (content_length != header.headers.end()) {
+        framing = LENGTH;
+        remaining = strtoul(content_length->second.c_str(), NULL, 10);
+    } else if (header.type == HttpHeader::RESPONSE && response_has_body(header)) {
+        // Neither length nor chunks - the body ends when the server closes the connection
+        framing = UNTIL_CLOSED;
     } else {
-    	body_string = "";
+        framing = NO_BODY;
     }
+}
 
-	if (result->header.headers.find("Referer") != result->header.headers.end()) {
-		std::string referer_string = result->header.headers["Referer"];
-        std::vector<std::string> referer_string_parts = split_all(referer_string, '/');
-        if (referer_string_parts.size() > 3) {
-            std::string referer_base = referer_string_parts[3];
-            if (result->header.path.find("/" + referer_base) != 0) {
-                log("Using Referer to rewrite path string in HTTP response to target server");
-                if (result->header.path == "/") {
-                    result->header.path = "/" + referer_base;
-                } else {
-                    result->header.path = "/" + referer_base + "/" + result->header.path;
-                }
+bool MessageBodyStream::has_length() const
+{
+    return framing == LENGTH || framing == NO_BODY;
+}
+
+bool MessageBodyStream::has_body() const
+{
+    return framing != NO_BODY && !(framing == LENGTH && remaining == 0);
+}
+
+bool MessageBodyStream::is_reusable() const
+{
+    return finished && framing != UNTIL_CLOSED && keep_alive;
+}
+
+// Moves up to `remaining` bytes of the current chunk or body to `out`, receiving
+// straight into it when nothing is buffered
+ssize_t MessageBodyStream::read_remaining(std::string &out)
+{
+    size_t length;
+    if (!reader.buffer.empty()) {
+        length = std::min(remaining, reader.buffer.size());
+        out.append(reader.buffer, 0, length);
+        reader.buffer.erase(0, length);
+    } else {
+        size_t offset = out.size();
+        out.resize(offset + std::min(remaining, BODY_READ_CHUNK_SIZE));
+        ssize_t bytes_read;
+        do {
+            bytes_read = io_recv(reader.socket_fd, &out[offset], out.size() - offset, 0, reader.timeout_ms);
+        } while (bytes_read < 0 && errno == EINTR);
+        out.resize(offset + std::max(bytes_read, (ssize_t)0));
+        if (bytes_read <= 0) {
+            log("Connection closed in the middle of HTTP message body");
+            return -1;
+        }
+        length = bytes_read;
+    }
+    remaining -= length;
+    return length;
+}
+
+ssize_t MessageBodyStream::read(std::string &out)
+{
+    if (finished)
+        return 0;
+
+    switch (framing) {
+    case NO_BODY:
+        break;
+
+    case LENGTH:
+        if (remaining > 0)
+            return read_remaining(out);
+        break;
+
+    case CHUNKED:
+        if (remaining == 0) {
+            std::string line;
+            // The data of the previous chunk is followed by an empty line
+            if (in_chunk && (!read_line(reader, line) || !line.empty()))
+                return -1;
+            if (!read_line(reader, line))
+                return -1;
+            // Chunk extensions after ';' are ignored. A size that isn't hex
+            // fails the body, it must not pass for the last chunk.
+            std::string size = trim(split(line, ';')[0]);
+            char *size_end;
+            errno = 0;
+            remaining = strtoull(size.c_str(), &size_end, 16);
+            if (size.empty() || *size_end != '\0' || errno == ERANGE || !isxdigit((unsigned char)size[0])) {
+                log("Invalid chunk size line in HTTP message body: " + line);
+                return -1;
+            }
+            in_chunk = true;
+            if (remaining == 0) {
+                // Skip the trailer section up to the final empty line
+                do {
+                    if (!read_line(reader, line))
+                        return -1;
+                } while (!line.empty());
+                break;
             }
         }
-	}
+        return read_remaining(out);
+
+    case UNTIL_CLOSED:
+        if (reader.buffer.empty()) {
+            int bytes_read = fill_reader_buffer(reader);
+            if (bytes_read < 0)
+                return -1;
+            if (bytes_read == 0)
+                break;
+        }
+        {
+            size_t length = reader.buffer.size();
+            out += reader.buffer;
+            reader.buffer.clear();
+            return length;
+        }
+    }
+
+    finished = true;
+    return 0;
+}
+
+HttpMessage* read_http_message(SocketReader &reader, bool *reusable, bool expect_body)
+{
+    if (reusable != NULL)
+        *reusable = false;
+
+    HttpMessage *result = read_http_message_header(reader);
+    if (result == NULL)
+        return NULL;
+    HeaderMap &headers = result->header.headers;
 
-	result->body = body_string;
+    // Reading the body as delimited by the message framing
+    std::string body_string;
+    MessageBodyStream body(reader, result->header, expect_body);
+    ssize_t bytes_read;
+    while ((bytes_read = body.read(body_string)) > 0)
+        ;
+    if (bytes_read < 0) {
+        delete result;
+        return NULL;
+    }
+    if (headers.find("Transfer-Encoding") != headers.end()) {
+        headers.erase("Transfer-Encoding");
+        std::stringstream content_length_stream;
+        content_length_stream << body_string.size();
+        headers["Content-Length"] = content_length_stream.str();
+    }
+
+    std::string encoding = (headers.find("Content-Encoding") != headers.end()) ? trim(headers["Content-Encoding"]) : "";
+    if (encoding == "gzip" || encoding == "deflate") {
+	    log("Target server's reply is compressed - starting decompresison");
+	    try {
+	    	run_on_worker_pool([&]() {
+	    		if (encoding == "gzip") {
+					body_string = decompress_gzip(body_string);
+				} else {
+					body_string = decompress_deflate(body_string);
+				}
+			});
+			headers["Content-Encoding"] = "identity";
+			std::stringstream content_length_stream;
+			content_length_stream << body_string.size();
+			headers["Content-Length"] = content_length_stream.str();
+		} catch (std::runtime_error e) {
+			log("Error while uncompressing target server's response: " + std::string(e.what()));
+			delete result;
+			return NULL;
+		}
+    }
+
+	result->body.swap(body_string);
+	if (reusable != NULL)
+		*reusable = body.is_reusable();
+    return result;
+}
+
+bool parse_http_header(const std::string &head, HttpHeader &header)
+{
+    HttpParser parser;
+    if (parser.parse(head.data(), head.size(), head.size() + 1) != HttpParser::COMPLETE)
+        return false;
+    header = make_http_header(parser, head.data());
+    return true;
+}
+
+HttpMessage* parse_http_request_from_buffer(std::string &buffer, HttpParser &parser, bool &malformed)
+{
+    malformed = false;
+
+    HttpParser::Result state = parser.parse(buffer.data(), buffer.size(), HTTP_REQUEST_MAX_LENGTH);
+    if (state == HttpParser::INCOMPLETE)
+        return NULL;
+    if (state == HttpParser::INVALID || parser.is_response) {
+        log("Malformed or too long HTTP request header");
+        malformed = true;
+        return NULL;
+    }
+
+    HttpSlice value;
+    if (parser.find_header(buffer.data(), "Transfer-Encoding", value)) {
+        malformed = true;
+        return NULL;
+    }
+    size_t content_length = 0;
+    if (parser.find_header(buffer.data(), "Content-Length", value)) {
+        content_length = strtoul(value.to_string().c_str(), NULL, 10);
+    }
+
+    // The parser keeps its result while the body is still arriving
+    size_t message_length = parser.head_length + content_length;
+    if (buffer.size() < message_length) {
+        return NULL;
+    }
+
+    HttpMessage *result = new HttpMessage();
+    result->header = make_http_header(parser, buffer.data());
+    result->body = buffer.substr(parser.head_length, content_length);
+    buffer.erase(0, message_length);
+    parser.reset();
+
+    rewrite_path_using_referer(result);
     return result;
 }
 
@@ -316,7 +510,7 @@ std::string HttpMessage::to_log_string() const
 	    sstream << "Status/request line:\n\t" << this->header.protocol << " " << this->header.status;
 	}
 	sstream << "\n" << "Headers:\n";
-	for (std::map<std::string, std::string>::const_iterator iterator = this->header.headers.begin(); 
+	for (HeaderMap::const_iterator iterator = this->header.headers.begin(); 
 			iterator != this->header.headers.end(); iterator++) {
     	sstream << "\t" << iterator->first << ": " << iterator->second << "\n";
 	}
@@ -324,7 +518,7 @@ std::string HttpMessage::to_log_string() const
 	return sstream.str();
 }
 
-std::string HttpMessage::to_string() const
+std::string HttpMessage::header_to_string() const
 {
 	std::stringstream sstream;
 	if (this->header.type == HttpHeader::REQUEST) {
@@ -334,13 +528,15 @@ std::string HttpMessage::to_string() const
 	    sstream << this->header.protocol << " " << this->header.status;
 	}
 	sstream << "\r\n";
-	for (std::map<std::string, std::string>::const_iterator iterator = this->header.headers.begin();
+	for (HeaderMap::const_iterator iterator = this->header.headers.begin();
 	 		iterator != this->header.headers.end(); iterator++) {
     	sstream << iterator->first << ": " << trim(iterator->second) << "\r\n";
 	}
 	sstream << "\r\n";
-	if (!this->body.empty()) {
-		sstream << this->body;
-	}
 	return sstream.str();
 }
+
+std::string HttpMessage::to_string() const
+{
+	return this->header_to_string() + this->body;
+}
@@ -0,0 +1,356 @@
+#include "io_backend.h"
+
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+const unsigned IO_RING_ENTRIES = 64;
+
+static bool io_uring_enabled = false;
+
+/*
+ Minimal io_uring wrapper on top of the raw system calls. A ring is only ever
+ used by the thread that owns it, so the submission side needs no locking.
+*/
+struct IoRing {
+    int ring_fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+// Rings of exited threads are kept for reuse, threads in thread mode are short-lived
+static pthread_mutex_t free_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<IoRing*> free_rings;
+static pthread_key_t thread_ring_key;
+
+static IoRing* create_ring()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (ring_fd < 0)
+        return NULL;
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = std::max(sq_size, cq_size);
+
+    char *sq_ptr = (char *)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ring_fd, IORING_OFF_SQ_RING);
+    char *cq_ptr = sq_ptr;
+    if (sq_ptr != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+        cq_ptr = (char *)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                              ring_fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+        close(ring_fd);
+        return NULL;
+    }
+
+    IoRing *ring = new IoRing();
+    ring->ring_fd = ring_fd;
+    ring->sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    ring->sqes = (struct io_uring_sqe *)sqes;
+    ring->cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+    return ring;
+}
+
+static void release_thread_ring(void *arg)
+{
+    pthread_mutex_lock(&free_rings_mutex);
+    free_rings.push_back((IoRing *)arg);
+    pthread_mutex_unlock(&free_rings_mutex);
+}
+
+static IoRing* get_thread_ring()
+{
+    IoRing *ring = (IoRing *)pthread_getspecific(thread_ring_key);
+    if (ring != NULL)
+        return ring;
+
+    pthread_mutex_lock(&free_rings_mutex);
+    if (!free_rings.empty()) {
+        ring = free_rings.back();
+        free_rings.pop_back();
+    }
+    pthread_mutex_unlock(&free_rings_mutex);
+
+    if (ring == NULL && (ring = create_ring()) == NULL)
+        print_error_and_die("Error while creating io_uring");
+    pthread_setspecific(thread_ring_key, ring);
+    return ring;
+}
+
+// Returns a zeroed submission queue entry; the caller fills it in before the next one is taken
+static struct io_uring_sqe* get_sqe(IoRing *ring)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+/**
+ * Submits the `count` prepared entries and waits for all of them, storing the
+ * result of the entry with user_data i in results[i].
+ */
+static void submit_and_wait(IoRing *ring, unsigned count, int *results)
+{
+    unsigned to_submit = count;
+    unsigned completed = 0;
+
+    while (completed < count) {
+        int ret = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, count - completed,
+                          IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR)
+            print_error_and_die("Error in io_uring_enter()");
+        if (ret > 0)
+            to_submit -= std::min(to_submit, (unsigned)ret);
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            completed++;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Runs a single prepared entry, translating the result to the usual -1/errno convention
+static int run_single_sqe(IoRing *ring)
+{
+    int result;
+    submit_and_wait(ring, 1, &result);
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    return result;
+}
+
+// Whether the kernel supports every operation used here, those came in 5.5 and 5.6 after io_uring itself
+static bool supports_used_operations()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = syscall(__NR_io_uring_setup, 1, &params);
+    if (ring_fd < 0)
+        return false;
+
+    const unsigned PROBE_OPS = 256;
+    std::vector<char> buffer(sizeof(struct io_uring_probe) + PROBE_OPS * sizeof(struct io_uring_probe_op), 0);
+    struct io_uring_probe *probe = (struct io_uring_probe *)&buffer[0];
+    bool probed = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, PROBE_OPS) == 0;
+    close(ring_fd);
+    if (!probed)
+        return false;
+
+    const int used_operations[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SENDMSG,
+                                    IORING_OP_LINK_TIMEOUT };
+    for (size_t i = 0; i < sizeof(used_operations) / sizeof(used_operations[0]); i++) {
+        int op = used_operations[i];
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            return false;
+    }
+    return true;
+}
+
+bool set_io_backend(const std::string &name)
+{
+    if (name != "io_uring") {
+        io_uring_enabled = false;
+        return true;
+    }
+
+    if (!supports_used_operations())
+        return false;
+    IoRing *probe = create_ring();
+    if (probe == NULL)
+        return false;
+
+    pthread_key_create(&thread_ring_key, release_thread_ring);
+    free_rings.push_back(probe);
+    io_uring_enabled = true;
+    return true;
+}
+
+int io_accept(int listening_socket, struct sockaddr *address, socklen_t *address_length)
+{
+    if (!io_uring_enabled)
+        return accept(listening_socket, address, address_length);
+
+    IoRing *ring = get_thread_ring();
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listening_socket;
+    sqe->addr = (unsigned long)address;
+    sqe->addr2 = (unsigned long)address_length;
+    sqe->user_data = 0;
+    return run_single_sqe(ring);
+}
+
+ssize_t io_recv(int socket_fd, void *buffer, size_t length, int flags, int timeout_ms)
+{
+    if (!io_uring_enabled) {
+        if (timeout_ms <= 0)
+            return recv(socket_fd, buffer, length, flags);
+
+        // Waiting only costs the extra poll() when there is nothing buffered yet
+        ssize_t result = recv(socket_fd, buffer, length, flags | MSG_DONTWAIT);
+        if (result >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            return result;
+        struct pollfd pfd;
+        pfd.fd = socket_fd;
+        pfd.events = POLLIN;
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready <= 0) {
+            if (ready == 0)
+                errno = EAGAIN;
+            return -1;
+        }
+        return recv(socket_fd, buffer, length, flags);
+    }
+
+    IoRing *ring = get_thread_ring();
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = socket_fd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = length;
+    sqe->msg_flags = flags;
+    sqe->user_data = 0;
+    if (timeout_ms <= 0)
+        return run_single_sqe(ring);
+
+    // The receive is cancelled by a linked timeout, both entries complete
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    sqe->flags |= IOSQE_IO_LINK;
+    struct io_uring_sqe *timeout_sqe = get_sqe(ring);
+    timeout_sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    timeout_sqe->addr = (unsigned long)&timeout;
+    timeout_sqe->len = 1;
+    timeout_sqe->user_data = 1;
+
+    int results[2];
+    submit_and_wait(ring, 2, results);
+    if (results[0] == -ECANCELED)
+        results[0] = -EAGAIN;
+    if (results[0] < 0) {
+        errno = -results[0];
+        return -1;
+    }
+    return results[0];
+}
+
+int io_send_all(int socket_fd, const char *data, size_t length)
+{
+    size_t offset = 0;
+    while (offset < length) {
+        ssize_t bytes_sent;
+        if (io_uring_enabled) {
+            IoRing *ring = get_thread_ring();
+            struct io_uring_sqe *sqe = get_sqe(ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = socket_fd;
+            sqe->addr = (unsigned long)(data + offset);
+            sqe->len = length - offset;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = 0;
+            bytes_sent = run_single_sqe(ring);
+        } else {
+            bytes_sent = send(socket_fd, data + offset, length - offset, MSG_NOSIGNAL);
+        }
+
+        if (bytes_sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        offset += bytes_sent;
+    }
+    return 0;
+}
+
+int io_send_buffers_all(int socket_fd, struct iovec *buffers, int count, int flags)
+{
+    while (count > 0) {
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = buffers;
+        message.msg_iovlen = count;
+
+        ssize_t bytes_sent;
+        if (io_uring_enabled) {
+            IoRing *ring = get_thread_ring();
+            struct io_uring_sqe *sqe = get_sqe(ring);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = socket_fd;
+            sqe->addr = (unsigned long)&message;
+            sqe->msg_flags = MSG_NOSIGNAL | flags;
+            sqe->user_data = 0;
+            bytes_sent = run_single_sqe(ring);
+        } else {
+            bytes_sent = sendmsg(socket_fd, &message, MSG_NOSIGNAL | flags);
+        }
+
+        if (bytes_sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        // Skip what was sent, a partial send leaves the rest of the buffers
+        size_t remaining = bytes_sent;
+        while (count > 0 && remaining >= buffers->iov_len) {
+            remaining -= buffers->iov_len;
+            buffers++;
+            count--;
+        }
+        if (count > 0) {
+            buffers->iov_base = (char *)buffers->iov_base + remaining;
+            buffers->iov_len -= remaining;
+        }
+    }
+    return 0;
+}
+
+int io_sendfile_all(int socket_fd, int file_fd, off_t offset, size_t length)
+{
+    while (length > 0) {
+        ssize_t bytes_sent = sendfile(socket_fd, file_fd, &offset, length);
+        if (bytes_sent < 0 && errno == EINTR)
+            continue;
+        if (bytes_sent <= 0)
+            return -1;
+        length -= bytes_sent;
+    }
+    return 0;
+}
@@ -0,0 +1,171 @@
+#include "memory_cache.h"
+#include "cache_admission.h"
+
+#include <list>
+
+const int MEMORY_CACHE_SHARDS = 16;
+
+// A single reply may take at most this fraction of its shard's budget
+const size_t MEMORY_CACHE_MAX_BODY_FRACTION = 4;
+
+// Bookkeeping charged to every entry on top of its bytes
+const size_t MEMORY_CACHE_ENTRY_OVERHEAD = 128;
+
+struct MemoryCacheEntry {
+    std::string url;
+    MemoryCachedReply reply;
+    size_t size;
+};
+
+struct MemoryCacheShard {
+    pthread_mutex_t mutex;
+    std::list<MemoryCacheEntry> entries;    // most recently used first
+    std::map<std::string, std::list<MemoryCacheEntry>::iterator> index;
+    size_t size;
+};
+
+static pthread_once_t memory_cache_init_once = PTHREAD_ONCE_INIT;
+static MemoryCacheShard memory_cache_shards[MEMORY_CACHE_SHARDS];
+static size_t shard_budget = 0;
+
+static void initialize_memory_cache()
+{
+    for (int i = 0; i < MEMORY_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&memory_cache_shards[i].mutex, NULL);
+        memory_cache_shards[i].size = 0;
+    }
+}
+
+void configure_memory_cache(size_t budget_bytes)
+{
+    pthread_once(&memory_cache_init_once, initialize_memory_cache);
+    shard_budget = budget_bytes / MEMORY_CACHE_SHARDS;
+}
+
+size_t memory_cache_max_body_size()
+{
+    return shard_budget / MEMORY_CACHE_MAX_BODY_FRACTION;
+}
+
+static MemoryCacheShard& get_cache_shard(const std::string &url)
+{
+    size_t hash = 5381;
+    for (size_t i = 0; i < url.size(); i++)
+        hash = hash * 33 + (unsigned char)url[i];
+    return memory_cache_shards[hash % MEMORY_CACHE_SHARDS];
+}
+
+static void erase_entry(MemoryCacheShard &shard, std::list<MemoryCacheEntry>::iterator it)
+{
+    shard.size -= it->size;
+    shard.index.erase(it->url);
+    shard.entries.erase(it);
+}
+
+bool memory_cache_lookup(const std::string &url, MemoryCachedReply &reply)
+{
+    if (shard_budget == 0)
+        return false;
+
+    MemoryCacheShard &shard = get_cache_shard(url);
+    pthread_mutex_lock(&shard.mutex);
+    std::map<std::string, std::list<MemoryCacheEntry>::iterator>::iterator it = shard.index.find(url);
+    bool found = it != shard.index.end();
+    if (found) {
+        // splice() keeps the iterators in the index valid
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        reply = it->second->reply;
+    }
+    pthread_mutex_unlock(&shard.mutex);
+    return found;
+}
+
+static size_t entry_size(const std::string &url, const MemoryCachedReply &reply)
+{
+    return url.size() + reply.head.size() + reply.body->size() + MEMORY_CACHE_ENTRY_OVERHEAD;
+}
+
+bool memory_cache_store(const std::string &url, const MemoryCachedReply &reply, std::vector<EvictedReply> *evicted)
+{
+    if (shard_budget == 0)
+        return false;
+
+    MemoryCacheEntry entry;
+    entry.url = url;
+    entry.reply = reply;
+    entry.size = entry_size(url, reply);
+    int frequency = cache_request_frequency(url);
+
+    MemoryCacheShard &shard = get_cache_shard(url);
+    pthread_mutex_lock(&shard.mutex);
+    std::map<std::string, std::list<MemoryCacheEntry>::iterator>::iterator it = shard.index.find(url);
+    size_t replaced_size = it != shard.index.end() ? it->second->size : 0;
+
+    // The replies that would make room must not be more popular; ties go to the new one, keeping LRU order
+    bool admitted = reply.body->size() <= memory_cache_max_body_size();
+    size_t freed = 0;
+    std::list<MemoryCacheEntry>::iterator victim = shard.entries.end();
+    while (admitted && shard.size - replaced_size - freed + entry.size > shard_budget && victim != shard.entries.begin()) {
+        --victim;
+        if (it != shard.index.end() && victim == it->second)
+            continue;
+        if (cache_request_frequency(victim->url) > frequency)
+            admitted = false;
+        freed += victim->size;
+    }
+
+    // The reply held for the URL is outdated by this one, even when this one isn't kept
+    if (it != shard.index.end())
+        erase_entry(shard, it->second);
+    if (!admitted) {
+        pthread_mutex_unlock(&shard.mutex);
+        return false;
+    }
+    while (!shard.entries.empty() && shard.size + entry.size > shard_budget) {
+        std::list<MemoryCacheEntry>::iterator last = --shard.entries.end();
+        if (evicted != NULL) {
+            EvictedReply eviction;
+            eviction.url = last->url;
+            eviction.reply = last->reply;
+            evicted->push_back(eviction);
+        }
+        erase_entry(shard, last);
+    }
+
+    shard.entries.push_front(entry);
+    shard.index[url] = shard.entries.begin();
+    shard.size += entry.size;
+    pthread_mutex_unlock(&shard.mutex);
+    return true;
+}
+
+void memory_cache_refresh(const std::string &url, const std::string &head, time_t expires_at)
+{
+    if (shard_budget == 0)
+        return;
+
+    MemoryCacheShard &shard = get_cache_shard(url);
+    pthread_mutex_lock(&shard.mutex);
+    std::map<std::string, std::list<MemoryCacheEntry>::iterator>::iterator it = shard.index.find(url);
+    if (it != shard.index.end()) {
+        MemoryCacheEntry &entry = *it->second;
+        entry.reply.head = head;
+        entry.reply.expires_at = expires_at;
+        shard.size -= entry.size;
+        entry.size = entry_size(url, entry.reply);
+        shard.size += entry.size;
+    }
+    pthread_mutex_unlock(&shard.mutex);
+}
+
+void clear_memory_cache()
+{
+    pthread_once(&memory_cache_init_once, initialize_memory_cache);
+    for (int i = 0; i < MEMORY_CACHE_SHARDS; i++) {
+        pthread_mutex_lock(&memory_cache_shards[i].mutex);
+        memory_cache_shards[i].entries.clear();
+        memory_cache_shards[i].index.clear();
+        memory_cache_shards[i].size = 0;
+        pthread_mutex_unlock(&memory_cache_shards[i].mutex);
+    }
+}
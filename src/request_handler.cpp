@@ -1,130 +1,870 @@
 
 #include "request_handler.h"
-#include "utils.h"
-#include "http_utils.h"
-
-pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
-std::map<std::string, std::string> url_to_file_cache_map;
+#include "worker_pool.h"
+#include "io_backend.h"
+#include "upstream_pool.h"
+#include "cache_store.h"
+#include "cache_policy.h"
+#include "shared_fetch.h"
+#include "cache_admission.h"
+#include "filter_lists.h"
+
+#include <fcntl.h>
+#include <set>
+#include <sys/uio.h>
 
 extern ParsedArguments parsedArguments;
 
-char rand_char()
-{
-    const char charset[] =
-    "0123456789"
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-    "abcdefghijklmnopqrstuvwxyz";
-    const size_t max_index = (sizeof(charset) - 1);
-    return charset[ rand() % max_index ];
+/*
+ Body of a target server reply. Owns the connection, which goes back to the
+ pool once the body was read completely and nothing else was received.
+*/
+class UpstreamBodyStream : public BodyStream {
+public:
+    UpstreamBodyStream(const std::string &host, int port, int socket_fd)
+        : host(host), port(port), reader(socket_fd, parsedArguments.upstream_timeout_seconds * 1000), body(NULL) {}
+
+    ~UpstreamBodyStream()
+    {
+        delete body;
+        if (reader.socket_fd >= 0)
+            close(reader.socket_fd);
+    }
+
+    // Reads the reply header, NULL if there is no valid reply
+    HttpMessage* read_header(bool expect_body)
+    {
+        HttpMessage *response = read_http_message_header(reader);
+        if (response == NULL)
+            return NULL;
+        body = new MessageBodyStream(reader, response->header, expect_body);
+
+        // Without a body the exchange is already complete
+        if (!has_body()) {
+            std::string none;
+            read(none);
+        }
+        return response;
+    }
+
+    ssize_t read(std::string &out)
+    {
+        ssize_t bytes_read = body->read(out);
+        if (bytes_read == 0 && reader.socket_fd >= 0) {
+            if (body->is_reusable() && reader.buffer.empty())
+                release_upstream_connection(host, port, reader.socket_fd);
+            else
+                close(reader.socket_fd);
+            reader.socket_fd = -1;
+        }
+        return bytes_read;
+    }
+
+    bool has_body() const { return body->has_body(); }
+    bool has_length() const { return body->has_length(); }
+
+    // After read_header() failed: whether the server closed the connection without replying at all
+    bool closed_before_reply() const { return reader.closed && reader.buffer.empty(); }
+
+private:
+    std::string host;
+    int port;
+    SocketReader reader;
+    MessageBodyStream *body;
 };
 
-std::string random_string( size_t length )
+// Methods a request may be sent twice with, see RFC 7231 section 4.2.2
+static bool is_idempotent_method(const std::string &method)
 {
-    std::string str(length,0);
-    std::generate_n( str.begin(), length, rand_char );
-    return str;
+    return method == "GET" || method == "HEAD" || method == "OPTIONS" || method == "PUT" || method == "DELETE";
 }
 
-void* handle_client_connection(void* arg)
+/**
+ * Sends the request to the target server over a pooled persistent connection
+ * and reads the header of the reply; its body is left to read from `body`. If
+ * a reused connection turns out to be closed by the server, failing the send
+ * or closing before any byte of a reply, an idempotent request is retried once
+ * on a fresh connection. Returns NULL when the target server can't be reached.
+ */
+HttpMessage* fetch_from_target_server(const std::string &target, const HttpMessage &request, UpstreamBodyStream *&body)
 {
-    HostInfo *client_info = (HostInfo *)arg;
-    int client_sd = client_info->socket_fd;
+    std::string host;
+    int port;
+    split_host_and_port(target, host, port);
+    std::string request_string = request.to_string();
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = false;
+        int target_sockfd = acquire_upstream_connection(host, port, reused);
+        if (target_sockfd < 0)
+            return NULL;
 
-    // Receive incoming client's request
-    HttpMessage *http_message = read_http_message_from_socket(client_sd);
-    if (http_message == NULL) {
-        return NULL;
+        log("Sending message to target server...");
+        UpstreamBodyStream *upstream = new UpstreamBodyStream(host, port, target_sockfd);
+        HttpMessage *response = NULL;
+        bool closed = true;
+        if (send_to_socket(target_sockfd, request_string) < 0) {
+            log("Error while sending modified HTTP message to target server");
+        } else {
+            response = upstream->read_header(request.header.method != "HEAD");
+            closed = response == NULL && upstream->closed_before_reply();
+        }
+
+        if (response != NULL) {
+            body = upstream;
+            return response;
+        }
+        delete upstream;
+
+        // The server may have got the request, it isn't sent twice unless that is harmless
+        if (!reused || !closed || !is_idempotent_method(request.header.method))
+            return NULL;
+        log("Pooled connection to " + target + " was closed by the server, retrying");
     }
-    HttpMessage *http_response_from_target_server;
+    return NULL;
+}
 
-    std::stringstream msg_stream;
-    msg_stream << "Received request from " << client_info->hostname << ":" << client_info->port << ":\n"
-		       << http_message->to_log_string();
-    log(msg_stream.str());
+/**
+ * Appends the head after the body in the cache store, the length of a
+ * streamed body is only known at its end, and adds the reply to the index.
+ * A body the store already holds is shared rather than kept twice.
+ */
+static bool finish_cache_entry(CacheSegmentWriter &writer, const std::string &request_path, const std::string &head,
+                               time_t expires_at)
+{
+    CacheIndexEntry entry;
+    bool shared_body;
+    if (!writer.finish_body(entry, shared_body) || !writer.append(head.data(), head.size())
+        || !writer.finish(entry.segment, entry.offset))
+        return false;
+    entry.head_length = head.size();
+    entry.stored_at = entry.last_access = time(NULL);
+    entry.expires_at = expires_at;
+    if (shared_body)
+        log("Sharing the cached body of an identical response");
+    return cache_index_store(request_path, entry, shared_body);
+}
 
-    // Extract request path on the target server that client wishes to access
-    std::string request_path = http_message->get_request_url();
+/**
+ * Holds the reply in the memory tier. Replies pushed out to make room that are
+ * only held there are written to disk if they are asked for often enough.
+ */
+static void store_in_memory_tier(const std::string &request_path, const MemoryCachedReply &reply)
+{
+    std::vector<EvictedReply> evicted;
+    memory_cache_store(request_path, reply, &evicted);
+    for (size_t i = 0; i < evicted.size(); i++) {
+        const EvictedReply &eviction = evicted[i];
+        if (eviction.reply.on_disk || !admit_to_disk_cache(eviction.url))
+            continue;
+        CacheSegmentWriter writer;
+        if (writer.append(eviction.reply.body->data(), eviction.reply.body->size())
+            && finish_cache_entry(writer, eviction.url, eviction.reply.head, eviction.reply.expires_at))
+            log("Moved cached response of " + eviction.url + " from memory to disk");
+    }
+}
+
+/*
+ Writes the body to the cache store as it passes through, if the reply is
+ admitted to disk, and keeps a copy for the in-memory cache while it is small
+ enough. The entry is only added once the whole body went through, a reply
+ cut short leaves no trace.
+*/
+class CacheWriteStream : public BodyStream {
+public:
+    CacheWriteStream(BodyStream *source, const std::string &request_path, const HttpHeader &header, time_t expires_at,
+                     bool to_disk)
+        : source(source), request_path(request_path), expires_at(expires_at), writer(NULL), body_length(0),
+          fits_memory_cache(true), done(false)
+    {
+        cached_reply.header = header;
+        if (to_disk)
+            writer = new CacheSegmentWriter();
+        if (writer != NULL && !writer->is_open())
+            discard();
+    }
+
+    ~CacheWriteStream()
+    {
+        discard();
+        delete source;
+    }
+
+    ssize_t read(std::string &out)
+    {
+        ssize_t bytes_read = source->read(out);
+        if (done)
+            return bytes_read;
+
+        if (bytes_read < 0) {
+            discard();
+            done = true;
+        } else if (bytes_read > 0) {
+            const char *data = out.data() + out.size() - bytes_read;
+            if (writer != NULL && !writer->append(data, bytes_read))
+                discard();
+            body_length += bytes_read;
+
+            fits_memory_cache = fits_memory_cache && body_length <= memory_cache_max_body_size();
+            if (fits_memory_cache)
+                memory_copy.append(data, bytes_read);
+            else
+                std::string().swap(memory_copy);
+            done = writer == NULL && !fits_memory_cache;
+        } else {
+            // The cached copy is always sent with its length
+            std::stringstream content_length_ss;
+            content_length_ss << body_length;
+            cached_reply.header.headers["Content-Length"] = content_length_ss.str();
+
+            MemoryCachedReply reply;
+            reply.head = cached_reply.header_to_string();
+            reply.expires_at = expires_at;
+            reply.on_disk = writer != NULL && finish_cache_entry(*writer, request_path, reply.head, expires_at);
+            discard();
+            done = true;
+
+            log("Caching the response");
+            if (fits_memory_cache) {
+                reply.body = std::make_shared<const std::string>(std::move(memory_copy));
+                store_in_memory_tier(request_path, reply);
+            }
+        }
+        return bytes_read;
+    }
+
+private:
+    // Drops the unfinished entry, if any
+    void discard()
+    {
+        delete writer;
+        writer = NULL;
+    }
+
+    BodyStream *source;
+    std::string request_path;
+    HttpMessage cached_reply;   // header only
+    time_t expires_at;
+    CacheSegmentWriter *writer;
+    size_t body_length;
+    std::string memory_copy;
+    bool fits_memory_cache;
+    bool done;                  // nothing more to cache
+};
+
+ClientResponse::~ClientResponse()
+{
+    if (body_fd >= 0)
+        close(body_fd);
+    delete body_stream;
+}
+
+size_t ClientResponse::size() const
+{
+    if (body_stream != NULL)
+        return head.size();
+    return head.size() + (body_fd >= 0 ? body_length : memory_body().size());
+}
+
+// Turns the message into a reply, the body is moved rather than copied
+ClientResponse* take_client_response(HttpMessage *message)
+{
+    ClientResponse *response = new ClientResponse();
+    response->head = message->header_to_string();
+    response->body.swap(message->body);
+    delete message;
+    return response;
+}
+
+// Reply served from the in-memory cache, the body isn't copied
+ClientResponse* make_memory_cached_response(const MemoryCachedReply &reply)
+{
+    ClientResponse *response = new ClientResponse();
+    response->head = reply.head;
+    response->shared_body = reply.body;
+    return response;
+}
 
-    // Checking the cache first...
-    pthread_mutex_lock(&cache_mutex);
-    if (url_to_file_cache_map.find(request_path) != url_to_file_cache_map.end()) {
-	    std::string cached_filename = url_to_file_cache_map[request_path];
-	    pthread_mutex_unlock(&cache_mutex);
+static bool pread_all(int fd, char *data, size_t length, off_t offset)
+{
+    while (length > 0) {
+        ssize_t bytes_read = pread(fd, data, length, offset);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            return false;
+        data += bytes_read;
+        length -= bytes_read;
+        offset += bytes_read;
+    }
+    return true;
+}
 
-	    std::ifstream inFile(cached_filename); //open the cache file
+// Reads the head of the cached reply from its segment, false on error
+static bool read_cached_head(const CacheIndexEntry &entry, std::string &head)
+{
+    int fd = open_cache_segment(entry.segment);
+    if (fd < 0)
+        return false;
+    head.assign(entry.head_length, 0);
+    bool loaded = pread_all(fd, &head[0], head.size(), entry.offset);
+    close(fd);
+    return loaded;
+}
 
-	    std::stringstream strStream;
-	    strStream << inFile.rdbuf(); //read the file
-	    std::string cached_response = strStream.str(); //str holds the content of the file
-	    inFile.close();
+// Opens the cached reply, whose body is sent from its segment. NULL if it can't be read.
+ClientResponse* open_cached_response(const CacheIndexEntry &entry)
+{
+    std::string head;
+    if (!read_cached_head(entry, head))
+        return NULL;
+    int fd = entry.body_length > 0 ? open_cache_segment(entry.body_segment) : -1;
+    if (fd < 0 && entry.body_length > 0)
+        return NULL;
+
+    ClientResponse *response = new ClientResponse();
+    response->head.swap(head);
+    response->body_fd = fd;
+    response->body_offset = entry.body_offset;
+    response->body_length = entry.body_length;
+    return response;
+}
+
+// Promotes the cached reply to the memory tier and serves it from memory, NULL on error
+ClientResponse* load_cached_response(const std::string &request_path, const CacheIndexEntry &entry)
+{
+    MemoryCachedReply reply;
+    if (!read_cached_head(entry, reply.head))
+        return NULL;
 
-	    if (send_to_socket(client_sd, cached_response) < 0) {
-		    log("Error while sending target server's reply back to client");
+    std::string body(entry.body_length, 0);
+    if (entry.body_length > 0) {
+        int fd = open_cache_segment(entry.body_segment);
+        bool loaded = fd >= 0 && pread_all(fd, &body[0], body.size(), entry.body_offset);
+        if (fd >= 0)
+            close(fd);
+        if (!loaded)
             return NULL;
-	    } else {
-		    log("Sent cached response back to the client");
-	    }
+    }
+    reply.body = std::make_shared<const std::string>(std::move(body));
+    reply.expires_at = entry.expires_at;
+    reply.on_disk = true;
+    store_in_memory_tier(request_path, reply);
+    return make_memory_cached_response(reply);
+}
 
-	    // Close the client connection
-        close(client_sd);
+/**
+ * Looks the URL up in the in-memory cache, then in the cache store. A fresh
+ * reply is returned, a stale one is handed out in `stale` along with its
+ * parsed head and the time it went stale, to be revalidated with the target
+ * server. NULL on a miss.
+ */
+static ClientResponse* lookup_cached_response(const std::string &request_path, ClientResponse *&stale,
+                                              HttpHeader &stale_header, time_t &expires_at)
+{
+    ClientResponse *cached_response = NULL;
+    MemoryCachedReply memory_reply;
+    CacheIndexEntry cache_entry;
+    if (memory_cache_lookup(request_path, memory_reply)) {
+        cached_response = make_memory_cached_response(memory_reply);
+        expires_at = memory_reply.expires_at;
+    } else if (cache_index_lookup(request_path, cache_entry)) {
+        // A reply evicted from memory gets back there on its next hit
+        if (cache_entry.body_length <= memory_cache_max_body_size())
+            cached_response = load_cached_response(request_path, cache_entry);
+        else
+            cached_response = open_cached_response(cache_entry);
+        if (cached_response == NULL) {
+            log("Unable to read cached response, fetching from the target server");
+            cache_index_remove(request_path, cache_entry.segment, cache_entry.offset);
+            return NULL;
+        }
+        expires_at = cache_entry.expires_at;
     } else {
-	    pthread_mutex_unlock(&cache_mutex);
+        return NULL;
+    }
+
+    if (time(NULL) < expires_at)
+        return cached_response;
+    if (parse_http_header(cached_response->head, stale_header))
+        stale = cached_response;
+    else
+        delete cached_response;
+    return NULL;
+}
+
+// Serves the stale reply the target server confirmed with a 304, which refreshes the entry
+static ClientResponse* refresh_cached_response(const std::string &request_path, ClientResponse *stale,
+                                               HttpHeader &stale_header, const HttpHeader &not_modified)
+{
+    merge_not_modified_headers(stale_header, not_modified);
+    time_t expires_at = response_expiry_time(stale_header, time(NULL));
+
+    HttpMessage refreshed;
+    refreshed.header = stale_header;
+    stale->head = refreshed.header_to_string();
+    cache_index_refresh(request_path, expires_at);
+    memory_cache_refresh(request_path, stale->head, expires_at);
+    return stale;
+}
+
+/**
+ * Turns the message into a reply whose body, if any, is read from the stream.
+ * A body of unknown length goes to the client in chunks, HTTP/1.0 clients
+ * read it until the connection closes.
+ */
+static ClientResponse* make_streamed_response(HttpMessage *message, BodyStream *body_stream, bool length_known,
+                                              const std::string &client_protocol)
+{
+    bool chunked = false;
+    bool close_delimited = false;
+    if (body_stream != NULL && !length_known) {
+        if (client_protocol == "HTTP/1.1") {
+            message->header.headers["Transfer-Encoding"] = "chunked";
+            chunked = true;
+        } else {
+            close_delimited = true;
+        }
+    }
+
+    ClientResponse *response = take_client_response(message);
+    response->body_stream = body_stream;
+    response->chunked = chunked;
+    response->close_delimited = close_delimited;
+    return response;
+}
+
+// Reply of the fetch another client leads for the same URL, NULL if it wasn't shared
+static ClientResponse* wait_for_shared_response(SharedFetch &shared_fetch, const HttpMessage &request)
+{
+    HttpMessage *message = new HttpMessage();
+    bool length_known;
+    BodyStream *body_stream;
+    if (!shared_fetch.wait(message->header, length_known, body_stream)) {
+        delete message;
+        return NULL;
+    }
+    return make_streamed_response(message, body_stream, length_known, request.header.protocol);
+}
+
+static ClientResponse* respond_to_request(const HttpMessage &http_message, const HostInfo &client_info, bool serve_stale);
+
+// Whether the body is worth compressing, media types that are compressed already are not
+static bool is_compressible_type(const HeaderMap &headers)
+{
+    HeaderMap::const_iterator it = headers.find("Content-Type");
+    if (it == headers.end())
+        return false;
+    std::string type = trim(split(it->second, ';')[0]);
+    std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+    return type.compare(0, 5, "text/") == 0 || type == "application/json" || type == "application/javascript"
+        || type == "application/xml" || type == "image/svg+xml"
+        || (type.size() > 4 && type.compare(type.size() - 4, 4, "+xml") == 0)
+        || (type.size() > 5 && type.compare(type.size() - 5, 5, "+json") == 0);
+}
+
+// The reply depends on the request's Accept-Encoding, caches down the line must know
+static void add_vary_accept_encoding(HeaderMap &headers)
+{
+    HeaderMap::iterator it = headers.find("Vary");
+    if (it == headers.end()) {
+        headers["Vary"] = "Accept-Encoding";
+        return;
+    }
+    std::string vary = it->second;
+    std::transform(vary.begin(), vary.end(), vary.begin(), ::tolower);
+    if (vary.find("accept-encoding") == std::string::npos && trim(vary) != "*")
+        it->second += ", Accept-Encoding";
+}
+
+/**
+ * Decodes a gzip-compressed reply, as it is cached, for a client that doesn't
+ * accept gzip. The body is inflated while it is sent, its length is unknown.
+ */
+static ClientResponse* decode_for_client(ClientResponse *response, const HttpMessage &request)
+{
+    HttpMessage *message = new HttpMessage();
+    HeaderMap::const_iterator encoding;
+    if (!parse_http_header(response->head, message->header)
+        || (encoding = message->header.headers.find("Content-Encoding")) == message->header.headers.end()
+        || trim(encoding->second) != "gzip") {
+        delete message;
+        return response;
+    }
+    message->header.headers.erase("Content-Encoding");
+    message->header.headers.erase("Content-Length");
+
+    // Our gzip encoding gets the target server's tag back, a gzip reply of the target server a weak one
+    HeaderMap::iterator etag = message->header.headers.find("ETag");
+    if (etag != message->header.headers.end()) {
+        std::string identity = identity_etag(etag->second);
+        if (identity != trim(etag->second))
+            etag->second = identity;
+        else if (identity.compare(0, 2, "W/") != 0)
+            etag->second = "W/" + identity;
+    }
+
+    BodyStream *compressed = NULL;
+    if (response->body_stream != NULL) {
+        compressed = response->body_stream;
+        response->body_stream = NULL;
+    } else if (response->body_fd >= 0) {
+        compressed = new FileBodyStream(response->body_fd, response->body_offset, response->body_length);
+        response->body_fd = -1;
+    } else if (!response->memory_body().empty()) {
+        compressed = new MemoryBodyStream(response->shared_body ? response->shared_body
+                                                                : std::make_shared<const std::string>(std::move(response->body)));
     }
+    delete response;
 
+    log("Decompressing the response for a client that doesn't accept gzip");
+    BodyStream *body_stream = compressed != NULL ? new InflateBodyStream(compressed, true) : NULL;
+    return make_streamed_response(message, body_stream, false, request.header.protocol);
+}
+
+// Keeps only the head of a reply, for a HEAD request served from a cached GET reply
+static void drop_body(ClientResponse &response)
+{
+    if (response.body_fd >= 0)
+        close(response.body_fd);
+    response.body_fd = -1;
+    delete response.body_stream;
+    response.body_stream = NULL;
+    response.body.clear();
+    response.shared_body.reset();
+    response.chunked = false;
+    response.close_delimited = false;
+}
+
+static pthread_mutex_t revalidations_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::set<std::string> revalidating_urls;     // stale replies being refreshed in the background
+
+struct BackgroundRevalidation {
+    std::string request_path;
+    HttpMessage request;
+    HostInfo client_info;
+};
+
+static void* run_background_revalidation(void *arg)
+{
+    BackgroundRevalidation *revalidation = (BackgroundRevalidation *)arg;
+    ClientResponse *response = respond_to_request(revalidation->request, revalidation->client_info, false);
+
+    // The new body is read through to its end, which caches it
+    if (response->body_stream != NULL) {
+        std::string piece;
+        while (response->body_stream->read(piece) > 0)
+            piece.clear();
+    }
+    delete response;
+
+    pthread_mutex_lock(&revalidations_mutex);
+    revalidating_urls.erase(revalidation->request_path);
+    pthread_mutex_unlock(&revalidations_mutex);
+    delete revalidation;
+    return NULL;
+}
+
+// Refreshes the stale reply on a thread of its own, unless that is already under way
+static void start_background_revalidation(const std::string &request_path, const HttpMessage &request,
+                                          const HostInfo &client_info)
+{
+    pthread_mutex_lock(&revalidations_mutex);
+    bool started = revalidating_urls.insert(request_path).second;
+    pthread_mutex_unlock(&revalidations_mutex);
+    if (!started)
+        return;
+
+    // The client's own conditions only applied to its request
+    BackgroundRevalidation *revalidation = new BackgroundRevalidation();
+    revalidation->request_path = request_path;
+    revalidation->request = request;
+    revalidation->request.header.headers.erase("If-None-Match");
+    revalidation->request.header.headers.erase("If-Modified-Since");
+    revalidation->client_info = client_info;
+
+    pthread_t revalidation_thread;
+    if (pthread_create(&revalidation_thread, NULL, run_background_revalidation, revalidation) != 0) {
+        log("Error while spawning revalidation thread");
+        pthread_mutex_lock(&revalidations_mutex);
+        revalidating_urls.erase(request_path);
+        pthread_mutex_unlock(&revalidations_mutex);
+        delete revalidation;
+        return;
+    }
+    pthread_detach(revalidation_thread);
+}
+
+// Whether the stale reply may stand in for a target server that failed
+static bool may_serve_stale_on_error(const HttpHeader &stale_header, time_t stale_expires_at)
+{
+    return time(NULL) < stale_serving_limit(stale_header, stale_expires_at, "stale-if-error",
+                                            parsedArguments.stale_if_error_seconds);
+}
+
+bool set_connection_header(ClientResponse &response, bool keep_alive)
+{
+    if (response.close_delimited)
+        keep_alive = false;
+
+    std::string::size_type status_line_end = response.head.find("\r\n");
+    if (status_line_end != std::string::npos)
+        response.head.insert(status_line_end + 2, keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    return keep_alive;
+}
+
+std::string chunk_size_line(size_t length)
+{
+    char line[32];
+    snprintf(line, sizeof(line), "%zx\r\n", length);
+    return line;
+}
+
+// Relays the body piece by piece as it comes out of the stream
+static int send_body_stream(int socket_fd, BodyStream *stream, bool chunked)
+{
+    std::string piece;
+    while (true) {
+        piece.clear();
+        ssize_t length = stream->read(piece);
+        if (length < 0)
+            return -1;
+        if (length == 0)
+            return chunked ? io_send_all(socket_fd, "0\r\n\r\n", 5) : 0;
+
+        std::string size_line = chunk_size_line(length);
+        struct iovec buffers[3];
+        int count = 0;
+        if (chunked) {
+            buffers[count].iov_base = (void *)size_line.data();
+            buffers[count++].iov_len = size_line.size();
+        }
+        buffers[count].iov_base = (void *)piece.data();
+        buffers[count++].iov_len = piece.size();
+        if (chunked) {
+            buffers[count].iov_base = (void *)"\r\n";
+            buffers[count++].iov_len = 2;
+        }
+        if (io_send_buffers_all(socket_fd, buffers, count) < 0)
+            return -1;
+    }
+}
+
+int send_client_response(int socket_fd, const ClientResponse &response)
+{
+    struct iovec buffers[2];
+    buffers[0].iov_base = (void *)response.head.data();
+    buffers[0].iov_len = response.head.size();
+    if (response.body_stream != NULL) {
+        // The head goes out right away, before the target server sent the body
+        if (io_send_buffers_all(socket_fd, buffers, 1) < 0)
+            return -1;
+        return send_body_stream(socket_fd, response.body_stream, response.chunked);
+    }
+    if (response.body_fd < 0) {
+        const std::string &body = response.memory_body();
+        buffers[1].iov_base = (void *)body.data();
+        buffers[1].iov_len = body.size();
+        return io_send_buffers_all(socket_fd, buffers, 2);
+    }
+
+    // The head waits for the first body bytes instead of going out in its own packet
+    if (io_send_buffers_all(socket_fd, buffers, 1, MSG_MORE) < 0)
+        return -1;
+    return io_sendfile_all(socket_fd, response.body_fd, response.body_offset, response.body_length);
+}
+
+void* handle_client_connection(void* arg)
+{
+    HostInfo *client_info = (HostInfo *)arg;
+    int client_sd = client_info->socket_fd;
+
+    // Requests are read one after another from the same reader, so pipelined
+    // requests already received stay buffered and get answered in order
+    SocketReader reader(client_sd, parsedArguments.keep_alive_timeout_seconds * 1000);
+    int requests_served = 0;
+    bool keep_alive = true;
+
+    while (keep_alive) {
+        // Receive incoming client's request
+        bool reusable = false;
+        HttpMessage *http_message = read_http_message(reader, &reusable);
+        if (http_message == NULL)
+            break;
+
+        requests_served++;
+        keep_alive = reusable && requests_served < parsedArguments.max_keep_alive_requests;
+
+        ClientResponse *response = process_client_request(*http_message, *client_info);
+        keep_alive = set_connection_header(*response, keep_alive);
+        delete http_message;
+
+        // Send the reply to the client
+        int sent = send_client_response(client_sd, *response);
+        delete response;
+        if (sent < 0) {
+            log("Error while sending target server's reply back to client");
+            break;
+        }
+        log("Sent response back to the client");
+    }
+
+	// Close the client connection, clean up the resources
+    close(client_sd);
+    delete client_info;
+
+    return NULL;
+}
+
+ClientResponse* process_client_request(const HttpMessage &http_message, const HostInfo &client_info)
+{
+    std::stringstream msg_stream;
+    msg_stream << "Received request from " << client_info.hostname << ":" << client_info.port << ":\n"
+		       << http_message.to_log_string();
+    log(msg_stream.str());
+    record_cache_request(http_message.get_request_url());
+
+    // Replies are cached gzip-compressed, clients that can't take that get them decoded
+    ClientResponse *response = respond_to_request(http_message, client_info, true);
+    if (!accepts_encoding(http_message.header, "gzip"))
+        response = decode_for_client(response, http_message);
+    if (http_message.header.method == "HEAD")
+        drop_body(*response);
+    return response;
+}
+
+/**
+ * Serves the request from the cache or the target server. With serve_stale,
+ * a reply that went stale a short while ago is served as is and revalidated
+ * in the background; without it, it is revalidated before being served.
+ */
+static ClientResponse* respond_to_request(const HttpMessage &http_message, const HostInfo &client_info, bool serve_stale)
+{
+    HttpMessage *http_response_from_target_server;
+    UpstreamBodyStream *upstream_body = NULL;
+
+    // Extract request path on the target server that client wishes to access
+    std::string request_path = http_message.get_request_url();
     std::vector<std::string> url_parts = split(request_path.substr(1), '/');
     std::string redirect_to = url_parts[0];
     std::string redirect_path = "/" + url_parts[1];
 
-    if (is_host_blocked(redirect_to, parsedArguments.sites_blocklist_filename)) {
+    // Checked before the cache, so a host blocked by a reload isn't served what was cached of it
+    if (is_host_blocked(redirect_to)) {
 	    log("Host " + redirect_to + " is blocked, returning code 401 - Access Denied");
-	    http_response_from_target_server = make_http_response("401 Access Denied"); 
-    } else {
+	    return take_client_response(make_http_response("401 Access Denied"));
+    }
 
-	    if (redirect_to.empty()) {
-		    http_response_from_target_server = make_http_response("404 Not Found"); 
+    // Checking the cache first, it only holds replies to GET, which also answer HEAD
+    ClientResponse *stale_response = NULL;
+    HttpHeader stale_header;
+    time_t stale_expires_at;
+    ClientResponse *cached_response = NULL;
+    const std::string &method = http_message.header.method;
+    if (method == "GET" || method == "HEAD")
+        cached_response = lookup_cached_response(request_path, stale_response, stale_header, stale_expires_at);
+    if (cached_response != NULL) {
+	    log("Serving cached response to the client");
+	    return cached_response;
+    }
+
+    // A reply that went stale only a short while ago doesn't make the client wait for its revalidation
+    if (stale_response != NULL && serve_stale
+	    && time(NULL) < stale_serving_limit(stale_header, stale_expires_at, "stale-while-revalidate",
+	                                        parsedArguments.stale_while_revalidate_seconds)) {
+	    log("Serving stale cached response, revalidating it in the background");
+	    start_background_revalidation(request_path, http_message, client_info);
+	    return stale_response;
+    }
+
+    // Concurrent misses of the same URL wait for a single fetch from the target server
+    SharedFetch shared_fetch;
+    if (http_message.header.method == "GET" && !shared_fetch.join(request_path)) {
+	    log("Waiting for the response another client is fetching");
+	    ClientResponse *shared_response = wait_for_shared_response(shared_fetch, http_message);
+	    if (shared_response != NULL) {
+		    log("Serving the response fetched for another client");
+		    delete stale_response;
+		    return shared_response;
 	    }
 
-	    log("Redirecting message to: " + redirect_to);
-	    log("Path on target server: " + redirect_path);
+	    // The reply wasn't shared, but a revalidation may have refreshed the cache
+	    delete stale_response;
+	    stale_response = NULL;
+	    cached_response = lookup_cached_response(request_path, stale_response, stale_header, stale_expires_at);
+	    if (cached_response != NULL) {
+		    log("Serving cached response to the client");
+		    return cached_response;
+	    }
+    }
 
-	    // Modify the HTTP message before sending it to the target server
-	    HttpMessage redirected_message(*http_message);
-	    redirected_message.header.path = redirect_path;
-	    redirected_message.header.headers["Host"] = redirect_to;
+    if (redirect_to.empty()) {
+	    http_response_from_target_server = make_http_response("404 Not Found"); 
+    }
 
-	    log("Redirected request to " + redirect_to + ":\n" + redirected_message.to_log_string());
+    log("Redirecting message to: " + redirect_to);
+    log("Path on target server: " + redirect_path);
+
+    // Modify the HTTP message before sending it to the target server
+    HttpMessage redirected_message(http_message);
+    redirected_message.header.path = redirect_path;
+    redirected_message.header.headers["Host"] = redirect_to;
+
+    // The connection to the target server is kept open for later requests
+    redirected_message.header.headers["Connection"] = "keep-alive";
+    redirected_message.header.headers.erase("Keep-Alive");
+    redirected_message.header.headers.erase("Proxy-Connection");
+
+    // A stale cached reply is revalidated instead of being downloaded again. The
+    // client's own conditions are dropped then, the 304 must answer ours. The
+    // reply is kept even without validators, to stand in if the fetch fails.
+    if (stale_response != NULL) {
+	    redirected_message.header.headers.erase("If-None-Match");
+	    redirected_message.header.headers.erase("If-Modified-Since");
+	    if (add_revalidation_headers(stale_header, redirected_message.header))
+		    log("Cached response is stale, revalidating it");
+    }
 
-	    // Send the modified HTTP message to target server
-	    int target_sockfd = create_socket_to_server(redirect_to);
-	    if (target_sockfd < 0)
-	    {
-		    // An error occured, TODO: send HTTP 500 back to client
-            http_response_from_target_server = make_http_response("404 Not Found");
-		    send_to_socket(client_sd, http_response_from_target_server->to_string());
-            return NULL;
-	    }
+    log("Redirected request to " + redirect_to + ":\n" + redirected_message.to_log_string());
 
-	    log("Sending message to target server...");
-	    if (send_to_socket(target_sockfd, redirected_message.to_string()) < 0) {
-    	    //close(target_sockfd);
-		    log("Error while sending modified HTTP message to target server");
-		    http_response_from_target_server = make_http_response("404 Not Found");
-		    send_to_socket(client_sd, http_response_from_target_server->to_string());
-            return NULL;
-	    } else {
-	        //close(target_sockfd);
+    // Send the modified HTTP message to target server
+    http_response_from_target_server = fetch_from_target_server(redirect_to, redirected_message, upstream_body);
+    if (http_response_from_target_server == NULL) {
+	    if (stale_response != NULL && may_serve_stale_on_error(stale_header, stale_expires_at)) {
+		    log("Target server failed, serving the stale cached response");
+		    return stale_response;
 	    }
+	    // An error occured, TODO: send HTTP 500 back to client
+	    delete stale_response;
+	    http_response_from_target_server = make_http_response("404 Not Found");
+            return take_client_response(http_response_from_target_server);
+    }
 
-	    // Receive target server's reply
-	    http_response_from_target_server = read_http_message_from_socket(target_sockfd);
-	    if (http_response_from_target_server == NULL) {
-		    http_response_from_target_server = make_http_response("404 Not Found");
-		    send_to_socket(client_sd, http_response_from_target_server->to_string());
-            return NULL;
-	    }
-	    
+    if (stale_response != NULL && http_response_from_target_server->header.status.compare(0, 1, "5") == 0
+	    && may_serve_stale_on_error(stale_header, stale_expires_at)) {
+	    log("Target server replied with an error, serving the stale cached response");
+	    delete http_response_from_target_server;
+	    delete upstream_body;
+	    return stale_response;
+    }
+
+    if (stale_response != NULL && http_response_from_target_server->header.status.compare(0, 3, "304") == 0) {
+	    log("Target server confirmed the cached response, serving it to the client");
+	    ClientResponse *response = refresh_cached_response(request_path, stale_response, stale_header,
+	                                                       http_response_from_target_server->header);
+	    delete http_response_from_target_server;
+	    delete upstream_body;
+	    return response;
+    }
+    if (stale_response != NULL) {
+	    // The cached reply changed; the conditions were about it, not about where it moved
+	    redirected_message.header.headers.erase("If-None-Match");
+	    redirected_message.header.headers.erase("If-Modified-Since");
+	    delete stale_response;
+    }
+    
         int redirect_cnt = 0;
-	    while (http_response_from_target_server->header.status.find("Moved") != std::string::npos && 
+    while (http_response_from_target_server->header.status.find("Moved") != std::string::npos && 
     	    redirect_cnt < 10) {
     	    redirect_cnt++;
     	    
@@ -141,77 +881,120 @@ void* handle_client_connection(void* arg)
             redirected_message.header.path = loc_redirect;
     	    
     	    // Try to fetch the resource from redirect URL
-	        int target_sockfd = create_socket_to_server(redirect_to);
-	        if (target_sockfd < 0)
-	        {
-		        // An error occured, TODO: send HTTP 500 back to client
+    	    delete http_response_from_target_server;
+    	    delete upstream_body;
+    	    upstream_body = NULL;
+        http_response_from_target_server = fetch_from_target_server(redirect_to, redirected_message, upstream_body);
+        if (http_response_from_target_server == NULL)
+        {
+	        // An error occured, TODO: send HTTP 500 back to client
                 http_response_from_target_server = make_http_response("404 Not Found");
-		        send_to_socket(client_sd, http_response_from_target_server->to_string());
-                return NULL;
-	        }
-
-	        log("Sending message to target server...");
-	        if (send_to_socket(target_sockfd, redirected_message.to_string()) < 0) {
-        	    //close(target_sockfd);
-		        log("Error while sending modified HTTP message to target server");
-		        http_response_from_target_server = make_http_response("404 Not Found");
-		        send_to_socket(client_sd, http_response_from_target_server->to_string());
-                return NULL;
-	        } else {
-	            //close(target_sockfd);
-	        }
-	    }
+                return take_client_response(http_response_from_target_server);
+        }
+    }
 
-	    log("Received response from target server:\n'" + http_response_from_target_server->to_log_string() + "'");
+    log("Received response from target server:\n'" + http_response_from_target_server->to_log_string() + "'");
+
+    // Connection related headers of the target server don't apply to the client connection,
+    // the caller adds its own Connection header when sending
+    HeaderMap &response_headers = http_response_from_target_server->header.headers;
+    response_headers.erase("Keep-Alive");
+    response_headers.erase("Connection");
+
+    bool filtered_type = (response_headers.find("Content-Type") != response_headers.end()) &&
+        (response_headers["Content-Type"] == "text/html" || response_headers["Content-Type"] == "text/plain");
+
+    // The body of the target server's reply is streamed through the stages below
+    BodyStream *body_stream = NULL;
+    bool length_known = true;
+    if (upstream_body != NULL && upstream_body->has_body()) {
+        body_stream = upstream_body;
+        length_known = upstream_body->has_length();
+        response_headers.erase("Transfer-Encoding");
+
+        // A gzip body that isn't filtered stays compressed, it is decoded for the clients that need it
+        std::string encoding = (response_headers.find("Content-Encoding") != response_headers.end()) ? trim(response_headers["Content-Encoding"]) : "";
+        if (encoding == "gzip" && !filtered_type) {
+            response_headers["Content-Encoding"] = "gzip";
+        } else if (encoding == "gzip" || encoding == "deflate") {
+            log("Target server's reply is compressed - decompressing it on the fly");
+            body_stream = new InflateBodyStream(body_stream, encoding == "gzip");
+            response_headers.erase("Content-Encoding");
+            length_known = false;
+        }
+    } else {
+        delete upstream_body;
     }
 
     // Filter words in the response's body
-    if ((http_response_from_target_server->header.headers.find("Content-Type") != http_response_from_target_server->header.headers.end()) && 
-	    (http_response_from_target_server->header.headers["Content-Type"] == "text/html" || http_response_from_target_server->header.headers["Content-Type"] == "text/plain")) {
-	    http_response_from_target_server->body = filter_words(http_response_from_target_server->body, parsedArguments.filter_words_list_filename);
-	    std::stringstream content_length_ss;
-	    content_length_ss << http_response_from_target_server->body.size();
-	    http_response_from_target_server->header.headers["Content-Length"] = content_length_ss.str();
+    if (filtered_type) {
+	    if (body_stream != NULL) {
+		    body_stream = new FilterBodyStream(body_stream);
+		    length_known = false;
+	    } else {
+		    HttpMessage *response = http_response_from_target_server;
+		    run_on_worker_pool([response]() {
+			    response->body = filter_words(response->body);
+		    });
+		    std::stringstream content_length_ss;
+		    content_length_ss << http_response_from_target_server->body.size();
+		    http_response_from_target_server->header.headers["Content-Length"] = content_length_ss.str();
+	    }
     }
 
     // Cache if it's allowed
-    if ((http_response_from_target_server->header.headers.find("Cache-Control") == http_response_from_target_server->header.headers.end()) || 
-		    ((http_response_from_target_server->header.headers["Cache-Control"] != "max-age=0") && 
-		    (http_response_from_target_server->header.headers["Cache-Control"] != "no-cache") && 
-		    (http_response_from_target_server->header.headers["Cache-Control"] != "no-store"))) {
+    time_t response_time = time(NULL);
+    bool cacheable = is_response_cacheable(http_message.header.method, http_response_from_target_server->header,
+                                           response_time);
+    time_t expires_at = response_expiry_time(http_response_from_target_server->header, response_time);
+
+    // Text is cached gzip-compressed, and sent that way to the clients that accept it
+    if (cacheable && body_stream != NULL && response_headers.find("Content-Encoding") == response_headers.end()
+        && is_compressible_type(response_headers)) {
+        body_stream = new GzipBodyStream(body_stream);
+        response_headers["Content-Encoding"] = "gzip";
+        length_known = false;
+        // The encoding is another representation, so it can't keep the tag of the original
+        if (response_headers.find("ETag") != response_headers.end())
+            response_headers["ETag"] = gzip_etag(response_headers["ETag"]);
+    }
+    if (response_headers.find("Content-Encoding") != response_headers.end())
+        add_vary_accept_encoding(response_headers);
+    if (!length_known)
+        response_headers.erase("Content-Length");
+
+    // Only replies asked for more than once are written to disk, the others are just held in memory
+    bool to_disk = cacheable && admit_to_disk_cache(request_path);
+    if (cacheable && body_stream != NULL)
+        body_stream = new CacheWriteStream(body_stream, request_path, http_response_from_target_server->header, expires_at,
+                                           to_disk);
+
+    // Clients that missed the same URL meanwhile get this reply too
+    if (cacheable)
+        body_stream = shared_fetch.publish(http_response_from_target_server->header, length_known, body_stream);
+
+    ClientResponse *response = make_streamed_response(http_response_from_target_server, body_stream, length_known,
+                                                      http_message.header.protocol);
+
+    if (cacheable && body_stream == NULL) {
 	    log("Caching the response");
-	    std::string cache_filename = random_string(32);
+	    MemoryCachedReply reply;
+	    reply.head = response->head;
+	    reply.expires_at = expires_at;
+	    if (to_disk) {
+		    CacheSegmentWriter writer;
+		    reply.on_disk = writer.append(response->body.data(), response->body.size())
+			    && finish_cache_entry(writer, request_path, response->head, expires_at);
+		    if (!reply.on_disk)
+			    log("Unable to write the response to the cache");
+	    }
 
-	    // Create cache directory if not exists
-	    struct stat st = {0};
-	    if (stat(parsedArguments.cache_directory_path.c_str(), &st) == -1) {
-	        mkdir(parsedArguments.cache_directory_path.c_str(), 0700);
+	    if (response->body.size() <= memory_cache_max_body_size()) {
+		    response->shared_body = std::make_shared<const std::string>(std::move(response->body));
+		    reply.body = response->shared_body;
+		    store_in_memory_tier(request_path, reply);
 	    }
-	    // Write target server's response to the newly created file
-	    std::ofstream fout;
-	    std::string full_path = parsedArguments.cache_directory_path + "/" + cache_filename;
-	    fout.open(full_path);
-	    fout << http_response_from_target_server->to_string();
-	    fout.close();
-
-	    pthread_mutex_lock(&cache_mutex);
-	    url_to_file_cache_map[request_path] = full_path;
-	    pthread_mutex_unlock(&cache_mutex);
-    }
-
-    // Send the target server's reply to the client
-    if (send_to_socket(client_sd, http_response_from_target_server->to_string()) < 0) {
-	    log("Error while sending target server's reply back to client");
-	    return NULL;
-    } else {
-	    log("Sent response back to the client");
     }
-	
-
-	// Close the client connection, clean up the resources
-    close(client_sd);
-    delete client_info;
-    delete http_message;
 
-    return NULL;
+    return response;
 }
@@ -1,18 +1,25 @@
 
 #include "request_handler.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "io_backend.h"
+#include "upstream_pool.h"
+#include "dns_resolver.h"
+#include "memory_cache.h"
+#include "cache_store.h"
+#include "cache_admission.h"
+#include "cache_janitor.h"
+#include "filter_lists.h"
+#include "shared_fetch.h"
 #include "utils.h"
 
+#include <signal.h>
+
 ParsedArguments parsedArguments;
 
-int main(int argc, char* argv[])
+void* run_accept_loop(void* arg)
 {
-    parsedArguments = parse_arguments(argc, argv);
-    log("Launching server...");
-
-    struct sockaddr_in listening_socket_address = create_listening_socket_address(parsedArguments);
-    int listening_socket = create_listening_socket(&listening_socket_address);
-
-    log("Started listening to client connecitons " + std::to_string(parsedArguments.port));
+    int listening_socket = (int)(long)arg;
 
     // Entering the main loop, waiting for clients to connect
     while (true)
@@ -26,4 +33,63 @@ int main(int argc, char* argv[])
             pthread_detach(client_thread);
         }
     }
+    return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+    parsedArguments = parse_arguments(argc, argv);
+    log("Launching server...");
+
+    // A client closing its connection early must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!set_io_backend(parsedArguments.io_backend))
+        log("io_uring or the operations it is used for are not supported by the kernel, falling back to plain system calls");
+
+    configure_dns_resolver(parsedArguments.dns_server, parsedArguments.dns_timeout_ms);
+    start_worker_pool(parsedArguments.worker_threads, parsedArguments.worker_queue_depth);
+    start_upstream_pool(parsedArguments.upstream_max_idle, parsedArguments.upstream_max_idle_per_host,
+                        parsedArguments.upstream_idle_timeout_seconds);
+    // Readers of a shared fetch are given as long to catch up as the target server to reply
+    configure_shared_fetch(parsedArguments.upstream_timeout_seconds * 1000);
+    configure_memory_cache((size_t)parsedArguments.memory_cache_megabytes * 1024 * 1024);
+    open_cache_index(parsedArguments.cache_directory_path);
+    start_cache_store(parsedArguments.cache_directory_path, (size_t)parsedArguments.cache_segment_megabytes * 1024 * 1024);
+    // The request sketch tracks about as many URLs as both tiers hold
+    configure_cache_admission((size_t)parsedArguments.memory_cache_megabytes * 256 + cache_index_size());
+    start_cache_janitor((uint64_t)parsedArguments.cache_max_megabytes * 1024 * 1024, parsedArguments.cache_max_entries);
+    load_filter_lists(parsedArguments.sites_blocklist_filename, parsedArguments.filter_words_list_filename);
+    start_filter_lists_reloader();
+
+    // With several listeners every one gets its own SO_REUSEPORT socket, so the
+    // kernel spreads incoming connections over the accept loops
+    struct sockaddr_in listening_socket_address = create_listening_socket_address(parsedArguments);
+    std::vector<int> listening_sockets;
+    for (int i = 0; i < parsedArguments.listeners; i++) {
+        listening_sockets.push_back(create_listening_socket(&listening_socket_address, parsedArguments.listen_backlog,
+                                                            parsedArguments.listeners > 1,
+                                                            parsedArguments.defer_accept_seconds));
+    }
+
+    log("Started listening to client connecitons " + std::to_string(parsedArguments.port));
+
+    if (parsedArguments.server_mode == "epoll") {
+        run_event_loop_server(listening_sockets, parsedArguments);
+        return 0;
+    }
+
+    if (listening_sockets.size() == 1) {
+        run_accept_loop((void *)(long)listening_sockets[0]);
+        return 0;
+    }
+
+    std::vector<pthread_t> accept_threads(listening_sockets.size());
+    for (size_t i = 0; i < listening_sockets.size(); i++) {
+        if (pthread_create(&accept_threads[i], NULL, run_accept_loop, (void *)(long)listening_sockets[i]) != 0)
+            print_error_and_die("Error while spawning accept loop thread");
+        pin_thread_to_core(accept_threads[i], i);
+    }
+    for (size_t i = 0; i < accept_threads.size(); i++)
+        pthread_join(accept_threads[i], NULL);
 }
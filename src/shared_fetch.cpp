@@ -0,0 +1,293 @@
+#include "shared_fetch.h"
+
+// Body bytes held for the readers before no one may join any more and reading on waits for the slowest one
+const size_t SHARED_FETCH_MAX_BUFFER = 4 << 20;
+// Largest piece handed to a reader at once
+const size_t SHARED_FETCH_MAX_PIECE = 65536;
+
+static int follower_timeout_ms = 30000;
+
+struct SharedFetchState {
+    std::string url;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed;
+    enum { FETCHING, SHARED, ABANDONED } status;
+    HttpHeader header;
+    bool length_known;
+    bool has_body;
+    BodyStream *source;             // the leader's body, read by whichever reader needs the next piece
+    bool source_busy;               // a reader is reading it without the mutex
+    std::string buffer;             // body bytes not yet read by every reader
+    uint64_t buffer_start;          // offset of the buffer within the body
+    bool finished;
+    bool failed;
+    bool registered;                // in shared_fetches, open to joining
+    std::map<uint64_t, uint64_t> reader_offsets;    // reader id -> next offset to read, detached ones are dropped
+    uint64_t next_reader_id;
+
+    SharedFetchState(const std::string &url)
+        : url(url), status(FETCHING), length_known(false), has_body(false), source(NULL), source_busy(false),
+          buffer_start(0), finished(false), failed(false), registered(true), next_reader_id(1)
+    {
+        pthread_mutex_init(&mutex, NULL);
+        pthread_cond_init(&changed, NULL);
+    }
+
+    // Once no one reads the body any more, the rest of it isn't fetched
+    ~SharedFetchState()
+    {
+        delete source;
+        pthread_cond_destroy(&changed);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    // Whether a follower joining now can still read the body from its start, under mutex
+    bool is_joinable() const
+    {
+        return status != ABANDONED && !finished && !failed && buffer_start == 0 && buffer.size() <= SHARED_FETCH_MAX_BUFFER;
+    }
+
+    // Drops the bytes every reader read once past the limit, under mutex
+    void trim_buffer()
+    {
+        if (buffer.size() <= SHARED_FETCH_MAX_BUFFER)
+            return;
+        uint64_t keep_from = buffer_start + buffer.size();
+        for (std::map<uint64_t, uint64_t>::iterator it = reader_offsets.begin(); it != reader_offsets.end(); ++it)
+            keep_from = std::min(keep_from, it->second);
+        buffer.erase(0, keep_from - buffer_start);
+        buffer_start = keep_from;
+    }
+};
+
+void configure_shared_fetch(int timeout_ms)
+{
+    follower_timeout_ms = timeout_ms;
+}
+
+static pthread_mutex_t shared_fetches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, std::shared_ptr<SharedFetchState> > shared_fetches;    // the joinable ones
+
+// No one joins the fetch any more, must not be called with its mutex held
+static void unregister_shared_fetch(const std::shared_ptr<SharedFetchState> &state)
+{
+    pthread_mutex_lock(&shared_fetches_mutex);
+    std::map<std::string, std::shared_ptr<SharedFetchState> >::iterator it = shared_fetches.find(state->url);
+    if (it != shared_fetches.end() && it->second == state)
+        shared_fetches.erase(it);
+    pthread_mutex_unlock(&shared_fetches_mutex);
+}
+
+/*
+ A reader of the shared body, the leader or a follower. Every reader takes
+ the pieces from the buffer at its own pace, and the one that runs out reads
+ the next piece from the source for all of them, so the fetch goes on as long
+ as anyone reads: a leader whose client stalls holds up no follower.
+*/
+class SharedBodyStream : public BodyStream {
+public:
+    SharedBodyStream(const std::shared_ptr<SharedFetchState> &state, uint64_t reader_id)
+        : state(state), reader_id(reader_id) {}
+
+    ~SharedBodyStream()
+    {
+        pthread_mutex_lock(&state->mutex);
+        state->reader_offsets.erase(reader_id);
+        pthread_cond_broadcast(&state->changed);
+        pthread_mutex_unlock(&state->mutex);
+    }
+
+    // Fails once the reader was detached for falling behind, its client gets an incomplete body
+    ssize_t read(std::string &out)
+    {
+        pthread_mutex_lock(&state->mutex);
+        ssize_t length = 0;
+        while (true) {
+            std::map<uint64_t, uint64_t>::iterator reader = state->reader_offsets.find(reader_id);
+            if (reader == state->reader_offsets.end()) {
+                length = -1;
+                break;
+            }
+            uint64_t &offset = reader->second;
+            if (offset < state->buffer_start + state->buffer.size()) {
+                length = std::min((uint64_t)SHARED_FETCH_MAX_PIECE, state->buffer_start + state->buffer.size() - offset);
+                out.append(state->buffer, offset - state->buffer_start, length);
+                offset += length;
+                // Someone may be waiting for the slowest reader to make room
+                pthread_cond_broadcast(&state->changed);
+                break;
+            }
+            if (state->finished || state->failed) {
+                length = state->failed ? -1 : 0;
+                break;
+            }
+
+            if (state->source_busy)
+                pthread_cond_wait(&state->changed, &state->mutex);
+            else if (state->buffer.size() > SHARED_FETCH_MAX_BUFFER)
+                wait_for_slow_readers();
+            else
+                read_source_piece();
+        }
+        pthread_mutex_unlock(&state->mutex);
+        return length;
+    }
+
+private:
+    // Reads the next piece from the source into the buffer, under mutex but releasing it meanwhile
+    void read_source_piece()
+    {
+        state->source_busy = true;
+        pthread_mutex_unlock(&state->mutex);
+        std::string piece;
+        ssize_t length = state->source->read(piece);
+        pthread_mutex_lock(&state->mutex);
+        state->source_busy = false;
+
+        if (length > 0) {
+            state->buffer.append(piece);
+        } else {
+            state->finished = length == 0;
+            state->failed = length < 0;
+        }
+        state->trim_buffer();
+        pthread_cond_broadcast(&state->changed);
+
+        if (state->registered && !state->is_joinable()) {
+            state->registered = false;
+            pthread_mutex_unlock(&state->mutex);
+            unregister_shared_fetch(state);
+            pthread_mutex_lock(&state->mutex);
+        }
+    }
+
+    /**
+     * Past the limit, gives the slowest readers some time to catch up. Those
+     * still holding more than the limit back are then detached, so the buffer
+     * stays bounded. Under mutex.
+     */
+    void wait_for_slow_readers()
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += follower_timeout_ms / 1000;
+        deadline.tv_nsec += (long)(follower_timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        state->source_busy = true;
+        while (state->buffer.size() > SHARED_FETCH_MAX_BUFFER
+               && pthread_cond_timedwait(&state->changed, &state->mutex, &deadline) == 0)
+            state->trim_buffer();
+        state->source_busy = false;
+        if (state->buffer.size() <= SHARED_FETCH_MAX_BUFFER) {
+            pthread_cond_broadcast(&state->changed);
+            return;
+        }
+
+        uint64_t keep_from = state->buffer_start + state->buffer.size() - SHARED_FETCH_MAX_BUFFER;
+        std::map<uint64_t, uint64_t>::iterator it = state->reader_offsets.begin();
+        while (it != state->reader_offsets.end()) {
+            if (it->second < keep_from) {
+                log("A client reading a shared response fell too far behind, dropping it");
+                state->reader_offsets.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        state->trim_buffer();
+        pthread_cond_broadcast(&state->changed);
+    }
+
+    std::shared_ptr<SharedFetchState> state;
+    uint64_t reader_id;
+};
+
+SharedFetch::~SharedFetch()
+{
+    if (!state)
+        return;
+
+    pthread_mutex_lock(&state->mutex);
+    bool abandoned = leader && state->status == SharedFetchState::FETCHING;
+    if (abandoned) {
+        state->status = SharedFetchState::ABANDONED;
+        pthread_cond_broadcast(&state->changed);
+    }
+    if (!leader && !reader_handed_over)
+        state->reader_offsets.erase(reader_id);
+    pthread_mutex_unlock(&state->mutex);
+
+    if (abandoned)
+        unregister_shared_fetch(state);
+}
+
+bool SharedFetch::join(const std::string &url)
+{
+    pthread_mutex_lock(&shared_fetches_mutex);
+    std::map<std::string, std::shared_ptr<SharedFetchState> >::iterator it = shared_fetches.find(url);
+    if (it != shared_fetches.end()) {
+        pthread_mutex_lock(&it->second->mutex);
+        if (it->second->is_joinable()) {
+            state = it->second;
+            reader_id = state->next_reader_id++;
+            state->reader_offsets[reader_id] = 0;
+        }
+        pthread_mutex_unlock(&it->second->mutex);
+    }
+
+    leader = !state;
+    if (leader) {
+        state = std::make_shared<SharedFetchState>(url);
+        shared_fetches[url] = state;
+    }
+    pthread_mutex_unlock(&shared_fetches_mutex);
+    return leader;
+}
+
+BodyStream* SharedFetch::publish(const HttpHeader &header, bool length_known, BodyStream *body)
+{
+    if (!leader)
+        return body;
+
+    pthread_mutex_lock(&state->mutex);
+    state->status = SharedFetchState::SHARED;
+    state->header = header;
+    state->length_known = length_known;
+    state->has_body = body != NULL;
+    state->source = body;
+    state->finished = body == NULL;
+    if (body != NULL) {
+        reader_id = state->next_reader_id++;
+        state->reader_offsets[reader_id] = 0;
+    }
+    pthread_cond_broadcast(&state->changed);
+    pthread_mutex_unlock(&state->mutex);
+
+    if (body == NULL) {
+        unregister_shared_fetch(state);
+        return NULL;
+    }
+    return new SharedBodyStream(state, reader_id);
+}
+
+bool SharedFetch::wait(HttpHeader &header, bool &length_known, BodyStream *&body)
+{
+    if (leader || !state)
+        return false;
+
+    pthread_mutex_lock(&state->mutex);
+    while (state->status == SharedFetchState::FETCHING)
+        pthread_cond_wait(&state->changed, &state->mutex);
+    bool shared = state->status == SharedFetchState::SHARED;
+    if (shared) {
+        header = state->header;
+        length_known = state->length_known;
+        reader_handed_over = state->has_body;
+    }
+    pthread_mutex_unlock(&state->mutex);
+
+    body = reader_handed_over ? new SharedBodyStream(state, reader_id) : NULL;
+    return shared;
+}
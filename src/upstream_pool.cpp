@@ -0,0 +1,130 @@
+#include "upstream_pool.h"
+
+#include <deque>
+
+struct IdleConnection {
+    int socket_fd;
+    time_t idle_since;
+};
+
+static pthread_mutex_t upstream_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, std::deque<IdleConnection> > idle_connections;
+static int idle_connections_count = 0;
+
+static int max_idle_connections = 0;
+static int max_idle_connections_per_host = 0;
+static int idle_timeout = 0;
+
+static std::string origin_key(const std::string &host, int port)
+{
+    std::stringstream ss;
+    ss << host << ":" << port;
+    return ss.str();
+}
+
+// An idle connection must have nothing to read: data or EOF means the server gave up on it
+static bool is_connection_alive(int socket_fd)
+{
+    char byte;
+    ssize_t result = recv(socket_fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void* run_idle_connections_reaper(void *arg)
+{
+    while (true) {
+        sleep(1);
+
+        std::vector<int> expired;
+        time_t now = time(NULL);
+
+        pthread_mutex_lock(&upstream_pool_mutex);
+        std::map<std::string, std::deque<IdleConnection> >::iterator it = idle_connections.begin();
+        while (it != idle_connections.end()) {
+            // Oldest connections are at the front
+            std::deque<IdleConnection> &connections = it->second;
+            while (!connections.empty() && now - connections.front().idle_since >= idle_timeout) {
+                expired.push_back(connections.front().socket_fd);
+                connections.pop_front();
+                idle_connections_count--;
+            }
+            if (connections.empty())
+                idle_connections.erase(it++);
+            else
+                ++it;
+        }
+        pthread_mutex_unlock(&upstream_pool_mutex);
+
+        for (size_t i = 0; i < expired.size(); i++)
+            close(expired[i]);
+    }
+    return NULL;
+}
+
+void start_upstream_pool(int max_idle, int max_idle_per_host, int idle_timeout_seconds)
+{
+    max_idle_connections = max_idle;
+    max_idle_connections_per_host = max_idle_per_host;
+    idle_timeout = idle_timeout_seconds;
+
+    pthread_t reaper_thread;
+    if (pthread_create(&reaper_thread, NULL, run_idle_connections_reaper, NULL) != 0)
+        print_error_and_die("Error while spawning upstream connections reaper thread");
+    pthread_detach(reaper_thread);
+}
+
+int acquire_upstream_connection(const std::string &host, int port, bool &reused)
+{
+    std::string key = origin_key(host, port);
+
+    while (true) {
+        int socket_fd = -1;
+
+        // Most recently used first, it is the least likely to be timed out by the server
+        pthread_mutex_lock(&upstream_pool_mutex);
+        std::map<std::string, std::deque<IdleConnection> >::iterator it = idle_connections.find(key);
+        if (it != idle_connections.end()) {
+            socket_fd = it->second.back().socket_fd;
+            it->second.pop_back();
+            idle_connections_count--;
+            if (it->second.empty())
+                idle_connections.erase(it);
+        }
+        pthread_mutex_unlock(&upstream_pool_mutex);
+
+        if (socket_fd < 0)
+            break;
+        if (is_connection_alive(socket_fd)) {
+            log("Reusing pooled connection to " + key);
+            reused = true;
+            return socket_fd;
+        }
+        close(socket_fd);
+    }
+
+    reused = false;
+    return create_socket_to_server(host, port);
+}
+
+void release_upstream_connection(const std::string &host, int port, int socket_fd)
+{
+    std::string key = origin_key(host, port);
+    bool pooled = false;
+
+    pthread_mutex_lock(&upstream_pool_mutex);
+    std::deque<IdleConnection> &connections = idle_connections[key];
+    if (idle_connections_count < max_idle_connections && (int)connections.size() < max_idle_connections_per_host) {
+        IdleConnection connection;
+        connection.socket_fd = socket_fd;
+        connection.idle_since = time(NULL);
+        connections.push_back(connection);
+        idle_connections_count++;
+        pooled = true;
+    } else if (connections.empty()) {
+        idle_connections.erase(key);
+    }
+    pthread_mutex_unlock(&upstream_pool_mutex);
+
+    if (!pooled)
+        close(socket_fd);
+}
@@ -15,9 +15,12 @@
 #include <resolv.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <netinet/tcp.h>
 #include <set>
 
 #include "utils.h"
+#include "io_backend.h"
+#include "dns_resolver.h"
 
 pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
@@ -38,26 +41,171 @@ void print_error_and_die(const std::string &msg, int exit_status)
 
 void print_usage_and_die(int exit_status)
 {
-    const char *USAGE_STRING = "Usage: ./server <PORT NUMBER> <SITES_BLOCKLIST> <WORDS_FILTER> <CACHE_DIRECTORY>";
+    const char *USAGE_STRING =
+        "Usage: ./server <PORT NUMBER> <SITES_BLOCKLIST> <WORDS_FILTER> <CACHE_DIRECTORY> [OPTIONS]\n"
+        "Options:\n"
+        "  --mode=threads|epoll     serve each client on its own thread (default) or\n"
+        "                           multiplex clients over epoll event loops\n"
+        "  --event-threads=N        number of epoll event loop threads (default 4)\n"
+        "  --handler-threads=N      number of threads processing requests in epoll mode (default 32)\n"
+        "  --worker-threads=N       size of the CPU worker pool (default: number of cores)\n"
+        "  --worker-queue-depth=N   tasks allowed to wait for a CPU worker (default 1024)\n"
+        "  --listeners=N            number of SO_REUSEPORT listening sockets, each served by its\n"
+        "                           own accept loop pinned to a core (default 1)\n"
+        "  --backlog=N              listen() backlog of every listening socket (default 1024)\n"
+        "  --defer-accept=SECONDS   only accept connections once the client has sent data,\n"
+        "                           waiting at most SECONDS (default 0 - disabled)\n"
+        "  --io-backend=syscalls|io_uring\n"
+        "                           how socket I/O is issued (default syscalls)\n"
+        "  --upstream-max-idle=N    idle connections to target servers kept open (default 256)\n"
+        "  --upstream-max-idle-per-host=N\n"
+        "                           idle connections kept open per target server (default 8)\n"
+        "  --upstream-idle-timeout=SECONDS\n"
+        "                           close idle target server connections after (default 30)\n"
+        "  --dns-server=IP[:PORT]   nameserver to query (default: first one in /etc/resolv.conf)\n"
+        "  --dns-timeout=MS         time to wait for a DNS reply before retrying (default 2000)\n"
+        "  --keep-alive-timeout=SECONDS\n"
+        "                           close idle client connections after (default 15)\n"
+        "  --max-keep-alive-requests=N\n"
+        "                           requests served on one client connection (default 100)\n"
+        "  --memory-cache-size=MB   memory holding the most recently used cached replies (default 64)\n"
+        "  --cache-segment-size=MB  size of the files cached replies are appended to (default 64)\n"
+        "  --upstream-timeout=SECONDS\n"
+        "                           time to wait for data from a target server (default 30)\n"
+        "  --stale-while-revalidate=SECONDS\n"
+        "                           serve expired cached replies while refreshing them (default 30)\n"
+        "  --stale-if-error=SECONDS serve expired cached replies when the target server fails\n"
+        "                           (default 3600)\n"
+        "  --cache-max-size=MB      disk space the cached replies may take (default 1024)\n"
+        "  --cache-max-entries=N    number of replies the disk cache may hold (default 1000000)";
     std::cerr << USAGE_STRING << std::endl;
     exit(exit_status);
 }
 
+int parse_positive_option(const std::string &name, const std::string &value)
+{
+    int result = atoi(value.c_str());
+    if (result <= 0) {
+        std::cerr << "Option " << name << " expects a positive number, got '" << value << "'" << std::endl;
+        print_usage_and_die();
+    }
+    return result;
+}
+
+// For options where 0 turns a feature off
+int parse_non_negative_option(const std::string &name, const std::string &value)
+{
+    int result = atoi(value.c_str());
+    if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos || result < 0) {
+        std::cerr << "Option " << name << " expects a non-negative number, got '" << value << "'" << std::endl;
+        print_usage_and_die();
+    }
+    return result;
+}
+
 ParsedArguments parse_arguments(int argc, char *argv[])
 {
-    if (argc > 5 || argc < 5) {
+    if (argc < 5) {
         print_usage_and_die();
     }
 
     ParsedArguments arguments;
-    arguments.port = (argc > 1)? atoi(argv[1]) : 8888;
+    arguments.port = atoi(argv[1]);
     arguments.sites_blocklist_filename = argv[2];
     arguments.filter_words_list_filename = argv[3];
     arguments.cache_directory_path = argv[4];
+
+    arguments.server_mode = "threads";
+    arguments.event_threads = 4;
+    arguments.handler_threads = 32;
+    arguments.worker_threads = get_online_cpu_count();
+    arguments.worker_queue_depth = 1024;
+    arguments.listeners = 1;
+    arguments.listen_backlog = 1024;
+    arguments.defer_accept_seconds = 0;
+    arguments.io_backend = "syscalls";
+    arguments.upstream_max_idle = 256;
+    arguments.upstream_max_idle_per_host = 8;
+    arguments.upstream_idle_timeout_seconds = 30;
+    arguments.dns_timeout_ms = 2000;
+    arguments.keep_alive_timeout_seconds = 15;
+    arguments.max_keep_alive_requests = 100;
+    arguments.memory_cache_megabytes = 64;
+    arguments.cache_segment_megabytes = 64;
+    arguments.upstream_timeout_seconds = 30;
+    arguments.stale_while_revalidate_seconds = 30;
+    arguments.stale_if_error_seconds = 3600;
+    arguments.cache_max_megabytes = 1024;
+    arguments.cache_max_entries = 1000000;
+
+    for (int i = 5; i < argc; i++) {
+        std::vector<std::string> option = split(argv[i], '=');
+        const std::string &name = option[0];
+        const std::string &value = option[1];
+
+        if (name == "--mode") {
+            if (value != "threads" && value != "epoll") {
+                print_usage_and_die();
+            }
+            arguments.server_mode = value;
+        } else if (name == "--event-threads") {
+            arguments.event_threads = parse_positive_option(name, value);
+        } else if (name == "--handler-threads") {
+            arguments.handler_threads = parse_positive_option(name, value);
+        } else if (name == "--worker-threads") {
+            arguments.worker_threads = parse_positive_option(name, value);
+        } else if (name == "--worker-queue-depth") {
+            arguments.worker_queue_depth = parse_positive_option(name, value);
+        } else if (name == "--listeners") {
+            arguments.listeners = parse_positive_option(name, value);
+        } else if (name == "--backlog") {
+            arguments.listen_backlog = parse_positive_option(name, value);
+        } else if (name == "--defer-accept") {
+            arguments.defer_accept_seconds = parse_non_negative_option(name, value);
+        } else if (name == "--io-backend") {
+            if (value != "syscalls" && value != "io_uring") {
+                print_usage_and_die();
+            }
+            arguments.io_backend = value;
+        } else if (name == "--upstream-max-idle") {
+            arguments.upstream_max_idle = parse_positive_option(name, value);
+        } else if (name == "--upstream-max-idle-per-host") {
+            arguments.upstream_max_idle_per_host = parse_positive_option(name, value);
+        } else if (name == "--upstream-idle-timeout") {
+            arguments.upstream_idle_timeout_seconds = parse_positive_option(name, value);
+        } else if (name == "--dns-server") {
+            arguments.dns_server = value;
+        } else if (name == "--dns-timeout") {
+            arguments.dns_timeout_ms = parse_positive_option(name, value);
+        } else if (name == "--keep-alive-timeout") {
+            arguments.keep_alive_timeout_seconds = parse_positive_option(name, value);
+        } else if (name == "--max-keep-alive-requests") {
+            arguments.max_keep_alive_requests = parse_positive_option(name, value);
+        } else if (name == "--memory-cache-size") {
+            arguments.memory_cache_megabytes = parse_positive_option(name, value);
+        } else if (name == "--cache-segment-size") {
+            arguments.cache_segment_megabytes = parse_positive_option(name, value);
+        } else if (name == "--upstream-timeout") {
+            arguments.upstream_timeout_seconds = parse_positive_option(name, value);
+        } else if (name == "--stale-while-revalidate") {
+            arguments.stale_while_revalidate_seconds = parse_positive_option(name, value);
+        } else if (name == "--stale-if-error") {
+            arguments.stale_if_error_seconds = parse_positive_option(name, value);
+        } else if (name == "--cache-max-size") {
+            arguments.cache_max_megabytes = parse_positive_option(name, value);
+        } else if (name == "--cache-max-entries") {
+            arguments.cache_max_entries = parse_positive_option(name, value);
+        } else {
+            std::cerr << "Unknown option " << argv[i] << std::endl;
+            print_usage_and_die();
+        }
+    }
+
     return arguments;
 }
 
-int create_listening_socket(struct sockaddr_in *socket_address)
+int create_listening_socket(struct sockaddr_in *socket_address, int backlog, bool reuse_port,
+                            int defer_accept_seconds)
 {
     int listening_socket;
 
@@ -70,13 +218,24 @@ int create_listening_socket(struct sockaddr_in *socket_address)
         print_error_and_die("Error while calling setsockopt(...,SO_REUSEADDR,...) for listening socket");
     }
 
+    if (reuse_port && setsockopt(listening_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        print_error_and_die("Error while calling setsockopt(...,SO_REUSEPORT,...) for listening socket");
+    }
+
+    if (defer_accept_seconds > 0 &&
+        setsockopt(listening_socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept_seconds, sizeof(defer_accept_seconds)) < 0)
+    {
+        print_error_and_die("Error while calling setsockopt(...,TCP_DEFER_ACCEPT,...) for listening socket");
+    }
+
     if (bind(listening_socket, (struct sockaddr*)socket_address, sizeof(*socket_address)) != 0) {
         std::stringstream ss;
         ss << "Error while binding server socket to the port " << socket_address->sin_port;
         print_error_and_die(ss.str());
     }
 
-    if (listen(listening_socket, 32) != 0 )
+    if (listen(listening_socket, backlog) != 0 )
         print_error_and_die("Error while in listen() call");
 
     return listening_socket;
@@ -91,67 +250,65 @@ struct sockaddr_in create_listening_socket_address(const ParsedArguments &argume
     return addr;
 }
 
-int create_socket_to_server(const std::string &hostport)
+void split_host_and_port(const std::string &hostport, std::string &host, int &port)
 {
     std::vector<std::string> parts = split(hostport, ':');
-    std::string host = parts[0];
-    int port = parts[1].empty()? 80 : std::atoi(parts[1].c_str());
-    return create_socket_to_server(host, port);
+    host = parts[0];
+    port = parts[1].empty()? 80 : std::atoi(parts[1].c_str());
 }
 
-int hostname_to_ip(const std::string &hostname, std::string &ip_out)
+int create_socket_to_server(const std::string &hostport)
 {
-    struct hostent *he;
-    struct in_addr **addr_list;
-    int i;
-         
-    if ((he = gethostbyname(hostname.c_str())) == NULL) {
-        log("Error in gethostbyname() while resolving hostname to IP for hostname '" + hostname + "'");
-        return 1;
-    }
- 
-    addr_list = (struct in_addr **) he->h_addr_list;
-     
-    char ip_buf[16];
-    for(i = 0; addr_list[i] != NULL; i++) {
-        strcpy(ip_buf, inet_ntoa(*addr_list[i]));
-        ip_out = std::string(ip_buf);
-        return 0;
-    }
-     
-    return 1;
+    std::string host;
+    int port;
+    split_host_and_port(hostport, host, port);
+    return create_socket_to_server(host, port);
 }
 
 int create_socket_to_server(const std::string &host, int port)
 {
-    int sockfd;
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        log("Couldn't create socket to remote server at " + host);
+    std::vector<IpAddress> addresses;
+    if (!resolve_hostname(host, addresses)) {
+        log("Couldn't resolve hostname of remote server " + host);
         return -1;
-    } 
+    }
 
-    struct sockaddr_in serv_addr; 
+    // Trying all addresses of the server in turn until one accepts the connection
+    for (size_t i = 0; i < addresses.size(); i++) {
+        const IpAddress &address = addresses[i];
+        log("Resolved hostname " + host + " to ip " + address.to_string());
+
+        struct sockaddr_storage serv_addr;
+        socklen_t serv_addr_length;
+        memset(&serv_addr, 0, sizeof(serv_addr));
+        if (address.family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&serv_addr;
+            sin->sin_family = AF_INET;
+            sin->sin_port = htons(port);
+            memcpy(&sin->sin_addr, address.bytes, 4);
+            serv_addr_length = sizeof(struct sockaddr_in);
+        } else {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&serv_addr;
+            sin6->sin6_family = AF_INET6;
+            sin6->sin6_port = htons(port);
+            memcpy(&sin6->sin6_addr, address.bytes, 16);
+            serv_addr_length = sizeof(struct sockaddr_in6);
+        }
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port); 
+        int sockfd;
+        if ((sockfd = socket(address.family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+            log("Couldn't create socket to remote server at " + host);
+            return -1;
+        }
 
-    std::string ip_addr;
-    if (hostname_to_ip(host, ip_addr) < 0) {
-        return -1;
+        if (connect(sockfd, (struct sockaddr *)&serv_addr, serv_addr_length) == 0) {
+            return sockfd;
+        }
+        log("connect() error while connecting to remote server " + host + " at " + address.to_string());
+        close(sockfd);
     }
-    log("Resolved hostname " + host + " to ip " + ip_addr);
-
-    if (inet_pton(AF_INET, ip_addr.c_str(), &serv_addr.sin_addr) < 0) {
-        log("inet_pton() error occured");
-        return -1;
-    } 
 
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-       log("connect() error while connecting to remote server " + host);
-       return -1;
-    } 
-
-    return sockfd;
+    return -1;
 }
 
 HostInfo* wait_for_client_and_accept(int listening_socket)
@@ -160,7 +317,7 @@ HostInfo* wait_for_client_and_accept(int listening_socket)
   
     struct sockaddr_in client_address;
     socklen_t addr_size = static_cast<socklen_t>(sizeof(client_address));
-    client_info->socket_fd = accept(listening_socket, (struct sockaddr*)&client_address, &addr_size);
+    client_info->socket_fd = io_accept(listening_socket, (struct sockaddr*)&client_address, &addr_size);
 
     char client_host[INET_ADDRSTRLEN];
     if (inet_ntop(AF_INET, &client_address.sin_addr.s_addr, client_host, sizeof(client_host)) != NULL) {
@@ -178,20 +335,7 @@ HostInfo* wait_for_client_and_accept(int listening_socket)
 
 int send_to_socket(int sock, const std::string &data)
 {
-    const char *buf = data.c_str();
-    size_t bytes_left = data.size();
-    size_t offset = 0;
-
-    while (bytes_left > 0) {
-        int bytes_sent = send(sock, buf + offset, bytes_left, 0);
-        if (bytes_sent < 0) {
-            return -1;
-        }
-        offset += bytes_sent;
-        bytes_left -= bytes_sent;
-    }
-
-    return 0;
+    return io_send_all(sock, data.data(), data.size());
 }
 
 std::vector<std::string> split(std::string source, char delimiter)
@@ -222,66 +366,6 @@ std::vector<std::string> split_all(std::string source, char delimiter)
     return result;
 }
 
-bool is_host_blocked(const std::string &hostname, const std::string &sites_blocked_list_file)
-{
-    std::ifstream iss;
-    iss.open(sites_blocked_list_file);
-    std::string str;
-    while (std::getline(iss, str)) {
-        str = trim(str);
-        if (str.empty()) 
-            continue;
-        if (str == hostname) 
-            return true;
-    }
-    iss.close();
-
-    return false;
-}
-
-std::string filter_words(const std::string &str, const std::string &filtered_words_list_file)
-{
-    static std::vector<std::string> words;
-
-    if (words.empty()) {
-        std::ifstream is;
-        is.open(filtered_words_list_file);
-        std::string str;
-        while (std::getline(is, str)) {
-            std::string word_lowercase = trim(str);
-            std::transform(word_lowercase.begin(), word_lowercase.end(), word_lowercase.begin(), ::tolower);
-            words.push_back(word_lowercase);
-        }
-        is.close();
-    }
-    
-    std::string str_lowercase = std::string(str);
-    for (int i = 0; i < str_lowercase.size() - 1; i++) {
-        if (str_lowercase[i] == '<') {
-            while (i < str_lowercase.size() - 1 && str_lowercase[i] != '>') {
-                str_lowercase[i] = ' ';
-                i++;
-            }
-        }
-    }
-
-    std::string result = std::string(str);
-    std::transform(str_lowercase.begin(), str_lowercase.end(), str_lowercase.begin(), ::tolower);
-
-    for (int i = 0; i < words.size(); i++) {
-        std::string &word = words[i];
-        std::string::size_type n = 0;
-        std::string replacement = "CENSORED";
-        while ( ( n = str_lowercase.find( word, n ) ) != std::string::npos )
-        {
-            str_lowercase.replace( n, word.size(), replacement );
-            result.replace( n, word.size(), replacement );
-            n += replacement.size();
-        }
-    }
-        
-    return result;
-}
 
 void print_vector(std::vector<std::string> v)
 {
@@ -291,3 +375,18 @@ void print_vector(std::vector<std::string> v)
     }
             std::cerr << "VECTOR_END" << std::endl;
 }
+
+int get_online_cpu_count()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+void pin_thread_to_core(pthread_t thread, int index)
+{
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(index % get_online_cpu_count(), &cpu_set);
+    if (pthread_setaffinity_np(thread, sizeof(cpu_set), &cpu_set) != 0)
+        log("Unable to pin thread to a core");
+}
@@ -1,10 +1,36 @@
 
 #include "utils.h"
+#include "dns_resolver.h"
+#include "http_parser.h"
+#include "memory_cache.h"
+#include "cache_admission.h"
+#include "cache_store.h"
+#include "cache_policy.h"
+#include "cache_janitor.h"
+#include "shared_fetch.h"
+#include "word_filter.h"
+#include "filter_lists.h"
+#include "host_blocklist.h"
+#include "request_handler.h"
+#include "worker_pool.h"
 
+#include <fcntl.h>
 #include <iostream>
 
 using namespace std;
 
+ParsedArguments parsedArguments;
+
+int failures = 0;
+
+void check(bool condition, const string &description)
+{
+	cout << (condition ? "PASSED: " : "FAILED: ") << description << endl;
+	if (!condition) {
+		failures++;
+	}
+}
+
 void test_split()
 {
 	vector<string> result = split("google.com/query", '/');
@@ -30,8 +56,1127 @@ void test_split_all()
 	}
 }
 
+void test_word_filter()
+{
+	vector<string> words;
+	words.push_back("ape");
+	words.push_back("Amateur");
+	words.push_back("ab");
+	words.push_back("bcd");
+	words.push_back("cd");
+	words.push_back("");
+	WordFilter filter(words);
+	check(filter.word_count() == 5, "blank words are ignored");
+	check(filter.censor("Hello APE world, amateurish") == "Hello CENSORED world, CENSOREDish",
+		"words are censored whatever their case");
+	check(filter.censor("<img alt=\"ape\">ape<b>a</b>pe") == "<img alt=\"ape\">CENSORED<b>a</b>pe",
+		"words in tags or split by tags are kept");
+	check(filter.censor("abcd xbcd") == "CENSOREDCENSORED xCENSORED", "overlapping words censor the leftmost");
+	check(filter.censor("") == "" && filter.censor("nothing here") == "nothing here", "text without words is kept");
+
+	// Long runs of skipped bytes, across SIMD blocks
+	string skipped = string(70, ' ') + "<" + string(100, 'x') + ">ape" + string(40, '.') + "amateur";
+	check(filter.censor(skipped) == string(70, ' ') + "<" + string(100, 'x') + ">CENSORED" + string(40, '.') + "CENSORED",
+		"words after long skipped runs are censored");
+
+	// Every high nibble with its own low nibbles: the SIMD masks hold more than the set
+	bool members[256] = { false };
+	for (int high = 0; high < 16; high++)
+		members[high * 16 + high] = true;
+	CandidateByteSet set;
+	make_candidate_byte_set(members, set);
+	CandidateScanner scanner = select_candidate_scanner();
+	string text;
+	for (int i = 0; i < 4096; i++)
+		text += (char)((i * 7919) % 251);
+	const unsigned char *bytes = (const unsigned char *)text.data();
+	bool same = true;
+	for (size_t from = 0; from < text.size(); from++) {
+		size_t found = scanner(bytes, from, text.size(), set);
+		same = same && found <= scan_candidate_bytes(bytes, from, text.size(), set)
+			&& scan_candidate_bytes(bytes, from, found, set) == found;
+	}
+	check(same, "SIMD scanner finds no byte of the set later than the byte by byte one");
+
+	// Pieces of every size give the text censored as a whole, words and tags spanning them
+	shared_ptr<const WordFilter> shared_filter = make_shared<const WordFilter>(words);
+	string page = "Abcd <i title='ape'>APE</i> amateurs, ape<br>ape xbcd" + string(50, ' ') + "<p class=x>amateur";
+	bool all_same = true;
+	for (size_t piece_size = 1; piece_size <= page.size(); piece_size++) {
+		WordFilterStream stream(shared_filter);
+		string out;
+		for (size_t offset = 0; offset < page.size(); offset += piece_size) {
+			stream.write(page.data() + offset, min(piece_size, page.size() - offset), out);
+		}
+		stream.finish(out);
+		all_same = all_same && out == shared_filter->censor(page);
+	}
+	check(all_same, "text filtered in pieces is censored as a whole");
+
+	WordFilterStream stream(shared_filter);
+	string out;
+	bool held_back = true;
+	for (int i = 1; i <= 20; i++) {
+		stream.write("x amat", 6, out);
+		held_back = held_back && out.size() == i * 6 - (filter.max_word_length() - 1);
+	}
+	check(held_back, "only the bytes that may start a word are held back");
+}
+
+void test_host_blocklist()
+{
+	HostBlocklist blocklist;
+	check(blocklist.add("google.com") && blocklist.add("*.Example.com") && blocklist.add("127.0.0.1:9000")
+		&& !blocklist.add("bad..name") && !blocklist.add("*.") && blocklist.rule_count() == 3,
+		"rules naming a host are added");
+	check(blocklist.blocks("google.com") && blocklist.blocks("www.google.com") && blocklist.blocks("a.b.google.com"),
+		"a host and its subdomains are blocked");
+	check(!blocklist.blocks("notgoogle.com") && !blocklist.blocks("com") && !blocklist.blocks("google.org"),
+		"other hosts are not blocked");
+	check(!blocklist.blocks("example.com") && blocklist.blocks("www.example.com"),
+		"a wildcard blocks only the subdomains");
+	check(blocklist.blocks("WWW.Google.COM.") && blocklist.blocks("google.com:8080") && blocklist.blocks("127.0.0.1"),
+		"case, ports and trailing dots are ignored");
+	check(normalize_host("[::1]:8080") == "[::1]" && normalize_host("::1") == "::1", "IPv6 literals keep their colons");
+}
+
+void write_file(const string &filename, const string &contents)
+{
+	ofstream file(filename.c_str());
+	file << contents;
+}
+
+void test_filter_lists()
+{
+	char directory[] = "/tmp/filter_lists_testXXXXXX";
+	check(mkdtemp(directory) != NULL, "temporary filter lists directory is created");
+	string blocklist = string(directory) + "/blocklist.txt";
+	string words = string(directory) + "/words.txt";
+	write_file(blocklist, "blocked.test\n  spaced.test  \n");
+	write_file(words, "secret\n");
+	load_filter_lists(blocklist, words);
+	check(is_host_blocked("blocked.test") && is_host_blocked("spaced.test") && !is_host_blocked("other.test"),
+		"listed hosts are blocked");
+	check(filter_words("a secret word") == "a CENSORED word", "listed words are filtered");
+
+	shared_ptr<const WordFilter> old_filter = current_word_filter();
+	write_file(blocklist, "other.test\n");
+	write_file(words, "word\n");
+	check(reload_filter_lists(), "changed lists are reloaded");
+	check(!is_host_blocked("blocked.test") && is_host_blocked("other.test"), "reloaded blocklist is used");
+	check(filter_words("a secret word") == "a secret CENSORED", "reloaded words are used");
+	check(old_filter->censor("secret") == "CENSORED", "a filter in use outlives its reload");
+
+	unlink(words.c_str());
+	check(!reload_filter_lists() && filter_words("a word") == "a CENSORED", "lists are kept when a file is missing");
+
+	start_filter_lists_reloader();
+	write_file(blocklist, "changed.test\n");
+	write_file(words, "a\n");
+	bool reloaded = false;
+	for (int i = 0; i < 200 && !reloaded; i++) {
+		usleep(10000);
+		reloaded = is_host_blocked("changed.test");
+	}
+	check(reloaded, "lists are reloaded when their files are written");
+}
+
+// Readers of the filter lists, for as long as filter_lists_stress_running is set
+int filter_lists_stress_running = 1;
+int filter_lists_stress_errors = 0;
+
+void* read_filter_lists_stress(void *arg)
+{
+	while (__sync_fetch_and_add(&filter_lists_stress_running, 0)) {
+		if (!is_host_blocked("www.stress.test") || filter_words("a secret") != "a CENSORED")
+			__sync_fetch_and_add(&filter_lists_stress_errors, 1);
+	}
+	return NULL;
+}
+
+void test_filter_lists_stress()
+{
+	char directory[] = "/tmp/filter_lists_stressXXXXXX";
+	mkdtemp(directory);
+	string blocklist = string(directory) + "/blocklist.txt";
+	string words = string(directory) + "/words.txt";
+	write_file(blocklist, "stress.test\n");
+	write_file(words, "secret\n");
+	load_filter_lists(blocklist, words);
+
+	pthread_t readers[4];
+	for (int i = 0; i < 4; i++)
+		pthread_create(&readers[i], NULL, read_filter_lists_stress, NULL);
+	bool reloaded = true;
+	for (int i = 0; i < 300; i++)
+		reloaded = reload_filter_lists() && reloaded;
+	__sync_fetch_and_sub(&filter_lists_stress_running, 1);
+	for (int i = 0; i < 4; i++)
+		pthread_join(readers[i], NULL);
+	check(reloaded && filter_lists_stress_errors == 0, "readers see whole lists during back to back reloads");
+}
+
+void test_http_parser()
+{
+	HttpParser parser;
+	string request = "GET /index.html HTTP/1.1\r\nHost: example.com\r\nAccept:  */* \r\n\r\nbody";
+	HttpParser::Result result = HttpParser::INCOMPLETE;
+	// Fed one byte at a time, as the worst split a socket could produce
+	size_t length = 0;
+	while (result == HttpParser::INCOMPLETE && length < request.size())
+		result = parser.parse(request.data(), ++length);
+	const char *buffer = request.data();
+	check(result == HttpParser::COMPLETE && parser.head_length == request.size() - 4, "request head is complete before its body");
+	check(!parser.is_response && parser.slice(buffer, parser.method).equals("GET")
+		&& parser.slice(buffer, parser.target).equals("/index.html")
+		&& parser.slice(buffer, parser.version).equals("HTTP/1.1"), "request line is split");
+	HttpSlice value;
+	check(parser.header_count == 2 && parser.find_header(buffer, "accept", value) && value.equals("*/*"),
+		"header values are found case-insensitively and trimmed");
+	check(!parser.find_header(buffer, "Content-Length", value), "missing header is not found");
+
+	parser.reset();
+	string response = "HTTP/1.0 404 Not Found\nContent-Type: text/html\n\n";
+	check(parser.parse(response.data(), response.size()) == HttpParser::COMPLETE && parser.is_response
+		&& parser.status_code == 404 && parser.slice(response.data(), parser.reason).equals("Not Found"),
+		"status line with bare LF line endings is parsed");
+
+	parser.reset();
+	string folded = "GET / HTTP/1.1\r\nHost: a\r\n  b\r\n\r\n";
+	check(parser.parse(folded.data(), folded.size()) == HttpParser::INVALID, "folded header lines are rejected");
+
+	parser.reset();
+	string endless = "GET / HTTP/1.1\r\nX-Long: " + string(200, 'x');
+	check(parser.parse(endless.data(), endless.size(), 128) == HttpParser::INVALID, "head longer than the limit is rejected");
+}
+
+MemoryCachedReply make_memory_reply(const string &head, const string &body)
+{
+	MemoryCachedReply reply;
+	reply.head = head;
+	reply.body = make_shared<const string>(body);
+	return reply;
+}
+
+// Reads the chunked body sent as `message`, the result of the last read in `status`
+string read_chunked_body(const string &message, ssize_t &status)
+{
+	int fds[2];
+	socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+	send_to_socket(fds[1], message);
+	close(fds[1]);
+
+	HttpHeader header;
+	header.status = "200 OK";
+	header.headers["Transfer-Encoding"] = "chunked";
+	SocketReader reader(fds[0]);
+	MessageBodyStream body(reader, header, true);
+	string result;
+	while ((status = body.read(result)) > 0) {}
+	close(fds[0]);
+	return result;
+}
+
+void test_chunked_bodies()
+{
+	ssize_t status;
+	check(read_chunked_body("5;ext=1\r\nhello\r\n6\r\n world\r\n0\r\nTrailer: x\r\n\r\n", status) == "hello world"
+		&& status == 0, "chunked body is decoded");
+	read_chunked_body("5\r\nhello\r\nzz\r\n world\r\n0\r\n\r\n", status);
+	check(status == -1, "chunk size that isn't hex fails the body");
+	read_chunked_body("5\r\nhello\r\n\r\n", status);
+	check(status == -1, "empty chunk size fails the body");
+	read_chunked_body("5\r\nhello\r\n6", status);
+	check(status == -1, "truncated body fails");
+	read_chunked_body("5\r\nhelloXX\r\n0\r\n\r\n", status);
+	check(status == -1, "chunk data longer than its size fails the body");
+}
+
+void test_memory_cache()
+{
+	// 16 shards of 64 KB, a body may take 16 KB
+	configure_memory_cache(16 * 65536);
+	clear_memory_cache();
+	check(memory_cache_max_body_size() == 16384, "body size limit is a quarter of a shard");
+
+	MemoryCachedReply reply;
+	memory_cache_store("/a", make_memory_reply("HTTP/1.1 200 OK\r\n\r\n", "body of a"));
+	check(memory_cache_lookup("/a", reply) && *reply.body == "body of a", "stored reply is found");
+	check(!memory_cache_lookup("/b", reply), "missing reply is not found");
+
+	memory_cache_store("/large", make_memory_reply("", string(16385, 'x')));
+	check(!memory_cache_lookup("/large", reply), "too large body is not stored");
+
+	// More than a shard can hold, every shard evicts its least recently used replies
+	for (int i = 0; i < 1000; i++) {
+		memory_cache_store("/item" + to_string(i), make_memory_reply("", string(8192, 'x')));
+		memory_cache_lookup("/a", reply);
+	}
+	check(memory_cache_lookup("/a", reply) && memory_cache_lookup("/item999", reply), "recently used replies stay");
+	check(!memory_cache_lookup("/item0", reply), "least recently used replies are evicted");
+}
+
+FrequencySketch *shared_sketch = NULL;
+
+void* increment_shared_sketch(void *arg)
+{
+	for (int i = 0; i < 3; i++)
+		shared_sketch->increment((uint64_t)(long)arg);
+	for (uint64_t key = 1000; key < 1300; key++)
+		shared_sketch->increment(key);
+	return NULL;
+}
+
+void test_cache_admission()
+{
+	FrequencySketch sketch(1024);
+	for (int i = 0; i < 5; i++)
+		sketch.increment(42);
+	check(sketch.estimate(42) == 5 && sketch.estimate(43) == 0, "sketch counts increments per key");
+	for (int i = 0; i < 20; i++)
+		sketch.increment(7);
+	check(sketch.estimate(7) == 15, "sketch counters saturate");
+
+	FrequencySketch small_sketch(64);
+	for (int i = 0; i < 8; i++)
+		small_sketch.increment(42);
+	for (int i = 8; i < 10 * 64; i++)
+		small_sketch.increment(7);
+	check(small_sketch.estimate(42) == 4, "sketch counters are halved after ten increments per counter");
+
+	// Threads update the sketch without a lock, and counters sharing a byte stay apart
+	FrequencySketch concurrent_sketch(4096);
+	shared_sketch = &concurrent_sketch;
+	pthread_t threads[4];
+	for (long i = 0; i < 4; i++)
+		pthread_create(&threads[i], NULL, increment_shared_sketch, (void *)(i % 2 == 0 ? 42L : 43L));
+	for (int i = 0; i < 4; i++)
+		pthread_join(threads[i], NULL);
+	bool all_counted = true;
+	for (uint64_t key = 1000; key < 1300; key++)
+		all_counted = all_counted && concurrent_sketch.estimate(key) >= 4;
+	check(concurrent_sketch.estimate(42) == 6 && concurrent_sketch.estimate(43) == 6 && all_counted,
+		"concurrent increments are all counted");
+
+	configure_cache_admission(4096);
+	record_cache_request("/once");
+	check(!admit_to_disk_cache("/once"), "reply asked for once is not written to disk");
+	record_cache_request("/once");
+	check(admit_to_disk_cache("/once"), "reply asked for twice is written to disk");
+
+	configure_memory_cache(16 * 65536);
+	clear_memory_cache();
+	for (int i = 0; i < 5; i++)
+		record_cache_request("/popular");
+	MemoryCachedReply reply;
+	memory_cache_store("/popular", make_memory_reply("", string(8192, 'p')));
+	vector<EvictedReply> evicted;
+	for (int i = 0; i < 1000; i++)
+		memory_cache_store("/rare" + to_string(i), make_memory_reply("", string(8192, 'x')), &evicted);
+	check(memory_cache_lookup("/popular", reply), "rarely asked replies don't evict popular ones");
+	check(!evicted.empty() && evicted[0].url.compare(0, 5, "/rare") == 0, "evicted replies are handed back");
+
+	clear_memory_cache();
+	record_cache_request("/refetched");
+	record_cache_request("/refetched");
+	memory_cache_store("/refetched", make_memory_reply("", "old body"));
+	for (int i = 0; i < 1000; i++) {
+		for (int j = 0; j < 5; j++)
+			record_cache_request("/hot" + to_string(i));
+		memory_cache_store("/hot" + to_string(i), make_memory_reply("", string(8192, 'h')));
+		memory_cache_lookup("/refetched", reply);
+	}
+	check(!memory_cache_store("/refetched", make_memory_reply("", string(16000, 'n')))
+		&& !memory_cache_lookup("/refetched", reply), "a refused reply doesn't leave the former one behind");
+}
+
+CacheIndexEntry make_cache_index_entry(uint32_t segment, uint64_t body_length)
+{
+	CacheIndexEntry entry;
+	entry.segment = segment;
+	entry.offset = body_length * 2;
+	entry.head_length = 19;
+	entry.body_segment = segment;
+	entry.body_offset = body_length;
+	entry.body_length = body_length;
+	entry.body_hash = body_length;
+	entry.stored_at = entry.last_access = entry.expires_at = time(NULL);
+	return entry;
+}
+
+void test_cache_index()
+{
+	char directory[] = "/tmp/cache_index_testXXXXXX";
+	check(mkdtemp(directory) != NULL, "temporary cache directory is created");
+	open_cache_index(directory);
+	check(cache_index_size() == 0, "new index is empty");
+
+	CacheIndexEntry entry;
+	cache_index_store("/a/1", make_cache_index_entry(1, 100));
+	cache_index_store("/a/2", make_cache_index_entry(2, 200));
+	check(cache_index_lookup("/a/1", entry) && entry.segment == 1 && entry.offset == 200 && entry.body_length == 100
+		&& entry.head_length == 19, "stored entry is found");
+	check(!cache_index_lookup("/a/3", entry), "missing entry is not found");
+
+	// Entries survive a restart, and grow the table past its initial 16384 slots
+	for (int i = 0; i < 20000; i++)
+		cache_index_store("/many/" + to_string(i), make_cache_index_entry(3, i));
+	open_cache_index(directory);
+	check(cache_index_size() == 20002, "reopened index holds all entries");
+	check(cache_index_lookup("/a/2", entry) && entry.segment == 2, "entry is found after reopening");
+	check(cache_index_lookup("/many/12345", entry) && entry.body_length == 12345, "entry is found after growing");
+
+	cache_index_remove("/a/2", 2, 0);
+	check(cache_index_lookup("/a/2", entry), "entry is not removed from another place");
+	cache_index_remove("/a/1", 1, 200);
+	for (int i = 0; i < 20000; i += 2)
+		cache_index_remove("/many/" + to_string(i), 3, i * 2);
+	bool all_found = true;
+	for (int i = 1; i < 20000; i += 2)
+		all_found = all_found && cache_index_lookup("/many/" + to_string(i), entry) && entry.body_length == i;
+	check(!cache_index_lookup("/a/1", entry) && cache_index_lookup("/a/2", entry) && all_found
+		&& cache_index_size() == 10001, "removal keeps the other entries reachable");
+
+	// An entry whose key is that of the URL but whose second hash isn't, as if another URL collided with it
+	string index_path = string(directory) + "/index";
+	int index_fd = open(index_path.c_str(), O_RDWR);
+	string index_bytes(lseek(index_fd, 0, SEEK_END), 0);
+	pread(index_fd, &index_bytes[0], index_bytes.size(), 0);
+	uint64_t key = cache_url_hash("/a/2");
+	size_t slot = index_bytes.find(string((const char *)&key, sizeof(key)));
+	uint64_t other_check = 12345;
+	pwrite(index_fd, &other_check, sizeof(other_check), slot + sizeof(key));
+	close(index_fd);
+	check(!cache_index_lookup("/a/2", entry), "entry of a colliding URL is not served");
+
+	unlink(index_path.c_str());
+	rmdir(directory);
+}
+
+// Stores a reply the way the request handler does: body, then head
+bool store_cached_reply(const string &url, const string &body)
+{
+	CacheSegmentWriter writer;
+	CacheIndexEntry entry;
+	bool shared_body;
+	string head = "HTTP/1.1 200 OK\r\n\r\n";
+	if (!writer.append(body.data(), body.size()) || !writer.finish_body(entry, shared_body)
+		|| !writer.append(head.data(), head.size()) || !writer.finish(entry.segment, entry.offset))
+		return false;
+	entry.head_length = head.size();
+	entry.stored_at = entry.last_access = entry.expires_at = time(NULL);
+	return cache_index_store(url, entry, shared_body);
+}
+
+string read_cached_body(const string &url)
+{
+	CacheIndexEntry entry;
+	if (!cache_index_lookup(url, entry))
+		return "";
+	int fd = open_cache_segment(entry.body_segment);
+	string body(entry.body_length, 0);
+	bool read_all = fd >= 0 && pread(fd, &body[0], body.size(), entry.body_offset) == (ssize_t)body.size();
+	close(fd);
+	return read_all ? body : "";
+}
+
+void test_cache_store()
+{
+	char directory[] = "/tmp/cache_store_testXXXXXX";
+	check(mkdtemp(directory) != NULL, "temporary cache directory is created");
+	open_cache_index(directory);
+	start_cache_store(directory, 4096);
+
+	{
+		CacheSegmentWriter aborted;
+		aborted.append("partial", 7);
+	}
+	check(store_cached_reply("/one", "first body") && store_cached_reply("/two", "second body"),
+		"replies are appended");
+	check(read_cached_body("/one") == "first body" && read_cached_body("/two") == "second body",
+		"replies are read back from their offsets");
+	CacheIndexEntry one, two;
+	cache_index_lookup("/one", one);
+	cache_index_lookup("/two", two);
+	check(one.body_segment == two.body_segment && one.body_offset == 0
+		&& two.body_offset == one.body_length + one.head_length && one.offset == one.body_length,
+		"aborted reply leaves no bytes behind");
+
+	// Identical bodies are stored once
+	uint64_t usage = cache_store_disk_usage();
+	check(store_cached_reply("/two-mirror", "second body"), "reply with a stored body is added");
+	CacheIndexEntry mirror;
+	cache_index_lookup("/two-mirror", mirror);
+	check(mirror.body_segment == two.body_segment && mirror.body_offset == two.body_offset
+		&& cache_store_disk_usage() == usage + mirror.head_length, "identical body is shared");
+	check(cache_index_body_references(two) == 2 && read_cached_body("/two-mirror") == "second body",
+		"shared body counts its references");
+	store_cached_reply("/two-other", "second bodY");
+	check(read_cached_body("/two-other") == "second bodY" && cache_index_body_references(two) == 2,
+		"different bodies are not shared");
+
+	// Filling the first segment seals it, replacing its replies makes it garbage
+	check(store_cached_reply("/big", string(5000, 'x')), "reply larger than a segment is appended");
+	store_cached_reply("/big", "small");
+	store_cached_reply("/one", "first body, replaced");
+	compact_cache_segments();
+	CacheIndexEntry moved;
+	cache_index_lookup("/two", moved);
+	check(moved.body_segment != two.body_segment && read_cached_body("/two") == "second body",
+		"live reply is moved out of a compacted segment");
+	cache_index_lookup("/two-mirror", mirror);
+	check(mirror.body_segment == moved.body_segment && mirror.body_offset == moved.body_offset
+		&& cache_index_body_references(moved) == 2 && read_cached_body("/two-mirror") == "second body",
+		"shared body is moved once");
+	check(read_cached_body("/one") == "first body, replaced" && read_cached_body("/big") == "small",
+		"replaced replies are kept");
+	struct stat st;
+	check(stat((string(directory) + "/segment-" + to_string(two.body_segment)).c_str(), &st) != 0,
+		"compacted segment is deleted");
+
+	// Over the quota of entries, the janitor keeps the popular ones
+	for (int i = 0; i < 20; i++)
+		store_cached_reply("/n" + to_string(i), "body " + to_string(i));
+	for (int i = 0; i < 5; i++)
+		record_cache_request("/n0");
+	sleep(1);
+	check(run_cache_janitor(1 << 30, 10) > 0 && cache_index_size() <= 9, "janitor evicts down to the quota");
+	check(read_cached_body("/n0") == "body 0", "popular reply is not evicted");
+	check(run_cache_janitor(1 << 30, 10) == 0, "janitor leaves a cache within its quota alone");
+
+	// Replies stored after a round outrank smaller ones not asked for since before it
+	for (int i = 0; i < 10; i++)
+		store_cached_reply("/later" + to_string(i), "larger body of reply " + to_string(i));
+	run_cache_janitor(1 << 30, 10);
+	int old_left = 0, later_left = 0;
+	CacheIndexEntry left;
+	for (int i = 1; i < 20; i++)
+		old_left += cache_index_lookup("/n" + to_string(i), left);
+	for (int i = 0; i < 10; i++)
+		later_left += cache_index_lookup("/later" + to_string(i), left);
+	check(old_left == 0 && later_left == 8, "replies not asked for since an earlier round are evicted first");
+
+	FILE *orphan = fopen((string(directory) + "/aB3xY9qZ").c_str(), "w");
+	fclose(orphan);
+	check(remove_orphaned_cache_files() == 1 && cache_index_size() > 0, "only orphaned files are removed");
+
+	system(("rm -rf " + string(directory)).c_str());
+}
+
+HttpHeader make_response_header(const string &status, const string &headers)
+{
+	HttpHeader header;
+	parse_http_header("HTTP/1.1 " + status + "\r\n" + headers + "\r\n", header);
+	return header;
+}
+
+void test_cache_policy()
+{
+	check(parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT") == 784111777
+		&& parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT") == 784111777
+		&& parse_http_date("Sun Nov  6 08:49:37 1994") == 784111777, "all three HTTP-date formats are parsed");
+	check(parse_http_date("yesterday") == -1, "invalid date is rejected");
+
+	time_t now = 784111777;
+	string date = "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n";
+	check(response_expiry_time(make_response_header("200 OK", date + "Cache-Control: public, max-age=60\r\n"), now) == now + 60,
+		"max-age sets the lifetime");
+	check(response_expiry_time(make_response_header("200 OK", date + "Cache-Control: max-age=60, s-maxage=600\r\n"), now) == now + 600,
+		"s-maxage takes precedence over max-age");
+	check(response_expiry_time(make_response_header("200 OK", date + "Expires: Sun, 06 Nov 1994 09:49:37 GMT\r\n"), now) == now + 3600,
+		"Expires is relative to Date");
+	check(response_expiry_time(make_response_header("200 OK", date + "Cache-Control: max-age=60\r\nAge: 50\r\n"), now) == now + 10,
+		"Age is subtracted");
+	check(response_expiry_time(make_response_header("200 OK", date + "Last-Modified: Sat, 05 Nov 1994 08:49:37 GMT\r\n"), now) == now + 8640,
+		"heuristic lifetime is a tenth of the time since Last-Modified");
+
+	check(!is_response_cacheable("GET", make_response_header("200 OK", date + "Cache-Control: no-store\r\n"), now), "no-store is not cached");
+	check(!is_response_cacheable("GET", make_response_header("200 OK", date + "Cache-Control: private, max-age=60\r\n"), now), "private is not cached");
+	check(!is_response_cacheable("GET", make_response_header("200 OK", date), now), "reply without lifetime or validator is not cached");
+	check(!is_response_cacheable("GET", make_response_header("304 Not Modified", date + "ETag: \"x\"\r\n"), now), "304 is not cached");
+	HttpHeader no_cache = make_response_header("200 OK", date + "Cache-Control: no-cache\r\nETag: \"v1\"\r\n");
+	check(is_response_cacheable("GET", no_cache, now) && response_expiry_time(no_cache, now) == now,
+		"no-cache with a validator is cached stale");
+
+	HttpHeader request = make_response_header("200 OK", "");
+	check(add_revalidation_headers(no_cache, request) && request.headers["If-None-Match"] == "\"v1\"",
+		"ETag is sent as If-None-Match");
+	merge_not_modified_headers(no_cache, make_response_header("304 Not Modified", "Cache-Control: max-age=30\r\nContent-Length: 0\r\n"));
+	check(no_cache.headers["Cache-Control"] == "max-age=30" && no_cache.headers.count("Content-Length") == 0,
+		"304 headers update the cached reply");
+
+	check(gzip_etag("\"v1\"") == "\"v1-gzip\"" && gzip_etag("W/\"v1\"") == "W/\"v1-gzip\"", "gzip encoding gets its own tag");
+	check(identity_etag("\"v1-gzip\"") == "\"v1\"" && identity_etag(" \"v1\" ") == "\"v1\"",
+		"decoding restores the original tag");
+	HttpHeader gzipped = make_response_header("200 OK", "Content-Encoding: gzip\r\nETag: \"v1-gzip\"\r\n");
+	request = make_response_header("200 OK", "");
+	check(add_revalidation_headers(gzipped, request) && request.headers["If-None-Match"] == "\"v1-gzip\", \"v1\"",
+		"revalidation of a gzip encoding asks about the original tag too");
+	merge_not_modified_headers(gzipped, make_response_header("304 Not Modified", "ETag: \"v1\"\r\n"));
+	check(gzipped.headers["ETag"] == "\"v1-gzip\"", "304 for the original tag keeps the tag of the encoding");
+	merge_not_modified_headers(gzipped, make_response_header("304 Not Modified", "ETag: \"v2\"\r\n"));
+	check(gzipped.headers["ETag"] == "\"v2\"", "304 with another tag replaces it");
+
+	HttpHeader lenient = make_response_header("200 OK", "Cache-Control: max-age=60, stale-while-revalidate=5\r\n");
+	check(stale_serving_limit(lenient, 1000, "stale-while-revalidate", 30) == 1005, "stale-while-revalidate sets the window");
+	check(stale_serving_limit(lenient, 1000, "stale-if-error", 30) == 1030, "default window applies without the directive");
+	HttpHeader strict = make_response_header("200 OK", "Cache-Control: max-age=60, must-revalidate, stale-if-error=60\r\n");
+	check(stale_serving_limit(strict, 1000, "stale-if-error", 30) == 1000, "must-revalidate forbids serving stale");
+}
+
+// Body handed out in fixed pieces
+class PiecesBodyStream : public BodyStream {
+public:
+	PiecesBodyStream(const vector<string> &pieces) : pieces(pieces), next(0) {}
+
+	ssize_t read(string &out)
+	{
+		if (next == pieces.size())
+			return 0;
+		out += pieces[next];
+		return pieces[next++].size();
+	}
+
+private:
+	vector<string> pieces;
+	size_t next;
+};
+
+void test_shared_fetch()
+{
+	SharedFetch leader;
+	SharedFetch follower;
+	check(leader.join("/example.test/shared"), "first miss leads the fetch");
+	check(!follower.join("/example.test/shared"), "second miss follows it");
+
+	HttpHeader header;
+	header.status = "200 OK";
+	BodyStream *leader_body = leader.publish(header, false, new PiecesBodyStream({ "first ", "second" }));
+
+	HttpHeader shared_header;
+	bool length_known = true;
+	BodyStream *follower_body = NULL;
+	check(follower.wait(shared_header, length_known, follower_body) && follower_body != NULL
+		&& shared_header.status == "200 OK" && !length_known, "follower gets the published reply");
+
+	string leader_copy, follower_copy;
+	check(leader_body->read(leader_copy) == 6 && follower_body->read(follower_copy) == 6 && follower_copy == "first ",
+		"follower reads pieces as the leader reads them");
+	while (leader_body->read(leader_copy) > 0) {}
+	while (follower_body->read(follower_copy) > 0) {}
+	check(leader_copy == "first second" && follower_copy == leader_copy, "follower gets the whole body");
+
+	SharedFetch late;
+	check(late.join("/example.test/shared"), "a finished fetch is not joined");
+	delete follower_body;
+	delete leader_body;
+
+	SharedFetch idle_leader;
+	SharedFetch busy_follower;
+	idle_leader.join("/example.test/idle");
+	busy_follower.join("/example.test/idle");
+	BodyStream *idle_body = idle_leader.publish(header, false, new PiecesBodyStream({ "one ", "two" }));
+	busy_follower.wait(shared_header, length_known, follower_body);
+	string busy_copy;
+	while (follower_body->read(busy_copy) > 0) {}
+	string idle_copy;
+	while (idle_body->read(idle_copy) > 0) {}
+	check(busy_copy == "one two" && idle_copy == busy_copy, "follower reads on while the leader doesn't");
+	delete follower_body;
+	delete idle_body;
+
+	SharedFetch other_follower;
+	{
+		SharedFetch other_leader;
+		other_leader.join("/example.test/other");
+		other_follower.join("/example.test/other");
+	}
+	HttpHeader unused;
+	BodyStream *no_body = NULL;
+	check(!other_follower.wait(unused, length_known, no_body) && no_body == NULL,
+		"follower of an abandoned fetch goes on by itself");
+	SharedFetch other;
+	check(other.join("/example.test/other"), "an abandoned fetch is not joined");
+
+	// A follower that never reads holds the leader up only for a while, then the buffer stays bounded
+	configure_shared_fetch(100);
+	SharedFetch big_leader;
+	SharedFetch stalled;
+	big_leader.join("/example.test/big");
+	stalled.join("/example.test/big");
+	vector<string> big_pieces(10, string(1 << 20, 'x'));
+	BodyStream *big_body = big_leader.publish(header, true, new PiecesBodyStream(big_pieces));
+	BodyStream *stalled_body = NULL;
+	stalled.wait(shared_header, length_known, stalled_body);
+	string big_copy;
+	time_t started = time(NULL);
+	while (big_body->read(big_copy) > 0) {}
+	check(big_copy.size() == 10 << 20 && time(NULL) - started < 5, "leader reads on past a stalled follower");
+	string stalled_copy;
+	check(stalled_body->read(stalled_copy) == -1 && stalled_copy.empty(), "follower that fell behind is detached");
+	delete stalled_body;
+	delete big_body;
+	configure_shared_fetch(30000);
+}
+
+void test_compressed_bodies()
+{
+	string text;
+	for (int i = 0; i < 2000; i++)
+		text += "compressible text " + to_string(i % 10) + "\n";
+	vector<string> pieces;
+	for (size_t offset = 0; offset < text.size(); offset += 1000)
+		pieces.push_back(text.substr(offset, 1000));
+
+	string compressed;
+	GzipBodyStream gzip(new PiecesBodyStream(pieces));
+	while (gzip.read(compressed) > 0) {}
+	check(compressed.size() > 2 && compressed.size() < text.size() / 4 && compressed[0] == '\x1f' && compressed[1] == '\x8b',
+		"body is gzip-compressed");
+
+	string decoded;
+	InflateBodyStream inflate(new MemoryBodyStream(make_shared<const string>(compressed)), true);
+	while (inflate.read(decoded) > 0) {}
+	check(decoded == text, "compressed body decodes to the original");
+
+	string first_piece;
+	GzipBodyStream flushed(new PiecesBodyStream(pieces));
+	flushed.read(first_piece);
+	string first_decoded;
+	InflateBodyStream first_inflate(new MemoryBodyStream(make_shared<const string>(first_piece)), true);
+	first_inflate.read(first_decoded);
+	check(first_decoded == pieces[0], "every piece is handed out compressed as it comes");
+
+	HttpHeader request;
+	request.headers["Accept-Encoding"] = "deflate, gzip;q=0.8";
+	check(accepts_encoding(request, "gzip"), "gzip with a weight is accepted");
+	request.headers["Accept-Encoding"] = "gzip;q=0, *";
+	check(!accepts_encoding(request, "gzip"), "gzip with q=0 is refused");
+	request.headers["Accept-Encoding"] = "br, *";
+	check(accepts_encoding(request, "gzip"), "wildcard accepts gzip");
+	request.headers.erase("Accept-Encoding");
+	check(!accepts_encoding(request, "gzip"), "no Accept-Encoding means identity");
+}
+
+/*
+ Stub target server for the request tests: every request gets a cacheable
+ reply of 5 bytes, without its body for HEAD.
+*/
+int origin_stub_socket;
+int origin_stub_requests = 0;
+
+void* run_origin_stub(void *arg)
+{
+	int client;
+	while ((client = accept(origin_stub_socket, NULL, NULL)) >= 0) {
+		string received;
+		char buffer[4096];
+		ssize_t length;
+		while ((length = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+			received.append(buffer, length);
+			size_t end;
+			while ((end = received.find("\r\n\r\n")) != string::npos) {
+				bool head = received.compare(0, 5, "HEAD ") == 0;
+				received.erase(0, end + 4);
+				__sync_fetch_and_add(&origin_stub_requests, 1);
+				string reply = "HTTP/1.1 200 OK\r\nContent-Length: 5\r\nCache-Control: max-age=60\r\n\r\n";
+				if (!head)
+					reply += "hello";
+				send(client, reply.data(), reply.size(), 0);
+			}
+		}
+		close(client);
+	}
+	return NULL;
+}
+
+// Sends the request through the proxy, and returns the head and body of its reply
+string proxy_request(const string &method, const string &path, string &body)
+{
+	HttpMessage request;
+	request.header.type = HttpHeader::REQUEST;
+	request.header.method = method;
+	request.header.path = path;
+	request.header.protocol = "HTTP/1.1";
+	HostInfo client;
+	client.hostname = "127.0.0.1";
+	client.port = 0;
+	client.socket_fd = -1;
+
+	ClientResponse *response = process_client_request(request, client);
+	string head = response->head;
+	body = response->body_fd >= 0 ? string() : response->memory_body();
+	if (response->body_fd >= 0) {
+		body.resize(response->body_length);
+		pread(response->body_fd, &body[0], body.size(), response->body_offset);
+	}
+	if (response->body_stream != NULL)
+		while (response->body_stream->read(body) > 0) {}
+	delete response;
+	return head;
+}
+
+void test_request_methods()
+{
+	origin_stub_socket = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t address_length = sizeof(address);
+	bind(origin_stub_socket, (struct sockaddr *)&address, sizeof(address));
+	listen(origin_stub_socket, 16);
+	getsockname(origin_stub_socket, (struct sockaddr *)&address, &address_length);
+	pthread_t stub_thread;
+	pthread_create(&stub_thread, NULL, run_origin_stub, NULL);
+	pthread_detach(stub_thread);
+	string origin = "/127.0.0.1:" + to_string(ntohs(address.sin_port));
+
+	string body;
+	string head = proxy_request("HEAD", origin + "/head-first", body);
+	check(head.find("Content-Length: 5") != string::npos && body.empty() && origin_stub_requests == 1,
+		"HEAD reply has no body");
+	proxy_request("GET", origin + "/head-first", body);
+	check(body == "hello" && origin_stub_requests == 2, "GET after HEAD is not served the HEAD reply");
+	proxy_request("GET", origin + "/head-first", body);
+	check(body == "hello" && origin_stub_requests == 2, "GET reply is cached");
+	head = proxy_request("HEAD", origin + "/head-first", body);
+	check(head.find("200 OK") != string::npos && body.empty() && origin_stub_requests == 2,
+		"HEAD is answered by the cached GET reply, without its body");
+
+	proxy_request("POST", origin + "/posted", body);
+	proxy_request("GET", origin + "/posted", body);
+	check(body == "hello" && origin_stub_requests == 4, "POST reply is not served to GET");
+	proxy_request("POST", origin + "/head-first", body);
+	check(origin_stub_requests == 5, "POST is not served from the cache");
+
+	char directory[] = "/tmp/blocked_origin_testXXXXXX";
+	mkdtemp(directory);
+	write_file(string(directory) + "/blocklist.txt", "127.0.0.1\n");
+	write_file(string(directory) + "/words.txt", "");
+	load_filter_lists(string(directory) + "/blocklist.txt", string(directory) + "/words.txt");
+	head = proxy_request("GET", origin + "/head-first", body);
+	check(head.find("401") != string::npos && origin_stub_requests == 5, "a blocked host isn't served from the cache");
+	system(("rm -rf " + string(directory)).c_str());
+}
+
+/*
+ Stub nameserver for the resolver tests: "example.test" has two A records with
+ a TTL of 1 second and one AAAA record, every other name is NXDOMAIN with a
+ negative TTL of 60 seconds. "big.test" has three A records, which only fit
+ into a reply over TCP, and "slow.test" is answered after 100 ms.
+*/
+int dns_stub_socket;
+int dns_stub_tcp_socket;
+int dns_stub_queries = 0;
+int dns_stub_tcp_queries = 0;
+
+void append_record_header(string &packet, uint16_t type, uint32_t ttl, uint16_t length)
+{
+	const unsigned char header[] = { 0xC0, 0x0C, (unsigned char)(type >> 8), (unsigned char)type, 0, 1,
+		(unsigned char)(ttl >> 24), (unsigned char)(ttl >> 16), (unsigned char)(ttl >> 8), (unsigned char)ttl,
+		(unsigned char)(length >> 8), (unsigned char)length };
+	packet.append((const char *)header, sizeof(header));
+}
+
+string dns_stub_reply(const string &query, bool over_tcp)
+{
+	string packet = query;
+	size_t length = query.size();
+	uint16_t type = ((unsigned char)query[length - 4] << 8) | (unsigned char)query[length - 3];
+	bool big = packet.find("\x03" "big" "\x04" "test") != string::npos;
+	bool slow = packet.find("\x04" "slow" "\x04" "test") != string::npos;
+	bool known = big || slow || packet.find("\x07" "example" "\x04" "test") != string::npos;
+	if (slow)
+		usleep(100000);
+
+	packet[2] = (char)0x81;
+	packet[3] = known ? (char)0x80 : (char)0x83;
+	packet[7] = 0;
+	packet[9] = 0;
+	if (!known) {
+		// SOA with MINIMUM = 60 in the authority section
+		packet[9] = 1;
+		append_record_header(packet, 6, 3600, 22);
+		packet.append("\x00\x00", 2);
+		packet.append(16, '\0');
+		packet.append("\x00\x00\x00\x3c", 4);
+	} else if (type == 1) {
+		packet[7] = big && !over_tcp ? 1 : 2;
+		if (big && !over_tcp)
+			packet[2] = (char)0x83;
+		append_record_header(packet, 1, 1, 4);
+		packet.append("\x0a\x00\x00\x01", 4);
+		if (!big || over_tcp) {
+			append_record_header(packet, 1, 1, 4);
+			packet.append("\x0a\x00\x00\x02", 4);
+		}
+		if (big && over_tcp) {
+			packet[7] = 3;
+			append_record_header(packet, 1, 1, 4);
+			packet.append("\x0a\x00\x00\x03", 4);
+		}
+	} else {
+		packet[7] = 1;
+		append_record_header(packet, 28, 60, 16);
+		packet.append("\x20\x01\x0d\xb8", 4);
+		packet.append(11, '\0');
+		packet.append("\x01", 1);
+	}
+	return packet;
+}
+
+void* run_dns_stub(void *arg)
+{
+	char query[512];
+	struct sockaddr_in client;
+	socklen_t client_length = sizeof(client);
+	ssize_t length;
+	while ((length = recvfrom(dns_stub_socket, query, sizeof(query), 0, (struct sockaddr *)&client, &client_length)) > 0) {
+		__sync_fetch_and_add(&dns_stub_queries, 1);
+		string packet = dns_stub_reply(string(query, length), false);
+		sendto(dns_stub_socket, packet.data(), packet.size(), 0, (struct sockaddr *)&client, client_length);
+	}
+	return NULL;
+}
+
+void* run_dns_tcp_stub(void *arg)
+{
+	int client;
+	while ((client = accept(dns_stub_tcp_socket, NULL, NULL)) >= 0) {
+		__sync_fetch_and_add(&dns_stub_tcp_queries, 1);
+		unsigned char prefix[2];
+		char query[512];
+		if (recv(client, prefix, 2, MSG_WAITALL) == 2) {
+			size_t length = prefix[0] << 8 | prefix[1];
+			if (length <= sizeof(query) && recv(client, query, length, MSG_WAITALL) == (ssize_t)length) {
+				string packet = dns_stub_reply(string(query, length), true);
+				string message;
+				message += (char)(packet.size() >> 8);
+				message += (char)(packet.size() & 0xFF);
+				message += packet;
+				send(client, message.data(), message.size(), MSG_NOSIGNAL);
+			}
+		}
+		close(client);
+	}
+	return NULL;
+}
+
+void* resolve_slow_test(void *arg)
+{
+	vector<IpAddress> addresses;
+	*(bool *)arg = resolve_hostname("slow.test", addresses) && addresses.size() == 3;
+	return NULL;
+}
+
+void test_dns_resolver()
+{
+	dns_stub_socket = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(dns_stub_socket, (struct sockaddr *)&address, sizeof(address));
+	socklen_t address_length = sizeof(address);
+	getsockname(dns_stub_socket, (struct sockaddr *)&address, &address_length);
+
+	pthread_t stub_thread;
+	pthread_create(&stub_thread, NULL, run_dns_stub, NULL);
+	pthread_detach(stub_thread);
+
+	// The TCP side listens on the same port
+	dns_stub_tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
+	bind(dns_stub_tcp_socket, (struct sockaddr *)&address, sizeof(address));
+	listen(dns_stub_tcp_socket, 4);
+	pthread_create(&stub_thread, NULL, run_dns_tcp_stub, NULL);
+	pthread_detach(stub_thread);
+
+	configure_dns_resolver("127.0.0.1:" + to_string(ntohs(address.sin_port)), 500);
+	clear_dns_cache();
+
+	vector<IpAddress> addresses;
+	check(resolve_hostname("example.test", addresses), "example.test resolves");
+	check(addresses.size() == 3, "all A and AAAA records are returned");
+	check(addresses.size() == 3 && addresses[0].to_string() == "10.0.0.1" && addresses[1].to_string() == "10.0.0.2"
+		&& addresses[2].to_string() == "2001:db8::1", "IPv4 addresses come first");
+	check(dns_stub_queries == 2, "A and AAAA are queried once");
+
+	check(resolve_hostname("EXAMPLE.test.", addresses) && dns_stub_queries == 2, "answer is served from the cache");
+
+	sleep(2);
+	check(resolve_hostname("example.test", addresses) && dns_stub_queries == 4, "answer is queried again after its TTL");
+
+	check(!resolve_hostname("missing.test", addresses) && dns_stub_queries == 6, "NXDOMAIN fails the lookup");
+	check(!resolve_hostname("missing.test", addresses) && dns_stub_queries == 6, "NXDOMAIN is cached negatively");
+
+	check(resolve_hostname("192.168.1.1", addresses) && addresses.size() == 1 && dns_stub_queries == 6,
+		"IP literals are not queried");
+
+	check(resolve_hostname("big.test", addresses) && addresses.size() == 4 && dns_stub_tcp_queries == 1,
+		"truncated reply is asked again over TCP");
+	check(addresses.size() == 4 && addresses[2].to_string() == "10.0.0.3", "records from TCP are returned");
+
+	pthread_t lookups[4];
+	bool resolved[4];
+	int queries_before = dns_stub_queries;
+	for (int i = 0; i < 4; i++)
+		pthread_create(&lookups[i], NULL, resolve_slow_test, &resolved[i]);
+	for (int i = 0; i < 4; i++)
+		pthread_join(lookups[i], NULL);
+	check(resolved[0] && resolved[1] && resolved[2] && resolved[3], "concurrent lookups of a name all resolve");
+	check(dns_stub_queries - queries_before == 2, "concurrent lookups of a name share one query");
+
+	shutdown(dns_stub_tcp_socket, SHUT_RDWR);
+	clear_dns_cache();
+	check(!resolve_hostname("big.test", addresses), "truncated reply fails the lookup without TCP");
+	queries_before = dns_stub_queries;
+	check(!resolve_hostname("big.test", addresses) && dns_stub_queries == queries_before + 2,
+		"truncated reply is not cached");
+}
+
+// Worker pool tasks record the order they ran in; gated ones hold their worker until the gate opens
+pthread_mutex_t pool_test_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_test_cond = PTHREAD_COND_INITIALIZER;
+vector<int> pool_test_runs;
+bool pool_test_gate_open[2];
+int pool_test_gates_held = 0;
+int pool_test_running = 0;
+int pool_test_max_running = 0;
+
+struct PoolTestTask {
+	int number;
+	int gate;	// -1 for none
+};
+
+void* submit_pool_test_task(void *arg)
+{
+	PoolTestTask task = *(PoolTestTask *)arg;
+	delete (PoolTestTask *)arg;
+	run_on_worker_pool([task]() {
+		pthread_mutex_lock(&pool_test_mutex);
+		pool_test_max_running = max(pool_test_max_running, ++pool_test_running);
+		if (task.gate >= 0) {
+			pool_test_gates_held++;
+			pthread_cond_broadcast(&pool_test_cond);
+			while (!pool_test_gate_open[task.gate])
+				pthread_cond_wait(&pool_test_cond, &pool_test_mutex);
+		}
+		pool_test_runs.push_back(task.number);
+		pool_test_running--;
+		pthread_cond_broadcast(&pool_test_cond);
+		pthread_mutex_unlock(&pool_test_mutex);
+	});
+	return NULL;
+}
+
+pthread_t start_pool_test_task(int number, int gate=-1)
+{
+	pthread_t thread;
+	pthread_create(&thread, NULL, submit_pool_test_task, new PoolTestTask{ number, gate });
+	return thread;
+}
+
+// Waits until as many tasks are queued, ran and hold a gate, or a while has passed
+void wait_for_pool_test(int queued, size_t runs, int gates_held)
+{
+	for (int i = 0; i < 200; i++) {
+		pthread_mutex_lock(&pool_test_mutex);
+		bool reached = pool_test_runs.size() >= runs && pool_test_gates_held >= gates_held;
+		pthread_mutex_unlock(&pool_test_mutex);
+		if (reached && worker_pool_queued_tasks() >= queued)
+			return;
+		usleep(10000);
+	}
+}
+
+void open_pool_test_gate(int gate)
+{
+	pthread_mutex_lock(&pool_test_mutex);
+	pool_test_gate_open[gate] = true;
+	pthread_cond_broadcast(&pool_test_cond);
+	pthread_mutex_unlock(&pool_test_mutex);
+}
+
+void test_worker_pool()
+{
+	start_worker_pool(2, 4);
+
+	// Both workers held, so the submitted tasks queue up to the cap
+	vector<pthread_t> threads;
+	threads.push_back(start_pool_test_task(100, 0));
+	threads.push_back(start_pool_test_task(101, 1));
+	wait_for_pool_test(0, 0, 2);
+	for (int i = 0; i < 10; i++)
+		threads.push_back(start_pool_test_task(i));
+	wait_for_pool_test(4, 0, 2);
+	usleep(100000);
+	check(worker_pool_queued_tasks() == 4, "tasks beyond the queue depth wait for a slot");
+	open_pool_test_gate(0);
+	open_pool_test_gate(1);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	vector<int> runs = pool_test_runs;
+	sort(runs.begin(), runs.end());
+	vector<int> expected;
+	for (int i = 0; i < 10; i++)
+		expected.push_back(i);
+	expected.push_back(100);
+	expected.push_back(101);
+	check(runs == expected, "every task ran exactly once");
+	check(pool_test_max_running <= 2, "no more tasks run at once than there are workers");
+
+	// With one worker let go, it takes its own tasks newest first, then steals the other's oldest first
+	threads.clear();
+	pool_test_runs.clear();
+	pool_test_gates_held = 0;
+	pool_test_gate_open[0] = pool_test_gate_open[1] = false;
+	threads.push_back(start_pool_test_task(200, 0));
+	threads.push_back(start_pool_test_task(201, 1));
+	wait_for_pool_test(0, 0, 2);
+	for (int i = 1; i <= 4; i++) {
+		threads.push_back(start_pool_test_task(i));
+		wait_for_pool_test(i, 0, 2);
+	}
+	open_pool_test_gate(0);
+	wait_for_pool_test(0, 5, 2);
+	pthread_mutex_lock(&pool_test_mutex);
+	vector<int> order(pool_test_runs.begin() + 1, pool_test_runs.end());
+	pthread_mutex_unlock(&pool_test_mutex);
+	check(order == vector<int>({ 3, 1, 2, 4 }) || order == vector<int>({ 4, 2, 1, 3 }),
+		"owner pops its newest task, thief steals the oldest");
+	open_pool_test_gate(1);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+
+	bool rethrown = false;
+	try {
+		run_on_worker_pool([]() { throw runtime_error("task failed"); });
+	} catch (const runtime_error &) {
+		rethrown = true;
+	}
+	check(rethrown, "exception of a task is rethrown in the submitter");
+}
+
 int main()
 {
 	test_split();
 	test_split_all();
-}
\ No newline at end of file
+	test_word_filter();
+	test_host_blocklist();
+	test_filter_lists();
+	test_filter_lists_stress();
+	test_http_parser();
+	test_chunked_bodies();
+	test_memory_cache();
+	test_cache_admission();
+	test_cache_index();
+	test_cache_store();
+	test_cache_policy();
+	test_shared_fetch();
+	test_compressed_bodies();
+	test_request_methods();
+	test_dns_resolver();
+	test_worker_pool();
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,310 @@
+#include "word_filter.h"
+
+#include <immintrin.h>
+
+// Marks the rows of states where a word ends, rows are multiples of two
+const uint32_t OUTPUT_FLAG = 1;
+const char CENSORED_REPLACEMENT[] = "CENSORED";
+const int CANDIDATE_GROUPS = 8;     // bits of a nibble mask
+
+void make_candidate_byte_set(const bool members[256], CandidateByteSet &set)
+{
+    // High nibbles with the same low nibbles share a bit, the last bit takes
+    // in all the high nibbles that don't get their own
+    uint16_t low_nibbles[16] = { 0 };
+    for (int b = 0; b < 256; b++) {
+        set.exact[b] = members[b];
+        if (members[b])
+            low_nibbles[b >> 4] |= 1 << (b & 15);
+    }
+
+    std::vector<uint16_t> groups;
+    memset(set.low_nibble_masks, 0, sizeof(set.low_nibble_masks));
+    memset(set.high_nibble_masks, 0, sizeof(set.high_nibble_masks));
+    for (int high = 0; high < 16; high++) {
+        if (low_nibbles[high] == 0)
+            continue;
+        size_t group = std::find(groups.begin(), groups.end(), low_nibbles[high]) - groups.begin();
+        if (group == groups.size() && groups.size() < CANDIDATE_GROUPS)
+            groups.push_back(low_nibbles[high]);
+        group = std::min(group, (size_t)CANDIDATE_GROUPS - 1);
+        if (group == CANDIDATE_GROUPS - 1)
+            groups[group] |= low_nibbles[high];
+        set.high_nibble_masks[high] |= 1 << group;
+    }
+    for (size_t group = 0; group < groups.size(); group++) {
+        for (int low = 0; low < 16; low++) {
+            if (groups[group] & (1 << low))
+                set.low_nibble_masks[low] |= 1 << group;
+        }
+    }
+}
+
+size_t scan_candidate_bytes(const unsigned char *text, size_t from, size_t length, const CandidateByteSet &set)
+{
+    while (from < length && !set.exact[text[from]])
+        from++;
+    return from;
+}
+
+__attribute__((target("ssse3")))
+static size_t scan_candidate_bytes_ssse3(const unsigned char *text, size_t from, size_t length,
+                                         const CandidateByteSet &set)
+{
+    __m128i low_masks = _mm_loadu_si128((const __m128i *)set.low_nibble_masks);
+    __m128i high_masks = _mm_loadu_si128((const __m128i *)set.high_nibble_masks);
+    __m128i nibble = _mm_set1_epi8(0x0f);
+    for (; from + 16 <= length; from += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(text + from));
+        __m128i low = _mm_shuffle_epi8(low_masks, _mm_and_si128(bytes, nibble));
+        __m128i high = _mm_shuffle_epi8(high_masks, _mm_and_si128(_mm_srli_epi16(bytes, 4), nibble));
+        __m128i outside = _mm_cmpeq_epi8(_mm_and_si128(low, high), _mm_setzero_si128());
+        uint32_t candidates = ~_mm_movemask_epi8(outside) & 0xffff;
+        if (candidates != 0)
+            return from + __builtin_ctz(candidates);
+    }
+    return scan_candidate_bytes(text, from, length, set);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_candidate_bytes_avx2(const unsigned char *text, size_t from, size_t length,
+                                        const CandidateByteSet &set)
+{
+    __m256i low_masks = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set.low_nibble_masks));
+    __m256i high_masks = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)set.high_nibble_masks));
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    for (; from + 32 <= length; from += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(text + from));
+        __m256i low = _mm256_shuffle_epi8(low_masks, _mm256_and_si256(bytes, nibble));
+        __m256i high = _mm256_shuffle_epi8(high_masks, _mm256_and_si256(_mm256_srli_epi16(bytes, 4), nibble));
+        __m256i outside = _mm256_cmpeq_epi8(_mm256_and_si256(low, high), _mm256_setzero_si256());
+        uint32_t candidates = ~(uint32_t)_mm256_movemask_epi8(outside);
+        if (candidates != 0)
+            return from + __builtin_ctz(candidates);
+    }
+    return scan_candidate_bytes_ssse3(text, from, length, set);
+}
+
+CandidateScanner select_candidate_scanner()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return scan_candidate_bytes_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return scan_candidate_bytes_ssse3;
+    return scan_candidate_bytes;
+}
+
+WordFilter::WordFilter(const std::vector<std::string> &word_list)
+    : scan_word_starts(select_candidate_scanner()), class_shift(1), words(0), longest_word(0)
+{
+    // Class 0 is for the bytes no word contains
+    memset(byte_class, 0, sizeof(byte_class));
+    int class_count = 1;
+    for (size_t i = 0; i < word_list.size(); i++) {
+        for (size_t j = 0; j < word_list[i].size(); j++) {
+            unsigned char c = tolower((unsigned char)word_list[i][j]);
+            if (byte_class[c] == 0)
+                byte_class[c] = class_count++;
+        }
+    }
+    for (int c = 'A'; c <= 'Z'; c++)
+        byte_class[c] = byte_class[tolower(c)];
+    while ((1 << class_shift) < class_count)
+        class_shift++;
+    size_t width = (size_t)1 << class_shift;
+
+    // Trie of the words, 0 stands for a missing child as the root is nobody's child
+    std::vector<uint32_t> next_states(width, 0);
+    outputs.assign(1, StateOutput());
+    for (size_t i = 0; i < word_list.size(); i++) {
+        if (word_list[i].empty())
+            continue;
+        uint32_t state = 0;
+        for (size_t j = 0; j < word_list[i].size(); j++) {
+            size_t slot = state * width + byte_class[tolower((unsigned char)word_list[i][j])];
+            if (next_states[slot] == 0) {
+                next_states[slot] = outputs.size();
+                outputs.push_back(StateOutput());
+                next_states.resize(next_states.size() + width, 0);
+            }
+            state = next_states[slot];
+        }
+        outputs[state].length = word_list[i].size();
+        longest_word = std::max(longest_word, word_list[i].size());
+        words++;
+    }
+
+    // Breadth first, the state of the longest proper suffix of every state is
+    // done before it, and its missing children become transitions of that state
+    std::vector<uint32_t> suffix_states(outputs.size(), 0);
+    std::vector<uint32_t> queue;
+    for (size_t c = 0; c < width; c++) {
+        if (next_states[c] != 0)
+            queue.push_back(next_states[c]);
+    }
+    for (size_t i = 0; i < queue.size(); i++) {
+        uint32_t state = queue[i];
+        uint32_t suffix = suffix_states[state];
+        outputs[state].next = outputs[suffix].length > 0 ? suffix : outputs[suffix].next;
+        for (size_t c = 0; c < width; c++) {
+            uint32_t &child = next_states[state * width + c];
+            if (child != 0) {
+                suffix_states[child] = next_states[suffix * width + c];
+                queue.push_back(child);
+            } else {
+                child = next_states[suffix * width + c];
+            }
+        }
+    }
+
+    transitions.resize(next_states.size());
+    for (size_t i = 0; i < next_states.size(); i++) {
+        uint32_t state = next_states[i];
+        bool has_output = outputs[state].length > 0 || outputs[state].next != 0;
+        transitions[i] = (state << class_shift) | (has_output ? OUTPUT_FLAG : 0);
+    }
+
+    bool starts[256];
+    for (int b = 0; b < 256; b++)
+        starts[b] = b == '<' || transitions[byte_class[b]] != 0;
+    make_candidate_byte_set(starts, word_starts);
+}
+
+void WordFilter::scan(const unsigned char *bytes, size_t length, uint64_t offset, ScanState &state,
+                      std::vector<Match> &matches) const
+{
+    const uint32_t *table = &transitions[0];
+    uint8_t space_class = byte_class[(unsigned char)' '];
+    uint32_t row = state.row;
+    bool in_tag = state.in_tag;
+    size_t i = 0;
+    while (i < length) {
+        // Tags are matched as spaces up to the '>' closing them; words don't
+        // end with a space, so only the state after the spaces matters
+        if (in_tag) {
+            const unsigned char *tag_end = (const unsigned char *)memchr(bytes + i, '>', length - i);
+            size_t end = tag_end != NULL ? tag_end - bytes : length;
+            for (; i < end && table[(row & ~OUTPUT_FLAG) + space_class] != row; i++)
+                row = table[(row & ~OUTPUT_FLAG) + space_class];
+            i = end;
+            in_tag = tag_end == NULL;
+            continue;
+        }
+
+        // In the root state, the bytes that can't start a word keep it there
+        if (row == 0 && !word_starts.exact[bytes[i]]) {
+            i = scan_word_starts(bytes, i, length, word_starts);
+            if (i == length)
+                break;
+        }
+        if (bytes[i] == '<') {
+            in_tag = true;
+            continue;
+        }
+
+        row = table[(row & ~OUTPUT_FLAG) + byte_class[bytes[i]]];
+        if (row & OUTPUT_FLAG) {
+            for (uint32_t state = row >> class_shift; state != 0; state = outputs[state].next) {
+                if (outputs[state].length > 0)
+                    matches.push_back(Match(offset + i + 1 - outputs[state].length, outputs[state].length));
+            }
+        }
+        i++;
+    }
+    state.row = row;
+    state.in_tag = in_tag;
+}
+
+static bool is_leftmost_longest(const std::pair<uint64_t, size_t> &a, const std::pair<uint64_t, size_t> &b)
+{
+    return a.first < b.first || (a.first == b.first && a.second > b.second);
+}
+
+/**
+ * Appends the text from `copied` up to `settled` to `out`, with the matches
+ * starting before `settled` replaced, the leftmost then longest first, and
+ * removes those matches. `text` starts at offset `copied` of the whole text.
+ * Returns where the copy ends, past `settled` if a match goes on beyond it.
+ */
+static uint64_t copy_censored(const char *text, uint64_t copied, uint64_t settled,
+                              std::vector<std::pair<uint64_t, size_t> > &matches, std::string &out)
+{
+    std::sort(matches.begin(), matches.end(), is_leftmost_longest);
+    uint64_t text_start = copied;
+    size_t i = 0;
+    for (; i < matches.size() && matches[i].first < settled; i++) {
+        if (matches[i].first < copied)
+            continue;
+        out.append(text + (copied - text_start), matches[i].first - copied);
+        out.append(CENSORED_REPLACEMENT);
+        copied = matches[i].first + matches[i].second;
+    }
+    matches.erase(matches.begin(), matches.begin() + i);
+    if (copied < settled) {
+        out.append(text + (copied - text_start), settled - copied);
+        copied = settled;
+    }
+    return copied;
+}
+
+std::string WordFilter::censor(const std::string &text) const
+{
+    std::vector<Match> matches;
+    ScanState state = { 0, false };
+    scan((const unsigned char *)text.data(), text.size(), 0, state, matches);
+    if (matches.empty())
+        return text;
+
+    std::string result;
+    result.reserve(text.size());
+    copy_censored(text.data(), 0, text.size(), matches, result);
+    return result;
+}
+
+WordFilterStream::WordFilterStream(const std::shared_ptr<const WordFilter> &filter)
+    : filter(filter), pending_start(0)
+{
+    state.row = 0;
+    state.in_tag = false;
+}
+
+void WordFilterStream::write(const char *data, size_t length, std::string &out)
+{
+    uint64_t offset = pending_start + pending.size();
+    filter->scan((const unsigned char *)data, length, offset, state, matches);
+    pending.append(data, length);
+
+    // Later matches end after this piece, none starts more than a word before its end
+    uint64_t end = offset + length;
+    size_t lookbehind = filter->max_word_length() > 0 ? filter->max_word_length() - 1 : 0;
+    if (end > pending_start + lookbehind)
+        hand_out(end - lookbehind, out);
+}
+
+void WordFilterStream::finish(std::string &out)
+{
+    hand_out(pending_start + pending.size(), out);
+}
+
+void WordFilterStream::hand_out(uint64_t settled, std::string &out)
+{
+    uint64_t copied = copy_censored(pending.data(), pending_start, settled, matches, out);
+    pending.erase(0, copied - pending_start);
+    pending_start = copied;
+}
+
+bool read_filter_words(const std::string &filename, std::vector<std::string> &words)
+{
+    std::ifstream is(filename.c_str());
+    if (!is.is_open())
+        return false;
+    std::string line;
+    while (std::getline(is, line)) {
+        std::string word = trim(line);
+        std::transform(word.begin(), word.end(), word.begin(), ::tolower);
+        if (!word.empty())
+            words.push_back(word);
+    }
+    return true;
+}
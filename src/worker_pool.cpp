@@ -0,0 +1,165 @@
+#include "worker_pool.h"
+#include "utils.h"
+
+#include <deque>
+#include <exception>
+
+struct PoolTask {
+    std::function<void()> function;
+    std::exception_ptr error;
+
+    bool done;
+    pthread_mutex_t done_mutex;
+    pthread_cond_t done_cond;
+};
+
+struct WorkerDeque {
+    pthread_mutex_t mutex;
+    std::deque<PoolTask*> tasks;
+};
+
+static std::vector<WorkerDeque*> worker_deques;
+static int max_queued_tasks = 0;
+
+// Guards queued_tasks and next_deque; idle workers and blocked submitters sleep on it
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tasks_available_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_space_cond = PTHREAD_COND_INITIALIZER;
+static int queued_tasks = 0;
+static size_t next_deque = 0;
+
+// Index of the worker running on the current thread, -1 for non-worker threads
+static __thread int current_worker = -1;
+
+// The owner takes the newest task (still hot in its cache), thieves take the oldest
+static PoolTask* take_task(int worker)
+{
+    PoolTask *task = NULL;
+    for (size_t i = 0; i < worker_deques.size() && task == NULL; i++) {
+        WorkerDeque *deque = worker_deques[(worker + i) % worker_deques.size()];
+        pthread_mutex_lock(&deque->mutex);
+        if (!deque->tasks.empty()) {
+            if (i == 0) {
+                task = deque->tasks.back();
+                deque->tasks.pop_back();
+            } else {
+                task = deque->tasks.front();
+                deque->tasks.pop_front();
+            }
+        }
+        pthread_mutex_unlock(&deque->mutex);
+    }
+
+    if (task != NULL) {
+        pthread_mutex_lock(&pool_mutex);
+        queued_tasks--;
+        pthread_cond_signal(&queue_space_cond);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    return task;
+}
+
+static void complete_task(PoolTask *task)
+{
+    try {
+        task->function();
+    } catch (...) {
+        task->error = std::current_exception();
+    }
+
+    pthread_mutex_lock(&task->done_mutex);
+    task->done = true;
+    pthread_cond_signal(&task->done_cond);
+    pthread_mutex_unlock(&task->done_mutex);
+}
+
+static void* run_worker(void *arg)
+{
+    current_worker = (int)(long)arg;
+
+    while (true) {
+        PoolTask *task = take_task(current_worker);
+        if (task != NULL) {
+            complete_task(task);
+            continue;
+        }
+
+        // A task may be counted before it lands in a deque, so only sleep when none is queued
+        pthread_mutex_lock(&pool_mutex);
+        while (queued_tasks == 0)
+            pthread_cond_wait(&tasks_available_cond, &pool_mutex);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+    return NULL;
+}
+
+void start_worker_pool(int threads, int max_queued)
+{
+    max_queued_tasks = max_queued;
+
+    for (int i = 0; i < threads; i++) {
+        WorkerDeque *deque = new WorkerDeque();
+        pthread_mutex_init(&deque->mutex, NULL);
+        worker_deques.push_back(deque);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        pthread_t worker_thread;
+        if (pthread_create(&worker_thread, NULL, run_worker, (void *)(long)i) != 0)
+            print_error_and_die("Error while spawning worker pool thread");
+        pin_thread_to_core(worker_thread, i);
+        pthread_detach(worker_thread);
+    }
+
+    std::stringstream ss;
+    ss << "Started worker pool with " << threads << " thread(s), queue depth " << max_queued;
+    log(ss.str());
+}
+
+void run_on_worker_pool(const std::function<void()> &function)
+{
+    if (worker_deques.empty() || current_worker >= 0) {
+        function();
+        return;
+    }
+
+    PoolTask task;
+    task.function = function;
+    task.done = false;
+    pthread_mutex_init(&task.done_mutex, NULL);
+    pthread_cond_init(&task.done_cond, NULL);
+
+    pthread_mutex_lock(&pool_mutex);
+    while (queued_tasks >= max_queued_tasks)
+        pthread_cond_wait(&queue_space_cond, &pool_mutex);
+    queued_tasks++;
+    WorkerDeque *deque = worker_deques[next_deque++ % worker_deques.size()];
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_mutex_lock(&deque->mutex);
+    deque->tasks.push_back(&task);
+    pthread_mutex_unlock(&deque->mutex);
+
+    pthread_mutex_lock(&pool_mutex);
+    pthread_cond_signal(&tasks_available_cond);
+    pthread_mutex_unlock(&pool_mutex);
+
+    pthread_mutex_lock(&task.done_mutex);
+    while (!task.done)
+        pthread_cond_wait(&task.done_cond, &task.done_mutex);
+    pthread_mutex_unlock(&task.done_mutex);
+
+    pthread_mutex_destroy(&task.done_mutex);
+    pthread_cond_destroy(&task.done_cond);
+
+    if (task.error)
+        std::rethrow_exception(task.error);
+}
+
+int worker_pool_queued_tasks()
+{
+    pthread_mutex_lock(&pool_mutex);
+    int queued = queued_tasks;
+    pthread_mutex_unlock(&pool_mutex);
+    return queued;
+}